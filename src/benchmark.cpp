@@ -0,0 +1,400 @@
+#include "benchmark.hpp"
+
+/// \brief      A replayed frame waiting to be searched
+struct benchmarkFrame {
+    int index;
+    int64 captureTick;
+    Mat image;
+};
+
+/// \brief      The outcome of searching a frame, waiting to be pooled
+struct benchmarkDetection {
+    int index;
+    int64 captureTick;
+    bool found;
+    vector<Point2f> corners;
+};
+
+/// \brief      Lets the last detection thread to finish close the result queue
+struct benchmarkWorkers {
+    boost::mutex countMutex;
+    int active;
+};
+
+benchmarkSettings::benchmarkSettings() :
+    imageSize(DEFAULT_BENCHMARK_WIDTH, DEFAULT_BENCHMARK_HEIGHT),
+    patternSize(12, 8),
+    patternFinderCode(MASK_FINDER_CODE),
+    correctionFactor(DEFAULT_CORRECTION_FACTOR),
+    frameRate(DEFAULT_BENCHMARK_FPS),
+    duration(DEFAULT_BENCHMARK_DURATION),
+    clipLength(DEFAULT_BENCHMARK_CLIP_LENGTH),
+    queueLength(DEFAULT_STREAM_QUEUE_LENGTH)
+{
+}
+
+benchmarkResult::benchmarkResult() :
+    threads(0),
+    framesOffered(0),
+    framesDropped(0),
+    framesProcessed(0),
+    patternsPooled(0),
+    sustainedRate(0.0),
+    meanIngestDepth(0.0),
+    meanResultDepth(0.0),
+    maxIngestDepth(0),
+    maxResultDepth(0),
+    latencyP50(0.0),
+    latencyP90(0.0),
+    latencyP99(0.0),
+    latencyMax(0.0)
+{
+}
+
+void renderSyntheticBoard(Size imageSize, Size patternSize, int patternFinderCode, double phase, Mat& frame)
+{
+    int squareSize = DEFAULT_BENCHMARK_SQUARE_SIZE;
+
+    Mat board;
+
+    if (patternFinderCode == MASK_FINDER_CODE)
+    {
+        // Separate black squares, one square apart, with a one square white border (the mask finder
+        // counts the pattern in squares and searches for twice as many corners, see findMaskCorners_1)
+        int rows, cols, quant;
+        determinePatchDistribution(Size(2 * patternSize.width, 2 * patternSize.height), 1, rows, cols, quant);
+
+        board = Mat(squareSize * (2 * rows + 1), squareSize * (2 * cols + 1), CV_8UC1, Scalar(255));
+
+        for (int iii = 0; iii < rows; iii++)
+        {
+            for (int jjj = 0; jjj < cols; jjj++)
+            {
+                Point topLeft(squareSize * (2 * jjj + 1), squareSize * (2 * iii + 1));
+                rectangle(board, topLeft, topLeft + Point(squareSize - 1, squareSize - 1), Scalar(0), CV_FILLED);
+            }
+        }
+    }
+    else
+    {
+        // A regular chessboard with the requested number of inner corners, plus a one square white border
+        int rows = patternSize.height + 1, cols = patternSize.width + 1;
+
+        board = Mat(squareSize * (rows + 2), squareSize * (cols + 2), CV_8UC1, Scalar(255));
+
+        for (int iii = 0; iii < rows; iii++)
+        {
+            for (int jjj = 0; jjj < cols; jjj++)
+            {
+                if ((iii + jjj) % 2 == 0)
+                {
+                    Point topLeft(squareSize * (jjj + 1), squareSize * (iii + 1));
+                    rectangle(board, topLeft, topLeft + Point(squareSize - 1, squareSize - 1), Scalar(0), CV_FILLED);
+                }
+            }
+        }
+    }
+
+    // The board drifts around the frame, rotating and tilting, so every frame needs a fresh search
+    double angle = 2.0 * PI * phase;
+    double scale = 0.55 * min(double(imageSize.width) / board.cols, double(imageSize.height) / board.rows) * (1.0 + 0.15 * sin(2.0 * angle));
+    double rotation = 0.25 * sin(3.0 * angle);
+    double tilt = 0.12 * sin(angle);
+
+    Point2f centre(float(imageSize.width * (0.5 + 0.12 * sin(angle))), float(imageSize.height * (0.5 + 0.10 * sin(2.0 * angle))));
+
+    Point2f source[4], destination[4];
+
+    source[0] = Point2f(0.0f, 0.0f);
+    source[1] = Point2f(float(board.cols), 0.0f);
+    source[2] = Point2f(float(board.cols), float(board.rows));
+    source[3] = Point2f(0.0f, float(board.rows));
+
+    for (int iii = 0; iii < 4; iii++)
+    {
+        double dx = (source[iii].x - board.cols / 2.0) * scale;
+        double dy = (source[iii].y - board.rows / 2.0) * scale;
+
+        // Shrinking one side relative to the other gives a perspective tilt
+        double depth = (dx < 0.0) ? (1.0 - tilt) : (1.0 + tilt);
+        dy *= depth;
+
+        destination[iii].x = float(centre.x + dx * cos(rotation) - dy * sin(rotation));
+        destination[iii].y = float(centre.y + dx * sin(rotation) + dy * cos(rotation));
+    }
+
+    Mat homography = getPerspectiveTransform(source, destination);
+
+    Mat greyFrame;
+    warpPerspective(board, greyFrame, homography, imageSize, INTER_LINEAR, BORDER_CONSTANT, Scalar(160));
+
+    Mat noise(imageSize, CV_16SC1);
+    randn(noise, Scalar(0), Scalar(DEFAULT_BENCHMARK_NOISE));
+
+    Mat noisyFrame;
+    greyFrame.convertTo(noisyFrame, CV_16SC1);
+    noisyFrame += noise;
+    noisyFrame.convertTo(greyFrame, CV_8UC1);
+
+    if (patternFinderCode == HEATED_CHESSBOARD_FINDER_CODE)
+    {
+        // Heated squares appear bright, so the finder inverts the frame back again
+        bitwise_not(greyFrame, greyFrame);
+    }
+
+    // Decoded video is 3-channel, so replay it that way
+    cvtColor(greyFrame, frame, CV_GRAY2BGR);
+}
+
+void renderSyntheticClip(const benchmarkSettings& settings, vector<Mat>& clip)
+{
+    clip.resize(max(settings.clipLength, 1));
+
+    for (unsigned int iii = 0; iii < clip.size(); iii++)
+    {
+        renderSyntheticBoard(settings.imageSize, settings.patternSize, settings.patternFinderCode, double(iii) / clip.size(), clip.at(iii));
+    }
+}
+
+bool detectBenchmarkPattern(const Mat& image, const benchmarkSettings& settings, vector<Point2f>& corners)
+{
+    Mat sourceMat, invertedMat;
+
+    switch (settings.patternFinderCode)
+    {
+    case MASK_FINDER_CODE:
+        return findMaskCorners_1(image, settings.patternSize, corners, settings.mserParams, settings.correctionFactor, PATTERN_FINDER_CV_CORNER_SUBPIX_FLAG);
+    case HEATED_CHESSBOARD_FINDER_CODE:
+        // Replayed frames are shared between passes, so invert a copy
+        sourceMat = image.clone();
+        invertMatIntensities(sourceMat, invertedMat);
+        return findChessboardCorners(invertedMat, settings.patternSize, corners);
+    default:
+        return findChessboardCorners(image, settings.patternSize, corners);
+    }
+}
+
+static void ingestStage(const benchmarkSettings *settings, const vector<Mat> *clip, boundedQueue<benchmarkFrame> *outputQueue, int *framesOffered, int *framesDropped)
+{
+    int totalFrames = max(int(settings->duration * settings->frameRate), 1);
+    double framePeriod = getTickFrequency() / settings->frameRate;
+
+    int64 startTick = getTickCount();
+
+    for (int iii = 0; iii < totalFrames; iii++)
+    {
+        // Frames are offered on a fixed schedule, whether or not the pipeline is keeping up
+        int64 dueTick = startTick + int64(iii * framePeriod);
+        int64 now = getTickCount();
+
+        if (dueTick > now)
+        {
+            boost::this_thread::sleep(boost::posix_time::microseconds(int64(double(dueTick - now) * 1000000.0 / getTickFrequency())));
+        }
+
+        benchmarkFrame frame;
+        frame.index = iii;
+        frame.image = clip->at(iii % clip->size());
+        frame.captureTick = getTickCount();
+
+        (*framesOffered)++;
+
+        // A camera will not wait, so a full queue means the frame is lost
+        if (!outputQueue->tryPush(frame))
+        {
+            (*framesDropped)++;
+        }
+    }
+
+    outputQueue->close();
+}
+
+static void detectionStage(const benchmarkSettings *settings, boundedQueue<benchmarkFrame> *inputQueue, boundedQueue<benchmarkDetection> *outputQueue, benchmarkWorkers *workers)
+{
+    benchmarkFrame frame;
+
+    while (inputQueue->pop(frame))
+    {
+        benchmarkDetection detection;
+        detection.index = frame.index;
+        detection.captureTick = frame.captureTick;
+        detection.found = detectBenchmarkPattern(frame.image, *settings, detection.corners);
+
+        if (!outputQueue->push(detection))
+        {
+            break;
+        }
+    }
+
+    boost::mutex::scoped_lock lock(workers->countMutex);
+
+    if (--workers->active == 0)
+    {
+        outputQueue->close();
+    }
+}
+
+static double percentile(const vector<double>& sortedValues, double fraction)
+{
+    if (sortedValues.size() == 0)
+    {
+        return 0.0;
+    }
+
+    int position = min(int(fraction * sortedValues.size()), int(sortedValues.size()) - 1);
+
+    return sortedValues.at(position);
+}
+
+void runBenchmarkPass(const benchmarkSettings& settings, const vector<Mat>& clip, int threads, benchmarkResult& result)
+{
+    result = benchmarkResult();
+    result.threads = threads;
+
+    boundedQueue<benchmarkFrame> ingestQueue(settings.queueLength);
+    boundedQueue<benchmarkDetection> resultQueue(settings.queueLength);
+
+    benchmarkWorkers workers;
+    workers.active = threads;
+
+    boost::thread_group detectors;
+
+    for (int iii = 0; iii < threads; iii++)
+    {
+        detectors.create_thread(boost::bind(detectionStage, &settings, &ingestQueue, &resultQueue, &workers));
+    }
+
+    int64 startTick = getTickCount();
+
+    boost::thread ingestThread(ingestStage, &settings, &clip, &ingestQueue, &result.framesOffered, &result.framesDropped);
+
+    // Pooling stays on the calling thread, and samples the queue depths each time a result arrives
+    vector<vector<Point2f> > pooledCorners;
+    vector<double> latencies;
+
+    double ingestDepthSum = 0.0, resultDepthSum = 0.0;
+
+    int64 lastTick = startTick;
+
+    benchmarkDetection detection;
+
+    while (resultQueue.pop(detection))
+    {
+        int ingestDepth = ingestQueue.size();
+        int resultDepth = resultQueue.size();
+
+        ingestDepthSum += ingestDepth;
+        resultDepthSum += resultDepth;
+        result.maxIngestDepth = max(result.maxIngestDepth, ingestDepth);
+        result.maxResultDepth = max(result.maxResultDepth, resultDepth);
+
+        if (detection.found)
+        {
+            pooledCorners.push_back(detection.corners);
+        }
+
+        lastTick = getTickCount();
+        latencies.push_back(double(lastTick - detection.captureTick) * 1000.0 / getTickFrequency());
+    }
+
+    ingestThread.join();
+    detectors.join_all();
+
+    result.framesProcessed = (int) latencies.size();
+    result.patternsPooled = (int) pooledCorners.size();
+
+    double elapsed = double(lastTick - startTick) / getTickFrequency();
+    result.sustainedRate = (elapsed > 0.0) ? (result.framesProcessed / elapsed) : 0.0;
+
+    if (result.framesProcessed > 0)
+    {
+        result.meanIngestDepth = ingestDepthSum / result.framesProcessed;
+        result.meanResultDepth = resultDepthSum / result.framesProcessed;
+    }
+
+    sort(latencies.begin(), latencies.end());
+
+    result.latencyP50 = percentile(latencies, 0.50);
+    result.latencyP90 = percentile(latencies, 0.90);
+    result.latencyP99 = percentile(latencies, 0.99);
+    result.latencyMax = latencies.empty() ? 0.0 : latencies.back();
+}
+
+void printScalingTable(const benchmarkSettings& settings, const vector<benchmarkResult>& results)
+{
+    printf("%s << Sustained throughput at %.1f fps offered (%d x %d, pattern finder %d, queue length %d):\n", __FUNCTION__, settings.frameRate, settings.imageSize.width, settings.imageSize.height, settings.patternFinderCode, settings.queueLength);
+    printf("%s << threads | offered | dropped (%%) |   fps   | speedup | pooled | ingest q (mean/max) | result q (mean/max) | latency ms p50 / p90 / p99 / max\n", __FUNCTION__);
+
+    double baseRate = results.empty() ? 0.0 : results.at(0).sustainedRate;
+
+    for (unsigned int iii = 0; iii < results.size(); iii++)
+    {
+        const benchmarkResult& row = results.at(iii);
+
+        double dropFraction = (row.framesOffered > 0) ? (100.0 * row.framesDropped / row.framesOffered) : 0.0;
+        double speedup = (baseRate > 0.0) ? (row.sustainedRate / baseRate) : 0.0;
+
+        printf("%s << %7d | %7d | %5d (%5.1f) | %7.2f | %7.2f | %6d | %8.2f / %-8d | %8.2f / %-8d | %7.1f / %7.1f / %7.1f / %7.1f\n",
+               __FUNCTION__,
+               row.threads,
+               row.framesOffered,
+               row.framesDropped,
+               dropFraction,
+               row.sustainedRate,
+               speedup,
+               row.patternsPooled,
+               row.meanIngestDepth,
+               row.maxIngestDepth,
+               row.meanResultDepth,
+               row.maxResultDepth,
+               row.latencyP50,
+               row.latencyP90,
+               row.latencyP99,
+               row.latencyMax);
+    }
+}
+
+int runThroughputBenchmark(const benchmarkSettings& settings, int maxThreads)
+{
+    printf("%s << Rendering %d synthetic frames...\n", __FUNCTION__, settings.clipLength);
+
+    vector<Mat> clip;
+    renderSyntheticClip(settings, clip);
+
+    // Each detection thread runs single-threaded, so that the thread count is the only thing that varies
+    int previousThreads = getNumThreads();
+    setNumThreads(1);
+
+    vector<benchmarkResult> results;
+
+    int fewestThreads = -1;
+
+    for (int threads = 1; threads <= max(maxThreads, 1); threads++)
+    {
+        printf("%s << Replaying %.1fs of capture with %d detection thread(s)...\n", __FUNCTION__, settings.duration, threads);
+
+        benchmarkResult result;
+        runBenchmarkPass(settings, clip, threads, result);
+        results.push_back(result);
+
+        if ((fewestThreads < 0) && (result.framesDropped == 0))
+        {
+            fewestThreads = threads;
+        }
+    }
+
+    setNumThreads(previousThreads);
+
+    printScalingTable(settings, results);
+
+    if (fewestThreads > 0)
+    {
+        printf("%s << %d detection thread(s) sustain %.1f fps without dropping frames.\n", __FUNCTION__, fewestThreads, settings.frameRate);
+    }
+    else
+    {
+        printf("%s << WARNING. Frames were dropped with up to %d detection thread(s); %.1f fps cannot be sustained.\n", __FUNCTION__, max(maxThreads, 1), settings.frameRate);
+    }
+
+    return fewestThreads;
+}
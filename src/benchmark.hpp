@@ -0,0 +1,92 @@
+/*! \file	benchmark.hpp
+ *  \brief	Header file for the end-to-end throughput benchmark (synthetic board video).
+ *
+ * A short clip of a moving board is rendered up front and then replayed at a fixed frame rate, the way
+ * a live capture would deliver it: frames that arrive while the ingest queue is full are dropped rather
+ * than waited for. A pool of detection threads searches each frame for the pattern and the calling
+ * thread pools whatever corners are found, as the calibrator does with its candidates. The run is
+ * repeated for 1..N detection threads, giving a scaling table that can be used to size hardware.
+ */
+
+#ifndef BENCHMARK_HPP
+#define BENCHMARK_HPP
+
+#include "calibration.hpp"
+#include "streaming.hpp"
+
+#include <algorithm>
+
+using namespace std;
+using namespace cv;
+
+#define DEFAULT_BENCHMARK_FPS           30.0
+#define DEFAULT_BENCHMARK_DURATION      10.0    // seconds of capture replayed for each thread count
+#define DEFAULT_BENCHMARK_CLIP_LENGTH   60      // distinct frames rendered before replay starts
+#define DEFAULT_BENCHMARK_WIDTH         640
+#define DEFAULT_BENCHMARK_HEIGHT        480
+#define DEFAULT_BENCHMARK_SQUARE_SIZE   40      // pixels per square on the unwarped board
+#define DEFAULT_BENCHMARK_NOISE         4.0     // standard deviation of added sensor noise
+
+/// \brief      What to replay and how to search it
+struct benchmarkSettings {
+    Size imageSize;
+    Size patternSize;
+    int patternFinderCode;
+    mserParameterGroup mserParams;
+    double correctionFactor;
+    /// \brief		Rate at which frames are offered to the pipeline
+    double frameRate;
+    /// \brief		Seconds of capture replayed for each thread count
+    double duration;
+    /// \brief		Number of distinct synthetic frames (replayed cyclically)
+    int clipLength;
+    /// \brief		Capacity of the queues between stages
+    unsigned int queueLength;
+
+    /// \brief 		Default Constructor.
+    benchmarkSettings();
+};
+
+/// \brief      Measurements from one pass of the pipeline with a fixed number of detection threads
+struct benchmarkResult {
+    int threads;
+    int framesOffered;
+    int framesDropped;
+    int framesProcessed;
+    int patternsPooled;
+    /// \brief		Frames per second carried all the way through to the pool
+    double sustainedRate;
+    double meanIngestDepth;
+    double meanResultDepth;
+    int maxIngestDepth;
+    int maxResultDepth;
+    /// \brief		Capture-to-pool latencies in ms
+    double latencyP50;
+    double latencyP90;
+    double latencyP99;
+    double latencyMax;
+
+    /// \brief 		Default Constructor.
+    benchmarkResult();
+};
+
+/// \brief      Draws the board for the given pattern finder, posed according to a phase in [0, 1)
+void renderSyntheticBoard(Size imageSize, Size patternSize, int patternFinderCode, double phase, Mat& frame);
+
+/// \brief      Renders the clip that each benchmark pass replays
+void renderSyntheticClip(const benchmarkSettings& settings, vector<Mat>& clip);
+
+/// \brief      Searches a single frame for the pattern, exactly as the calibrator's ingest loop does
+bool detectBenchmarkPattern(const Mat& image, const benchmarkSettings& settings, vector<Point2f>& corners);
+
+/// \brief      Replays the clip once through ingest, detection (with the given number of threads) and pooling
+void runBenchmarkPass(const benchmarkSettings& settings, const vector<Mat>& clip, int threads, benchmarkResult& result);
+
+/// \brief      Prints one row per thread count, with the speedup over a single thread
+void printScalingTable(const benchmarkSettings& settings, const vector<benchmarkResult>& results);
+
+/// \brief      Runs the benchmark for 1..maxThreads detection threads and prints the scaling table
+/// \return     The fewest threads that kept up with the frame rate without dropping frames, or -1 if none did
+int runThroughputBenchmark(const benchmarkSettings& settings, int maxThreads);
+
+#endif
@@ -1,5 +1,7 @@
 #include "calibration.hpp"
 
+#include <boost/thread/tss.hpp>
+
 mserParameterGroup::mserParameterGroup() {
 	delta = MSER_delta;
 	max_variation = MSER_max_variation;
@@ -142,7 +144,7 @@ mserPatch::mserPatch(vector<Point>& inputHull, const Mat& image)
     // get variance of pixel intensity
 }
 
-bool findMaskCorners_1(const Mat& image, Size patternSize, vector<Point2f>& corners, mserParameterGroup mserParams, double correctionFactor, int detector)
+bool findMaskCorners_1(const Mat& image, Size patternSize, vector<Point2f>& corners, mserParameterGroup mserParams, double correctionFactor, int detector, detectionRecord *record)
 {
 	
 	//printf("%s << correctionFactor = (%f)\n", __FUNCTION__, correctionFactor);
@@ -158,7 +160,7 @@ bool findMaskCorners_1(const Mat& image, Size patternSize, vector<Point2f>& corn
 	// Convert pattern size from squares to corners
 	Size cornersSize(2*patternSize.width, 2*patternSize.height);
 		
-    return findPatternCorners(grayIm, cornersSize, corners, 1, mserParams, correctionFactor, detector);
+    return findPatternCorners(grayIm, cornersSize, corners, 1, mserParams, correctionFactor, detector, record);
 }
 
 bool checkAcutance()
@@ -168,6 +170,97 @@ bool checkAcutance()
     return retVal;
 }
 
+bool prescreenPattern(const Mat& image, Size patternSize, int thumbnailWidth, int *blobCount)
+{
+    if (blobCount != NULL) *blobCount = 0;
+
+    if (image.empty() || (thumbnailWidth <= 0))
+    {
+        return true;
+    }
+
+    // The mask pattern is counted in squares, with one dark patch per square (see findMaskCorners_1)
+    int expectedPatches = patternSize.width * patternSize.height;
+
+    Mat grayIm, thumbnail;
+    if (image.channels() > 1) {
+        cvtColor(image, grayIm, CV_RGB2GRAY);
+    } else {
+        grayIm = image;
+    }
+
+    int thumbnailHeight = max(1, (thumbnailWidth * grayIm.rows) / max(grayIm.cols, 1));
+    resize(grayIm, thumbnail, Size(thumbnailWidth, thumbnailHeight), 0, 0, INTER_AREA);
+
+    // Dark patches relative to their surroundings, so uneven lighting does not matter
+    int blockSize = max(3, (thumbnailWidth / 8) | 1);
+    Mat binary;
+    adaptiveThreshold(thumbnail, binary, 255, CV_ADAPTIVE_THRESH_MEAN_C, CV_THRESH_BINARY_INV, blockSize, 5);
+
+    vector<vector<Point> > contours;
+    findContours(binary, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
+
+    if ((contours.size() < PRESCREEN_MIN_FRACTION * expectedPatches) || (contours.size() > PRESCREEN_MAX_FRACTION * expectedPatches))
+    {
+        if (blobCount != NULL) *blobCount = (int)contours.size();
+        return false;
+    }
+
+    // Patches on the board are all of a similar size, so measure everything against the median blob
+    vector<double> areas(contours.size());
+    vector<Point2f> centres(contours.size());
+
+    for (unsigned int iii = 0; iii < contours.size(); iii++)
+    {
+        Rect box = boundingRect(Mat(contours[iii]));
+        areas[iii] = max(double(box.area()), 1.0);
+        centres[iii] = Point2f(box.x + box.width / 2.0f, box.y + box.height / 2.0f);
+    }
+
+    vector<double> sortedAreas(areas);
+    nth_element(sortedAreas.begin(), sortedAreas.begin() + sortedAreas.size() / 2, sortedAreas.end());
+    double medianArea = sortedAreas[sortedAreas.size() / 2];
+
+    // Neighbouring patches are roughly two patch widths apart; count blobs with a neighbour at that kind of spacing
+    int plausible = 0;
+
+    for (unsigned int iii = 0; iii < contours.size(); iii++)
+    {
+        if ((areas[iii] < 0.25 * medianArea) || (areas[iii] > 4.0 * medianArea))
+        {
+            continue;
+        }
+
+        double nearest = -1.0;
+
+        for (unsigned int jjj = 0; jjj < contours.size(); jjj++)
+        {
+            if ((jjj == iii) || (areas[jjj] < 0.25 * medianArea) || (areas[jjj] > 4.0 * medianArea))
+            {
+                continue;
+            }
+
+            double dist = norm(centres[iii] - centres[jjj]);
+
+            if ((nearest < 0.0) || (dist < nearest))
+            {
+                nearest = dist;
+            }
+        }
+
+        double spacing = nearest / sqrt(areas[iii]);
+
+        if ((nearest > 0.0) && (spacing > 1.2) && (spacing < 4.0))
+        {
+            plausible++;
+        }
+    }
+
+    if (blobCount != NULL) *blobCount = plausible;
+
+    return (plausible >= PRESCREEN_MIN_FRACTION * expectedPatches);
+}
+
 void determinePatchDistribution(Size patternSize, int mode, int &rows, int &cols, int &quant)
 {
     if (mode == 0)
@@ -187,6 +280,7 @@ void determinePatchDistribution(Size patternSize, int mode, int &rows, int &cols
 
 void findAllPatches(const Mat& image, Size patternSize, vector<vector<Point> >& msers, mserParameterGroup mserParams)
 {
+    perfStageScope stageCounters(PERF_STAGE_FIND_ALL_PATCHES);
 
     //printf("%s << DEBUG {%d}{%d}\n", __FUNCTION__, 0, 0);
 
@@ -204,6 +298,14 @@ void findAllPatches(const Mat& image, Size patternSize, vector<vector<Point> >&
     Mat displayMat(image);
     Mat mask = Mat::ones(image.rows, image.cols, CV_8U);
 
+    // A per-camera mask (hand-drawn or learned) marks fixed clutter that would otherwise be re-extracted every frame
+    bool useMask = (!mserParams.mask.empty()) && (mserParams.mask.size() == image.size());
+
+    if (useMask)
+    {
+        mask = mserParams.mask;
+    }
+
     //printf("%s << DEBUG {%d}{%d}\n", __FUNCTION__, 0, 1);
 
     // 15
@@ -239,6 +341,12 @@ void findAllPatches(const Mat& image, Size patternSize, vector<vector<Point> >&
     //printf("%s << kernelSize = %d\n", __FUNCTION__, kernelSize);
     GaussianBlur(imGrey, imGrey, Size(kernelSize,kernelSize), 0,0);
 
+    if (useMask)
+    {
+        // Flattening the excluded pixels leaves nothing there for MSER to find, whether or not it honours the mask
+        imGrey.setTo(mean(imGrey, mask), mask == 0);
+    }
+
     //printf("%s << DEBUG {%d}{%d}\n", __FUNCTION__, 0, 3);
 
     //printf("%s << imGrey.size() = (%d,%d)\n", __FUNCTION__, imGrey.rows, imGrey.cols);
@@ -256,6 +364,37 @@ void findAllPatches(const Mat& image, Size patternSize, vector<vector<Point> >&
 
     //printf("%s << DEBUG {%d}{%d}\n", __FUNCTION__, 0, 4);
 
+    if (useMask)
+    {
+        // Anything centred on an excluded pixel is dropped before it reaches the filter chain
+        unsigned int kept = 0;
+
+        for (unsigned int i = 0; i < msers.size(); i++)
+        {
+            Point2f centre(0.0f, 0.0f);
+
+            for (unsigned int j = 0; j < msers[i].size(); j++)
+            {
+                centre.x += msers[i][j].x;
+                centre.y += msers[i][j].y;
+            }
+
+            centre *= 1.0f / max((int)msers[i].size(), 1);
+
+            if (mask.at<unsigned char>(int(centre.y), int(centre.x)) != 0)
+            {
+                if (kept != i)
+                {
+                    msers[kept].swap(msers[i]);
+                }
+
+                kept++;
+            }
+        }
+
+        msers.resize(kept);
+    }
+
     // Clean up MSER features by putting them in a convex hull
     for (unsigned int i = 0; i < msers.size(); i++)
     {
@@ -279,68 +418,1289 @@ void findAllPatches(const Mat& image, Size patternSize, vector<vector<Point> >&
     /*
     SURF surfExtractor();
 
-    vector<KeyPoint> surfs;
-    surfExtractor(imGrey, mask, surfs);
-    */
+    vector<KeyPoint> surfs;
+    surfExtractor(imGrey, mask, surfs);
+    */
+
+    if (DEBUG_MODE > 1)
+    {
+        printf("%s << Total patches found = %d\n", __FUNCTION__, (int)msers.size());
+    }
+}
+
+void randomCulling(vector<std::string> &inputList, int maxSearch)
+{
+
+    srand ( (unsigned int)(time(NULL)) );
+
+    int deletionIndex = 0;
+
+    while (inputList.size() > maxSearch)
+    {
+        deletionIndex = rand() % inputList.size();
+        inputList.erase(inputList.begin() + deletionIndex);
+    }
+}
+
+void randomCulling(vector<std::string> &inputList, int maxSearch, vector<vector<Point2f> >& patterns)
+{
+
+    srand ( (unsigned int)(time(NULL)) );
+
+    int deletionIndex = 0;
+
+    while (inputList.size() > maxSearch)
+    {
+        deletionIndex = rand() % inputList.size();
+        inputList.erase(inputList.begin() + deletionIndex);
+        patterns.erase(patterns.begin() + deletionIndex);
+    }
+}
+
+void randomCulling(vector<string>& inputList, int maxSearch, vector<vector<vector<Point2f> > >& patterns)
+{
+    srand ( (unsigned int)(time(NULL)) );
+
+    int deletionIndex = 0;
+
+    printf("%s << inputList.size() = %d / %d\n", __FUNCTION__, (int)inputList.size(), maxSearch);
+
+    while (inputList.size() > maxSearch)
+    {
+        deletionIndex = rand() % inputList.size();
+        inputList.erase(inputList.begin() + deletionIndex);
+
+        for (int i = 0; i < patterns.size(); i++)
+        {
+            patterns.at(i).erase(patterns.at(i).begin() + deletionIndex);
+        }
+
+    }
+
+    //printf("%s << patterns.at(i).size() = %d / %d\n", __FUNCTION__, patterns.at(0).size(), maxSearch);
+    //printf("%s << Waiting for key...\n", __FUNCTION__);
+    //cin.get();
+}
+
+patternQuality::patternQuality() :
+    latticeResidual(0.0),
+    subpixDisplacement(0.0),
+    sharpness(0.0),
+    margin(0.0),
+    score(0.0)
+{
+}
+
+selectionConvergence::selectionConvergence(int patience, double minRelativeGain, int minRounds) :
+    patienceRounds(patience),
+    minGain(minRelativeGain),
+    leastRounds(minRounds),
+    bestScore(DBL_MAX),
+    roundsSinceGain(0)
+{
+    stopReason[0] = '\0';
+}
+
+bool selectionConvergence::update(double roundScore)
+{
+    // Rounds where nothing could be scored (the selectors report 9e50) count as no gain, and stay out of the trend
+    if ((roundScore <= 0.0) || (roundScore > 1e49) || (roundScore != roundScore))
+    {
+        roundsSinceGain++;
+    }
+    else
+    {
+        history.push_back(roundScore);
+
+        if (roundScore < bestScore * (1.0 - minGain))
+        {
+            roundsSinceGain = 0;
+        }
+        else
+        {
+            roundsSinceGain++;
+        }
+
+        bestScore = min(bestScore, roundScore);
+    }
+
+    if ((patienceRounds <= 0) || ((int)history.size() < leastRounds) || (roundsSinceGain < patienceRounds))
+    {
+        return false;
+    }
+
+    // Least-squares slope (and its standard error) of the ERE over the most recent rounds
+    int window = min((int)history.size(), max(patienceRounds + 1, 3));
+    double meanX = (window - 1) / 2.0, meanY = 0.0;
+
+    for (int iii = 0; iii < window; iii++)
+    {
+        meanY += history[history.size() - window + iii] / window;
+    }
+
+    double Sxx = 0.0, Sxy = 0.0;
+
+    for (int iii = 0; iii < window; iii++)
+    {
+        Sxx += (iii - meanX) * (iii - meanX);
+        Sxy += (iii - meanX) * (history[history.size() - window + iii] - meanY);
+    }
+
+    double slope = Sxy / Sxx, residuals = 0.0;
+
+    for (int iii = 0; iii < window; iii++)
+    {
+        residuals += pow(history[history.size() - window + iii] - (meanY + slope * (iii - meanX)), 2);
+    }
+
+    double slopeError = (window > 2) ? sqrt(residuals / (window - 2) / Sxx) : 0.0;
+
+    // Even the most optimistic plausible trend would not beat the best ERE by a real margin within another patience of rounds
+    double optimisticSlope = min(0.0, slope - PLATEAU_TREND_CONFIDENCE * slopeError);
+
+    if (history.back() + optimisticSlope * patienceRounds < bestScore * (1.0 - minGain))
+    {
+        return false;
+    }
+
+    sprintf(stopReason, "no gain of %.1f%% on the best ERE (%f) in %d rounds, and the trend of the last %d (%+f per round) promises none",
+            100.0 * minGain, bestScore, roundsSinceGain, window, slope);
+
+    return true;
+}
+
+const char *selectionConvergence::reason() const
+{
+    return stopReason;
+}
+
+/// \brief      Accumulates lattice and verification statistics over one line of corners (a row or a column)
+static void measureCornerLine(vector<Point2f>& line, double& residualSum, int& residualCount, double& spacingSum, int& spacingCount, double& worstStraightness, double& worstFactor)
+{
+    for (unsigned int iii = 0; iii + 1 < line.size(); iii++)
+    {
+        spacingSum += distBetweenPts2f(line[iii], line[iii + 1]);
+        spacingCount++;
+    }
+
+    for (unsigned int iii = 0; iii + 2 < line.size(); iii++)
+    {
+        double dist1 = distBetweenPts2f(line[iii], line[iii + 1]);
+        double dist2 = distBetweenPts2f(line[iii + 1], line[iii + 2]);
+
+        if (min(dist1, dist2) <= 0.0)
+        {
+            worstFactor = max(worstFactor, double(QUALITY_MAX_SPACING_FACTOR));
+            continue;
+        }
+
+        // Second difference: zero for an evenly spaced lattice, and still small under perspective and lens distortion
+        Point2f secondDifference = line[iii] + line[iii + 2] - line[iii + 1] * 2.0f;
+        residualSum += norm(secondDifference) / (0.5 * (dist1 + dist2));
+        residualCount++;
+
+        worstStraightness = max(worstStraightness, perpDist(line[iii], line[iii + 1], line[iii + 2]));
+        worstFactor = max(worstFactor, max(dist1, dist2) / min(dist1, dist2));
+    }
+}
+
+patternQuality assessPatternQuality(const Mat& image, Size patternSize, const vector<Point2f>& corners)
+{
+    patternQuality quality;
+
+    if ((image.empty()) || (corners.size() != (unsigned int)(patternSize.width * patternSize.height)) || (patternSize.width < 3) || (patternSize.height < 3))
+    {
+        return quality;
+    }
+
+    Mat greyIm;
+    if (image.channels() > 1)
+    {
+        cvtColor(image, greyIm, CV_RGB2GRAY);
+    }
+    else
+    {
+        greyIm = image;
+    }
+
+    // LATTICE RESIDUAL AND VERIFICATION MARGINS (over every row and every column)
+    double residualSum = 0.0, spacingSum = 0.0;
+    int residualCount = 0, spacingCount = 0;
+    double worstStraightness = 0.0, worstFactor = 1.0;
+
+    vector<Point2f> line;
+
+    for (int i = 0; i < patternSize.height; i++)
+    {
+        line.clear();
+
+        for (int j = 0; j < patternSize.width; j++)
+        {
+            line.push_back(corners[i*patternSize.width + j]);
+        }
+
+        measureCornerLine(line, residualSum, residualCount, spacingSum, spacingCount, worstStraightness, worstFactor);
+    }
+
+    for (int j = 0; j < patternSize.width; j++)
+    {
+        line.clear();
+
+        for (int i = 0; i < patternSize.height; i++)
+        {
+            line.push_back(corners[i*patternSize.width + j]);
+        }
+
+        measureCornerLine(line, residualSum, residualCount, spacingSum, spacingCount, worstStraightness, worstFactor);
+    }
+
+    quality.latticeResidual = (residualCount > 0) ? residualSum / residualCount : 0.0;
+
+    double meanSpacing = (spacingCount > 0) ? spacingSum / spacingCount : 0.0;
+
+    // Distance from the limits that verifyPattern enforces (1 = ideal, 0 = only just accepted)
+    double straightnessUsed = worstStraightness / QUALITY_MAX_STRAIGHTNESS_DIST;
+    double factorUsed = (worstFactor - 1.0) / (QUALITY_MAX_SPACING_FACTOR - 1.0);
+    quality.margin = max(0.0, 1.0 - max(straightnessUsed, factorUsed));
+
+    // SUB-PIXEL STABILITY
+    // Corners of a crisp board barely move when refined again; blurred or misplaced ones wander
+    if (meanSpacing >= 4.0)
+    {
+        vector<Point2f> refined(corners);
+        int window = max(2, min(QUALITY_SUBPIX_WINDOW, int(meanSpacing / 4.0)));
+
+        cornerSubPix(greyIm, refined, Size(window, window), Size(-1, -1), TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 20, 0.01));
+
+        double displacementSum = 0.0;
+
+        for (unsigned int iii = 0; iii < corners.size(); iii++)
+        {
+            displacementSum += norm(refined[iii] - corners[iii]);
+        }
+
+        quality.subpixDisplacement = displacementSum / corners.size();
+    }
+
+    // EDGE SHARPNESS
+    // Mean gradient over the board relative to its contrast, so that it reflects focus and motion blur rather than exposure
+    Rect boardRect = boundingRect(Mat(corners)) & Rect(0, 0, greyIm.cols, greyIm.rows);
+
+    if (boardRect.area() > 0)
+    {
+        Mat boardIm = greyIm(boardRect);
+        Mat gradientX, gradientY, magnitude;
+
+        Sobel(boardIm, gradientX, CV_32F, 1, 0);
+        Sobel(boardIm, gradientY, CV_32F, 0, 1);
+        cv::magnitude(gradientX, gradientY, magnitude);
+
+        Scalar meanIntensity, stdDevIntensity;
+        meanStdDev(boardIm, meanIntensity, stdDevIntensity);
+
+        quality.sharpness = mean(magnitude)[0] / (stdDevIntensity[0] + 1.0);
+    }
+
+    quality.score = quality.margin
+                    * (quality.sharpness / (quality.sharpness + QUALITY_SHARPNESS_SCALE))
+                    / (1.0 + quality.latticeResidual / QUALITY_RESIDUAL_SCALE)
+                    / (1.0 + quality.subpixDisplacement / QUALITY_DISPLACEMENT_SCALE);
+
+    if (DEBUG_MODE > 1) printf("%s << residual = %f; displacement = %f; sharpness = %f; margin = %f; score = %f\n", __FUNCTION__, quality.latticeResidual, quality.subpixDisplacement, quality.sharpness, quality.margin, quality.score);
+
+    return quality;
+}
+
+void qualityCulling(vector<std::string>& inputList, int maxSearch, vector<vector<Point2f> >& patterns, vector<double>& scores)
+{
+    // Best first, with ties left in their original order
+    vector<pair<double, int> > ranking;
+
+    for (unsigned int iii = 0; iii < scores.size(); iii++)
+    {
+        ranking.push_back(pair<double, int>(-scores[iii], iii));
+    }
+
+    sort(ranking.begin(), ranking.end());
+
+    int keep = min(maxSearch, (int)ranking.size());
+
+    vector<std::string> keptList;
+    vector<vector<Point2f> > keptPatterns;
+    vector<double> keptScores;
+
+    for (int iii = 0; iii < keep; iii++)
+    {
+        keptList.push_back(inputList.at(ranking[iii].second));
+        keptPatterns.push_back(patterns.at(ranking[iii].second));
+        keptScores.push_back(scores.at(ranking[iii].second));
+    }
+
+    inputList.swap(keptList);
+    patterns.swap(keptPatterns);
+    scores.swap(keptScores);
+}
+
+/// \brief      Solves the n x n system A x = b in place (A row-major, x returned in b) by Gaussian elimination with partial pivoting
+static bool solveSmallSystem(double *A, double *b, int n)
+{
+    for (int col = 0; col < n; col++)
+    {
+        int pivot = col;
+
+        for (int row = col + 1; row < n; row++)
+        {
+            if (fabs(A[row*n + col]) > fabs(A[pivot*n + col]))
+            {
+                pivot = row;
+            }
+        }
+
+        if (fabs(A[pivot*n + col]) < 1e-12)
+        {
+            return false;
+        }
+
+        if (pivot != col)
+        {
+            for (int k = 0; k < n; k++)
+            {
+                swap(A[col*n + k], A[pivot*n + k]);
+            }
+
+            swap(b[col], b[pivot]);
+        }
+
+        for (int row = col + 1; row < n; row++)
+        {
+            double factor = A[row*n + col] / A[col*n + col];
+
+            for (int k = col; k < n; k++)
+            {
+                A[row*n + k] -= factor * A[col*n + k];
+            }
+
+            b[row] -= factor * b[col];
+        }
+    }
+
+    for (int row = n - 1; row >= 0; row--)
+    {
+        for (int k = row + 1; k < n; k++)
+        {
+            b[row] -= A[row*n + k] * b[k];
+        }
+
+        b[row] /= A[row*n + row];
+    }
+
+    return true;
+}
+
+/// \brief      Least-squares homography (with H[8] = 1) from centred board co-ordinates to normalized image co-ordinates
+static bool planarHomography(const Point3f *objectPoints, const Point2f *imagePoints, int count, double centreX, double centreY, double H[9])
+{
+    // Condition both point sets: board centred and scaled, image centred and scaled
+    double objectScale = 0.0, imageX = 0.0, imageY = 0.0, imageScale = 0.0;
+
+    for (int i = 0; i < count; i++)
+    {
+        objectScale += sqrt(pow(objectPoints[i].x - centreX, 2) + pow(objectPoints[i].y - centreY, 2));
+        imageX += imagePoints[i].x;
+        imageY += imagePoints[i].y;
+    }
+
+    imageX /= count;
+    imageY /= count;
+
+    for (int i = 0; i < count; i++)
+    {
+        imageScale += sqrt(pow(imagePoints[i].x - imageX, 2) + pow(imagePoints[i].y - imageY, 2));
+    }
+
+    if ((objectScale <= 0.0) || (imageScale <= 0.0))
+    {
+        return false;
+    }
+
+    objectScale = count / objectScale;
+    imageScale = count / imageScale;
+
+    double AtA[64], Atb[8];
+
+    for (int k = 0; k < 64; k++) AtA[k] = 0.0;
+    for (int k = 0; k < 8; k++) Atb[k] = 0.0;
+
+    for (int i = 0; i < count; i++)
+    {
+        double X = (objectPoints[i].x - centreX) * objectScale;
+        double Y = (objectPoints[i].y - centreY) * objectScale;
+        double u = (imagePoints[i].x - imageX) * imageScale;
+        double v = (imagePoints[i].y - imageY) * imageScale;
+
+        double rowU[8] = { X, Y, 1.0, 0.0, 0.0, 0.0, -u*X, -u*Y };
+        double rowV[8] = { 0.0, 0.0, 0.0, X, Y, 1.0, -v*X, -v*Y };
+
+        for (int r = 0; r < 8; r++)
+        {
+            for (int c = r; c < 8; c++)
+            {
+                AtA[r*8 + c] += rowU[r]*rowU[c] + rowV[r]*rowV[c];
+            }
+
+            Atb[r] += rowU[r]*u + rowV[r]*v;
+        }
+    }
+
+    for (int r = 0; r < 8; r++)
+    {
+        for (int c = 0; c < r; c++)
+        {
+            AtA[r*8 + c] = AtA[c*8 + r];
+        }
+    }
+
+    if (!solveSmallSystem(AtA, Atb, 8))
+    {
+        return false;
+    }
+
+    // Undo the conditioning: H = inv(Timage) * Hn * Tobject, with Tobject a pure scale
+    double Hn[9] = { Atb[0], Atb[1], Atb[2], Atb[3], Atb[4], Atb[5], Atb[6], Atb[7], 1.0 };
+
+    for (int r = 0; r < 3; r++)
+    {
+        Hn[r*3 + 0] *= objectScale;
+        Hn[r*3 + 1] *= objectScale;
+    }
+
+    for (int c = 0; c < 3; c++)
+    {
+        H[0*3 + c] = Hn[0*3 + c] / imageScale + imageX * Hn[2*3 + c];
+        H[1*3 + c] = Hn[1*3 + c] / imageScale + imageY * Hn[2*3 + c];
+        H[2*3 + c] = Hn[2*3 + c];
+    }
+
+    for (int k = 0; k < 9; k++)
+    {
+        H[k] /= H[8];
+    }
+
+    return true;
+}
+
+/// \brief      IPPE: the two rotations consistent with the homography's first-order behaviour at the board centre
+static bool ippeRotations(const double H[9], double R1[9], double R2[9])
+{
+    // Image of the board centre, and the Jacobian of the homography there
+    double p = H[2], q = H[5];
+
+    double j00 = H[0] - H[6]*p, j01 = H[1] - H[7]*p;
+    double j10 = H[3] - H[6]*q, j11 = H[4] - H[7]*q;
+
+    // Rotation taking the optical axis onto the ray through the board centre
+    double s = sqrt(p*p + q*q + 1.0);
+    double t = sqrt(p*p + q*q);
+    double costh = 1.0 / s;
+    double sinth = sqrt(1.0 - 1.0 / (s*s));
+
+    double krs0 = (t > 1e-12) ? p / t : 0.0;
+    double krs1 = (t > 1e-12) ? q / t : 0.0;
+
+    double rv00 = (costh - 1.0)*krs0*krs0 + 1.0;
+    double rv01 = krs0*krs1*(costh - 1.0);
+    double rv02 = krs0*sinth;
+    double rv10 = krs0*krs1*(costh - 1.0);
+    double rv11 = (costh - 1.0)*krs1*krs1 + 1.0;
+    double rv12 = krs1*sinth;
+    double rv20 = -krs0*sinth;
+    double rv21 = -krs1*sinth;
+    double rv22 = (costh - 1.0)*(krs0*krs0 + krs1*krs1) + 1.0;
+
+    double b00 = rv00 - p*rv20, b01 = rv01 - p*rv21;
+    double b10 = rv10 - q*rv20, b11 = rv11 - q*rv21;
+
+    double determinant = b00*b11 - b01*b10;
+
+    if (fabs(determinant) < 1e-12)
+    {
+        return false;
+    }
+
+    double binv00 = b11 / determinant, binv01 = -b01 / determinant;
+    double binv10 = -b10 / determinant, binv11 = b00 / determinant;
+
+    double a00 = binv00*j00 + binv01*j10, a01 = binv00*j01 + binv01*j11;
+    double a10 = binv10*j00 + binv11*j10, a11 = binv10*j01 + binv11*j11;
+
+    // Largest singular value of A
+    double ata00 = a00*a00 + a01*a01;
+    double ata01 = a00*a10 + a01*a11;
+    double ata11 = a10*a10 + a11*a11;
+
+    double gamma2 = 0.5*(ata00 + ata11 + sqrt((ata00 - ata11)*(ata00 - ata11) + 4.0*ata01*ata01));
+
+    if (gamma2 < 1e-24)
+    {
+        return false;
+    }
+
+    double gamma = sqrt(gamma2);
+
+    double r00 = a00 / gamma, r01 = a01 / gamma, r10 = a10 / gamma, r11 = a11 / gamma;
+
+    double b0 = sqrt(max(0.0, 1.0 - r00*r00 - r10*r10));
+    double b1 = sqrt(max(0.0, 1.0 - r01*r01 - r11*r11));
+
+    if ((-r00*r01 - r10*r11) < 0.0)
+    {
+        b1 = -b1;
+    }
+
+    double rv[9] = { rv00, rv01, rv02, rv10, rv11, rv12, rv20, rv21, rv22 };
+
+    // The two solutions differ only in the sign of the out-of-plane components
+    for (int sign = 0; sign < 2; sign++)
+    {
+        double *R = (sign == 0) ? R1 : R2;
+        double c0 = (sign == 0) ? b0 : -b0;
+        double c1 = (sign == 0) ? b1 : -b1;
+
+        double local[9] = { r00, r01, c1*r10 - c0*r11,
+                            r10, r11, c0*r01 - c1*r00,
+                            c0,  c1,  r00*r11 - r01*r10 };
+
+        for (int r = 0; r < 3; r++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                R[r*3 + c] = rv[r*3 + 0]*local[0*3 + c] + rv[r*3 + 1]*local[1*3 + c] + rv[r*3 + 2]*local[2*3 + c];
+            }
+        }
+    }
+
+    return true;
+}
+
+/// \brief      Linear least-squares translation for a known rotation (board co-ordinates centred)
+static bool planarTranslation(const double R[9], const Point3f *objectPoints, const Point2f *imagePoints, int count, double centreX, double centreY, double t[3])
+{
+    double AtA[9] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+    double Atb[3] = { 0.0, 0.0, 0.0 };
+
+    for (int i = 0; i < count; i++)
+    {
+        double X = objectPoints[i].x - centreX, Y = objectPoints[i].y - centreY;
+
+        double px = R[0]*X + R[1]*Y, py = R[3]*X + R[4]*Y, pz = R[6]*X + R[7]*Y;
+        double u = imagePoints[i].x, v = imagePoints[i].y;
+
+        // u (pz + tz) = px + tx   and   v (pz + tz) = py + ty
+        double rowU[3] = { 1.0, 0.0, -u };
+        double rowV[3] = { 0.0, 1.0, -v };
+        double rhsU = u*pz - px, rhsV = v*pz - py;
+
+        for (int r = 0; r < 3; r++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                AtA[r*3 + c] += rowU[r]*rowU[c] + rowV[r]*rowV[c];
+            }
+
+            Atb[r] += rowU[r]*rhsU + rowV[r]*rhsV;
+        }
+    }
+
+    if (!solveSmallSystem(AtA, Atb, 3))
+    {
+        return false;
+    }
+
+    t[0] = Atb[0];
+    t[1] = Atb[1];
+    t[2] = Atb[2];
+
+    return true;
+}
+
+/// \brief      Sum of squared reprojection errors in normalized co-ordinates (board co-ordinates centred)
+static double planarReprojectionError(const double R[9], const double t[3], const Point3f *objectPoints, const Point2f *imagePoints, int count, double centreX, double centreY)
+{
+    double err = 0.0;
+
+    for (int i = 0; i < count; i++)
+    {
+        double X = objectPoints[i].x - centreX, Y = objectPoints[i].y - centreY;
+
+        double x = R[0]*X + R[1]*Y + t[0];
+        double y = R[3]*X + R[4]*Y + t[1];
+        double z = R[6]*X + R[7]*Y + t[2];
+
+        if (z <= 0.0)
+        {
+            return DBL_MAX;
+        }
+
+        err += pow(x/z - imagePoints[i].x, 2) + pow(y/z - imagePoints[i].y, 2);
+    }
+
+    return err;
+}
+
+/// \brief      One Gauss-Newton step on rotation (as a left-multiplied increment) and translation
+static void refinePlanarPose(double R[9], double t[3], const Point3f *objectPoints, const Point2f *imagePoints, int count, double centreX, double centreY)
+{
+    double JtJ[36], Jtr[6];
+
+    for (int k = 0; k < 36; k++) JtJ[k] = 0.0;
+    for (int k = 0; k < 6; k++) Jtr[k] = 0.0;
+
+    for (int i = 0; i < count; i++)
+    {
+        double X = objectPoints[i].x - centreX, Y = objectPoints[i].y - centreY;
+
+        double x = R[0]*X + R[1]*Y + t[0];
+        double y = R[3]*X + R[4]*Y + t[1];
+        double z = R[6]*X + R[7]*Y + t[2];
+
+        double iz = 1.0 / z, iz2 = iz*iz;
+
+        // d(camera point)/d(omega) = -[Xc]x,  d(camera point)/d(t) = I
+        double dXc[3][6] = { {  0.0,    z,   -y, 1.0, 0.0, 0.0 },
+                             {   -z,  0.0,    x, 0.0, 1.0, 0.0 },
+                             {    y,   -x,  0.0, 0.0, 0.0, 1.0 } };
+
+        double Ju[6], Jv[6];
+
+        for (int k = 0; k < 6; k++)
+        {
+            Ju[k] = iz*dXc[0][k] - x*iz2*dXc[2][k];
+            Jv[k] = iz*dXc[1][k] - y*iz2*dXc[2][k];
+        }
+
+        double ru = x*iz - imagePoints[i].x, rv = y*iz - imagePoints[i].y;
+
+        for (int r = 0; r < 6; r++)
+        {
+            for (int c = 0; c < 6; c++)
+            {
+                JtJ[r*6 + c] += Ju[r]*Ju[c] + Jv[r]*Jv[c];
+            }
+
+            Jtr[r] -= Ju[r]*ru + Jv[r]*rv;
+        }
+    }
+
+    if (!solveSmallSystem(JtJ, Jtr, 6))
+    {
+        return;
+    }
+
+    // Rotation increment by Rodrigues' formula
+    double wx = Jtr[0], wy = Jtr[1], wz = Jtr[2];
+    double theta = sqrt(wx*wx + wy*wy + wz*wz);
+
+    double dR[9] = { 1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0 };
+
+    if (theta > 1e-15)
+    {
+        double kx = wx/theta, ky = wy/theta, kz = wz/theta;
+        double c = cos(theta), s = sin(theta), v = 1.0 - c;
+
+        dR[0] = c + kx*kx*v;     dR[1] = kx*ky*v - kz*s;  dR[2] = kx*kz*v + ky*s;
+        dR[3] = ky*kx*v + kz*s;  dR[4] = c + ky*ky*v;     dR[5] = ky*kz*v - kx*s;
+        dR[6] = kz*kx*v - ky*s;  dR[7] = kz*ky*v + kx*s;  dR[8] = c + kz*kz*v;
+    }
+
+    double newR[9], newT[3];
+
+    for (int r = 0; r < 3; r++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            newR[r*3 + c] = dR[r*3 + 0]*R[0*3 + c] + dR[r*3 + 1]*R[1*3 + c] + dR[r*3 + 2]*R[2*3 + c];
+        }
+
+        newT[r] = dR[r*3 + 0]*t[0] + dR[r*3 + 1]*t[1] + dR[r*3 + 2]*t[2] + Jtr[3 + r];
+    }
+
+    for (int k = 0; k < 9; k++) R[k] = newR[k];
+    for (int k = 0; k < 3; k++) t[k] = newT[k];
+}
+
+void rotationToVector(const double R[9], double rvec[3])
+{
+    double cosAngle = max(-1.0, min(1.0, 0.5*(R[0] + R[4] + R[8] - 1.0)));
+    double angle = acos(cosAngle);
+
+    double rx = R[7] - R[5], ry = R[2] - R[6], rz = R[3] - R[1];
+    double sinAngle2 = sqrt(rx*rx + ry*ry + rz*rz);    // 2 sin(angle)
+
+    if (angle < 1e-6)
+    {
+        rvec[0] = 0.5*rx;
+        rvec[1] = 0.5*ry;
+        rvec[2] = 0.5*rz;
+    }
+    else if (sinAngle2 > 1e-6)
+    {
+        rvec[0] = angle * rx / sinAngle2;
+        rvec[1] = angle * ry / sinAngle2;
+        rvec[2] = angle * rz / sinAngle2;
+    }
+    else
+    {
+        // Near a half turn: the axis comes from the diagonal of (R + I) / 2
+        double xx = sqrt(max(0.0, (R[0] + 1.0)*0.5));
+        double yy = sqrt(max(0.0, (R[4] + 1.0)*0.5));
+        double zz = sqrt(max(0.0, (R[8] + 1.0)*0.5));
+
+        if (R[1] < 0.0) yy = -yy;
+        if (R[2] < 0.0) zz = -zz;
+        if ((yy*zz > 0.0) != (R[5] > 0.0)) zz = -zz;
+
+        rvec[0] = angle*xx;
+        rvec[1] = angle*yy;
+        rvec[2] = angle*zz;
+    }
+}
+
+void vectorToRotation(const double rvec[3], double R[9])
+{
+    double angle = sqrt(rvec[0]*rvec[0] + rvec[1]*rvec[1] + rvec[2]*rvec[2]);
+
+    if (angle < DBL_EPSILON)
+    {
+        for (int k = 0; k < 9; k++) R[k] = (k % 4 == 0) ? 1.0 : 0.0;
+        return;
+    }
+
+    double x = rvec[0]/angle, y = rvec[1]/angle, z = rvec[2]/angle;
+    double c = cos(angle), s = sin(angle), c1 = 1.0 - c;
+
+    R[0] = c + c1*x*x;      R[1] = c1*x*y - s*z;    R[2] = c1*x*z + s*y;
+    R[3] = c1*x*y + s*z;    R[4] = c + c1*y*y;      R[5] = c1*y*z - s*x;
+    R[6] = c1*x*z - s*y;    R[7] = c1*y*z + s*x;    R[8] = c + c1*z*z;
+}
+
+/// \brief      Reads a 3x3 or 1xN/Nx1 matrix element as double, whether it is stored as CV_64F or CV_32F
+static double modelElement(const Mat& mat, int index)
+{
+    if (mat.depth() == CV_64F)
+    {
+        return mat.ptr<double>(0)[index];
+    }
+
+    return mat.ptr<float>(0)[index];
+}
+
+void unpackCameraModel(const Mat& cameraMatrix, const Mat& distCoeffs, double model[CAMERA_MODEL_LENGTH])
+{
+    for (int k = 0; k < CAMERA_MODEL_LENGTH; k++)
+    {
+        model[k] = 0.0;
+    }
+
+    // Rows of a 3x3 matrix are contiguous for any Mat that came from the calibrators
+    model[0] = modelElement(cameraMatrix, 0);
+    model[1] = modelElement(cameraMatrix, 4);
+    model[2] = modelElement(cameraMatrix, 2);
+    model[3] = modelElement(cameraMatrix, 5);
+
+    int coefficients = min((int) distCoeffs.total(), CAMERA_MODEL_LENGTH - 4);
+
+    for (int k = 0; k < coefficients; k++)
+    {
+        model[4 + k] = modelElement(distCoeffs, k);
+    }
+}
+
+void projectWithPose(const vector<Point3f>& objectPoints, const double R[9], const double t[3], const double model[CAMERA_MODEL_LENGTH], Point2f *imagePoints)
+{
+    const double fx = model[0], fy = model[1], cx = model[2], cy = model[3];
+    const double k1 = model[4], k2 = model[5], p1 = model[6], p2 = model[7];
+    const double k3 = model[8], k4 = model[9], k5 = model[10], k6 = model[11];
+
+    for (unsigned int iii = 0; iii < objectPoints.size(); iii++)
+    {
+        double X = objectPoints[iii].x, Y = objectPoints[iii].y, Z = objectPoints[iii].z;
+
+        double x = R[0]*X + R[1]*Y + R[2]*Z + t[0];
+        double y = R[3]*X + R[4]*Y + R[5]*Z + t[1];
+        double z = R[6]*X + R[7]*Y + R[8]*Z + t[2];
+
+        // Same convention as projectPoints() for points on the camera plane
+        z = z ? 1.0/z : 1.0;
+        x *= z;
+        y *= z;
+
+        double r2 = x*x + y*y, r4 = r2*r2, r6 = r4*r2;
+        double a1 = 2*x*y, a2 = r2 + 2*x*x, a3 = r2 + 2*y*y;
+        double radial = (1.0 + k1*r2 + k2*r4 + k3*r6) / (1.0 + k4*r2 + k5*r4 + k6*r6);
+
+        imagePoints[iii].x = (float) (fx * (x*radial + p1*a1 + p2*a2) + cx);
+        imagePoints[iii].y = (float) (fy * (y*radial + p1*a3 + p2*a1) + cy);
+    }
+}
+
+/// \brief      Normalized camera co-ordinates of distorted image points, by the same fixed-point iteration as undistortPoints()
+static void undistortWithModel(const Point2f *imagePoints, int count, const double model[CAMERA_MODEL_LENGTH], Point2f *normalized)
+{
+    const double fx = model[0], fy = model[1], cx = model[2], cy = model[3];
+    const double k1 = model[4], k2 = model[5], p1 = model[6], p2 = model[7];
+    const double k3 = model[8], k4 = model[9], k5 = model[10], k6 = model[11];
+
+    for (int iii = 0; iii < count; iii++)
+    {
+        double x0 = (imagePoints[iii].x - cx) / fx;
+        double y0 = (imagePoints[iii].y - cy) / fy;
+        double x = x0, y = y0;
+
+        for (int jjj = 0; jjj < 5; jjj++)
+        {
+            double r2 = x*x + y*y;
+            double icdist = (1.0 + ((k6*r2 + k5)*r2 + k4)*r2) / (1.0 + ((k3*r2 + k2)*r2 + k1)*r2);
+            double deltaX = 2*p1*x*y + p2*(r2 + 2*x*x);
+            double deltaY = p1*(r2 + 2*y*y) + 2*p2*x*y;
+            x = (x0 - deltaX)*icdist;
+            y = (y0 - deltaY)*icdist;
+        }
+
+        normalized[iii].x = (float) x;
+        normalized[iii].y = (float) y;
+    }
+}
+
+static void deletePoseWorkspace(planarPoseWorkspace *workspace)
+{
+    delete workspace;
+}
+
+static boost::thread_specific_ptr<planarPoseWorkspace> poseWorkspaceLocal(deletePoseWorkspace);
+
+planarPoseWorkspace& threadPoseWorkspace()
+{
+    planarPoseWorkspace *workspace = poseWorkspaceLocal.get();
+
+    if (workspace == NULL)
+    {
+        workspace = new planarPoseWorkspace;
+        poseWorkspaceLocal.reset(workspace);
+    }
+
+    return *workspace;
+}
+
+bool planarPoseFromNormalized(const Point3f *objectPoints, const Point2f *imagePoints, int count, bool refine, double R[9], double t[3])
+{
+    if (count < 4)
+    {
+        return false;
+    }
+
+    double centreX = 0.0, centreY = 0.0;
+
+    for (int i = 0; i < count; i++)
+    {
+        centreX += objectPoints[i].x;
+        centreY += objectPoints[i].y;
+    }
+
+    centreX /= count;
+    centreY /= count;
+
+    double H[9], R1[9], R2[9], t1[3], t2[3];
+
+    if (!planarHomography(objectPoints, imagePoints, count, centreX, centreY, H) || !ippeRotations(H, R1, R2))
+    {
+        return false;
+    }
+
+    bool valid1 = planarTranslation(R1, objectPoints, imagePoints, count, centreX, centreY, t1);
+    bool valid2 = planarTranslation(R2, objectPoints, imagePoints, count, centreX, centreY, t2);
+
+    double err1 = valid1 ? planarReprojectionError(R1, t1, objectPoints, imagePoints, count, centreX, centreY) : DBL_MAX;
+    double err2 = valid2 ? planarReprojectionError(R2, t2, objectPoints, imagePoints, count, centreX, centreY) : DBL_MAX;
+
+    if ((err1 == DBL_MAX) && (err2 == DBL_MAX))
+    {
+        return false;
+    }
+
+    const double *bestR = (err1 <= err2) ? R1 : R2;
+    const double *bestT = (err1 <= err2) ? t1 : t2;
+
+    for (int k = 0; k < 9; k++) R[k] = bestR[k];
+    for (int k = 0; k < 3; k++) t[k] = bestT[k];
+
+    if (refine)
+    {
+        refinePlanarPose(R, t, objectPoints, imagePoints, count, centreX, centreY);
+    }
+
+    // Back from centred board co-ordinates: t = t' - R * centre
+    for (int r = 0; r < 3; r++)
+    {
+        t[r] -= R[r*3 + 0]*centreX + R[r*3 + 1]*centreY;
+    }
+
+    return true;
+}
+
+int estimatePlanarPoses(const vector<Point3f>& objectPoints, const vector< vector<Point2f> >& views, const Mat& cameraMatrix, const Mat& distCoeffs, planarPoseWorkspace& workspace, bool refine)
+{
+    perfStageScope stageCounters(PERF_STAGE_PLANAR_POSE);
+
+    // Buffers only ever grow, so once warm an evaluation allocates nothing
+    workspace.rotations.resize(views.size() * 9);
+    workspace.translations.resize(views.size() * 3);
+
+    unsigned int pointsPerView = objectPoints.size();
+
+    bool planar = (pointsPerView >= 4);
+
+    for (unsigned int iii = 0; iii < pointsPerView; iii++)
+    {
+        if (objectPoints[iii].z != 0.0f)
+        {
+            planar = false;
+        }
+    }
+
+    // All views are undistorted in a single call, into buffers that keep their capacity between calls
+    workspace.distorted.resize(views.size() * pointsPerView);
+
+    for (unsigned int iii = 0; iii < views.size(); iii++)
+    {
+        if (views[iii].size() != pointsPerView)
+        {
+            planar = false;
+            break;
+        }
+
+        copy(views[iii].begin(), views[iii].end(), workspace.distorted.begin() + iii * pointsPerView);
+    }
+
+    workspace.normalized.resize(workspace.distorted.size());
+
+    if (planar && (workspace.distorted.size() > 0))
+    {
+        double model[CAMERA_MODEL_LENGTH];
+        unpackCameraModel(cameraMatrix, distCoeffs, model);
+        undistortWithModel(&workspace.distorted[0], workspace.distorted.size(), model, &workspace.normalized[0]);
+    }
+
+    int analyticPoses = 0;
+
+    for (unsigned int iii = 0; iii < views.size(); iii++)
+    {
+        double *R = &workspace.rotations[iii * 9];
+        double *t = &workspace.translations[iii * 3];
+
+        if (planar && planarPoseFromNormalized(&objectPoints[0], &workspace.normalized[iii * pointsPerView], pointsPerView, refine, R, t))
+        {
+            analyticPoses++;
+        }
+        else
+        {
+            // Non-planar targets, and the rare degenerate view, still get the general solver
+            Mat rvec, tvec;
+            solvePnP(Mat(objectPoints), Mat(views[iii]), cameraMatrix, distCoeffs, rvec, tvec, false);
+
+            double r[3];
+
+            for (int k = 0; k < 3; k++)
+            {
+                r[k] = rvec.at<double>(k, 0);
+                t[k] = tvec.at<double>(k, 0);
+            }
+
+            vectorToRotation(r, R);
+        }
+    }
+
+    return analyticPoses;
+}
+
+void patternPoseDescriptors(const vector< vector<Point2f> >& patterns, const vector<Point3f>& objectPoints, Size imSize, Mat& descriptors)
+{
+    descriptors = Mat::zeros(patterns.size(), POSE_DESCRIPTOR_LENGTH, CV_64F);
+
+    int count = objectPoints.size();
+
+    if ((count < 4) || (patterns.size() == 0))
+    {
+        return;
+    }
+
+    double centreX = 0.0, centreY = 0.0, extent = 0.0;
+
+    for (int i = 0; i < count; i++)
+    {
+        centreX += objectPoints[i].x / count;
+        centreY += objectPoints[i].y / count;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        extent = max(extent, sqrt(pow(objectPoints[i].x - centreX, 2) + pow(objectPoints[i].y - centreY, 2)));
+    }
+
+    // Image co-ordinates relative to the frame centre, in frame widths, so that descriptors do not depend on resolution
+    double imageScale = max(imSize.width, imSize.height);
+    vector<Point2f> scaledPoints(count);
+
+    for (unsigned int iii = 0; iii < patterns.size(); iii++)
+    {
+        if ((int)patterns[iii].size() != count)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            scaledPoints[i].x = float((patterns[iii][i].x - 0.5 * imSize.width) / imageScale);
+            scaledPoints[i].y = float((patterns[iii][i].y - 0.5 * imSize.height) / imageScale);
+        }
+
+        double H[9];
+
+        if (!planarHomography(&objectPoints[0], &scaledPoints[0], count, centreX, centreY, H))
+        {
+            continue;
+        }
+
+        double *descriptor = descriptors.ptr<double>(iii);
+
+        // Where the board centre lands, and how large the board appears
+        descriptor[0] = H[2];
+        descriptor[1] = H[5];
+        descriptor[2] = sqrt(fabs(H[0] * H[4] - H[1] * H[3])) * extent;
+
+        // Perspective terms, per board half-width: how far, and which way, the board is tilted
+        descriptor[3] = H[6] * extent;
+        descriptor[4] = H[7] * extent;
+
+        // Doubled angle, since a board turned through 180 degrees is the same view
+        double angle = 2.0 * atan2(H[3], H[0]);
+        descriptor[5] = cos(angle);
+        descriptor[6] = sin(angle);
+    }
+
+    // Standardized, so that no one component dominates the distances
+    for (int k = 0; k < POSE_DESCRIPTOR_LENGTH; k++)
+    {
+        double mean = 0.0, variance = 0.0;
+
+        for (int iii = 0; iii < descriptors.rows; iii++)
+        {
+            mean += descriptors.at<double>(iii, k) / descriptors.rows;
+        }
+
+        for (int iii = 0; iii < descriptors.rows; iii++)
+        {
+            variance += pow(descriptors.at<double>(iii, k) - mean, 2) / descriptors.rows;
+        }
+
+        double spread = (variance > 1e-12) ? sqrt(variance) : 0.0;
+
+        for (int iii = 0; iii < descriptors.rows; iii++)
+        {
+            descriptors.at<double>(iii, k) = (spread > 0.0) ? (descriptors.at<double>(iii, k) - mean) / spread : 0.0;
+        }
+    }
+}
+
+/// \brief      Squared distance between two descriptor rows
+static double descriptorDistance(const Mat& descriptors, int a, int b)
+{
+    const double *rowA = descriptors.ptr<double>(a);
+    const double *rowB = descriptors.ptr<double>(b);
+
+    double distance = 0.0;
+
+    for (int k = 0; k < descriptors.cols; k++)
+    {
+        distance += (rowA[k] - rowB[k]) * (rowA[k] - rowB[k]);
+    }
+
+    return distance;
+}
+
+/// \brief      Grows a seed set from a first pick, each further pick farthest from (or drawn by squared distance to) those chosen
+static void growSeedSet(const Mat& descriptors, int first, int nSeeds, RNG *rng, vector<int>& seedSet)
+{
+    seedSet.assign(1, first);
+
+    vector<double> nearest(descriptors.rows);
+
+    for (int iii = 0; iii < descriptors.rows; iii++)
+    {
+        nearest[iii] = descriptorDistance(descriptors, iii, first);
+    }
+
+    while ((int)seedSet.size() < nSeeds)
+    {
+        int pick = -1;
+
+        if (rng == NULL)
+        {
+            double farthest = -1.0;
+
+            for (int iii = 0; iii < descriptors.rows; iii++)
+            {
+                if (nearest[iii] > farthest)
+                {
+                    farthest = nearest[iii];
+                    pick = iii;
+                }
+            }
+        }
+        else
+        {
+            double total = 0.0;
+
+            for (int iii = 0; iii < descriptors.rows; iii++)
+            {
+                total += nearest[iii];
+            }
+
+            double target = rng->uniform(0.0, total);
+
+            for (int iii = 0; iii < descriptors.rows; iii++)
+            {
+                if (nearest[iii] <= 0.0)
+                {
+                    continue;
+                }
+
+                pick = iii;
+                target -= nearest[iii];
+
+                if (target <= 0.0)
+                {
+                    break;
+                }
+            }
+        }
+
+        // Every remaining pattern duplicates one already chosen, so any unused one will do
+        if ((pick < 0) || (nearest[pick] <= 0.0))
+        {
+            pick = -1;
+
+            for (int iii = 0; (iii < descriptors.rows) && (pick < 0); iii++)
+            {
+                if (find(seedSet.begin(), seedSet.end(), iii) == seedSet.end())
+                {
+                    pick = iii;
+                }
+            }
+        }
 
-    if (DEBUG_MODE > 1)
-    {
-        printf("%s << Total patches found = %d\n", __FUNCTION__, (int)msers.size());
+        seedSet.push_back(pick);
+
+        for (int iii = 0; iii < descriptors.rows; iii++)
+        {
+            nearest[iii] = min(nearest[iii], descriptorDistance(descriptors, iii, pick));
+        }
     }
 }
 
-void randomCulling(vector<std::string> &inputList, int maxSearch)
+void diverseSeedSets(const Mat& descriptors, int nSeeds, int nSets, vector< vector<int> >& seedSets)
 {
+    seedSets.clear();
 
-    srand ( (unsigned int)(time(NULL)) );
+    nSeeds = min(nSeeds, descriptors.rows);
 
-    int deletionIndex = 0;
+    if ((nSeeds <= 0) || (nSets <= 0))
+    {
+        return;
+    }
 
-    while (inputList.size() > maxSearch)
+    // Farthest-point sampling from the pattern closest to the mean descriptor (the origin, once standardized)
+    int typical = 0;
+    double typicalDistance = DBL_MAX;
+
+    for (int iii = 0; iii < descriptors.rows; iii++)
     {
-        deletionIndex = rand() % inputList.size();
-        inputList.erase(inputList.begin() + deletionIndex);
+        double distance = 0.0;
+
+        for (int k = 0; k < descriptors.cols; k++)
+        {
+            distance += descriptors.at<double>(iii, k) * descriptors.at<double>(iii, k);
+        }
+
+        if (distance < typicalDistance)
+        {
+            typicalDistance = distance;
+            typical = iii;
+        }
     }
-}
 
-void randomCulling(vector<std::string> &inputList, int maxSearch, vector<vector<Point2f> >& patterns)
-{
+    vector<int> seedSet, sortedSet;
+    vector< vector<int> > sortedSets;
 
-    srand ( (unsigned int)(time(NULL)) );
+    growSeedSet(descriptors, typical, nSeeds, NULL, seedSet);
 
-    int deletionIndex = 0;
+    seedSets.push_back(seedSet);
+    sortedSets.push_back(seedSet);
+    sort(sortedSets.back().begin(), sortedSets.back().end());
 
-    while (inputList.size() > maxSearch)
+    // k-means++ draws; a few extra attempts allow for draws that repeat an earlier set
+    RNG rng(DIVERSE_SEED_RNG_STATE);
+
+    for (int attempt = 0; ((int)seedSets.size() < nSets) && (attempt < 4 * nSets); attempt++)
     {
-        deletionIndex = rand() % inputList.size();
-        inputList.erase(inputList.begin() + deletionIndex);
-        patterns.erase(patterns.begin() + deletionIndex);
+        growSeedSet(descriptors, rng.uniform(0, descriptors.rows), nSeeds, &rng, seedSet);
+
+        sortedSet = seedSet;
+        sort(sortedSet.begin(), sortedSet.end());
+
+        if (find(sortedSets.begin(), sortedSets.end(), sortedSet) == sortedSets.end())
+        {
+            seedSets.push_back(seedSet);
+            sortedSets.push_back(sortedSet);
+        }
     }
 }
 
-void randomCulling(vector<string>& inputList, int maxSearch, vector<vector<vector<Point2f> > >& patterns)
+int pickDiverseBatch(const double *scores, int count, const Mat& descriptors, int batchSize, double minSeparation, vector<int>& batch)
 {
-    srand ( (unsigned int)(time(NULL)) );
+    batch.clear();
 
-    int deletionIndex = 0;
+    // Scores at or below zero mark candidates that were skipped, and 9e50 those already chosen
+    vector< pair<double, int> > ranked;
 
-    printf("%s << inputList.size() = %d / %d\n", __FUNCTION__, (int)inputList.size(), maxSearch);
+    for (int iii = 0; iii < count; iii++)
+    {
+        if ((scores[iii] > 0.0) && (scores[iii] < 1e49))
+        {
+            ranked.push_back(pair<double, int>(scores[iii], iii));
+        }
+    }
 
-    while (inputList.size() > maxSearch)
+    sort(ranked.begin(), ranked.end());
+
+    for (unsigned int iii = 0; (iii < ranked.size()) && ((int)batch.size() < batchSize); iii++)
     {
-        deletionIndex = rand() % inputList.size();
-        inputList.erase(inputList.begin() + deletionIndex);
+        bool distinct = true;
 
-        for (int i = 0; i < patterns.size(); i++)
+        for (unsigned int jjj = 0; (jjj < batch.size()) && distinct; jjj++)
         {
-            patterns.at(i).erase(patterns.at(i).begin() + deletionIndex);
+            if (descriptorDistance(descriptors, ranked[iii].second, batch[jjj]) < minSeparation * minSeparation)
+            {
+                distinct = false;
+            }
         }
 
+        if (distinct)
+        {
+            batch.push_back(ranked[iii].second);
+        }
     }
 
-    //printf("%s << patterns.at(i).size() = %d / %d\n", __FUNCTION__, patterns.at(0).size(), maxSearch);
-    //printf("%s << Waiting for key...\n", __FUNCTION__);
-    //cin.get();
+    return (int)batch.size();
 }
 
 void debugDisplayPatches(const Mat& image, vector<vector<Point> >& msers)
@@ -1349,7 +2709,7 @@ void debugDisplayPattern(const Mat& image, Size patternSize, Mat& corners, bool
     waitKey(0);
 }
 
-bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& corners, int mode, mserParameterGroup mserParams, double correctionFactor, int detector)
+bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& corners, int mode, mserParameterGroup mserParams, double correctionFactor, int detector, detectionRecord *record)
 {
 	
 	//printf("%s << correctionFactor = (%f)\n", __FUNCTION__, correctionFactor);
@@ -1357,6 +2717,12 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
     // mode 0: MSER chessboard finder
     // mode 1: MSER mask finder
 
+    // Always fill a record, even if the caller doesn't want one, so that each stage can report unconditionally
+    detectionRecord localRecord;
+    if (record == NULL) record = &localRecord;
+
+    int64 totalStart = getTickCount(), stageStart;
+
     if (!checkAcutance())
     {
         return false;
@@ -1367,7 +2733,10 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
 
     vector<vector<Point> > msers;
     //cout << "BETA" << endl;
+    stageStart = getTickCount();
     findAllPatches(image, patternSize, msers, mserParams);
+    record->mserTime = elapsedMS(stageStart);
+    record->mserCount = (int)msers.size();
 	//cout << "GAMMA" << endl;
     if (DEBUG_MODE > 2)
     {
@@ -1377,6 +2746,8 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
     if (msers.size() < desiredPatchQuantity)
     {
         corners.clear();
+        record->rejection = REJECTION_INSUFFICIENT_MSERS;
+        record->totalTime = elapsedMS(totalStart);
         if (DEBUG_MODE > 1)
         {
             printf("%s << Insufficient patches found. Returning.\n", __FUNCTION__);
@@ -1385,10 +2756,25 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
         return false;
     }
 
+    bool found = findPatternCornersFromPatches(image, patternSize, msers, corners, mode, correctionFactor, detector, record);
+
+    record->totalTime = elapsedMS(totalStart);
+
+    return found;
+}
+
+bool findPatternCornersFromPatches(const Mat& image, Size patternSize, vector<vector<Point> >& msers, vector<Point2f>& corners, int mode, double correctionFactor, int detector, detectionRecord *record)
+{
+    detectionRecord localRecord;
+    if (record == NULL) record = &localRecord;
+
+    int64 stageStart;
 
+    int patchCols, patchRows, desiredPatchQuantity;
+    determinePatchDistribution(patternSize, mode, patchRows, patchCols, desiredPatchQuantity);
 
     vector<Point2f> patchCentres2f;
-    bool found = refinePatches(image, patternSize, msers, patchCentres2f, mode);
+    bool found = refinePatches(image, patternSize, msers, patchCentres2f, mode, record);
 
 
     if (DEBUG_MODE > 1) printf("%s << Patches found after refinement = %d\n", __FUNCTION__, (int)msers.size());
@@ -1408,12 +2794,15 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
     }
 
 
+    stageStart = getTickCount();
+
     found = patternInFrame(image.size(), patchCentres2f);
 
     // If patches still not found...
     if (!found)
     {
         corners.clear();
+        record->rejection = REJECTION_PATCHES_OUT_OF_FRAME;
 
         if (DEBUG_MODE > 1)
         {
@@ -1435,12 +2824,15 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
     }
 
     found = verifyPatches(image.size(), patternSize, patchCentres2f, mode, 0, 1000);
+
+    record->verificationTime = elapsedMS(stageStart);
     
     if (DEBUG_MODE > 1) printf("%s << Reached here. (%d)\n", __FUNCTION__, 1);
 
     if (!found)
     {
         corners.clear();
+        record->rejection = REJECTION_VERIFICATION_FAILED;
 
         if (DEBUG_MODE > 1)
         {
@@ -1450,6 +2842,8 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
         return false;
     }
 
+    stageStart = getTickCount();
+
     // Correct patch centres (using histogram equalisation, single-frame calibration)
     correctPatchCentres(image, patternSize, patchCentres2f, mode);
     
@@ -1464,6 +2858,8 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
     Mat homography;
     found = findPatchCorners(image, patternSize, homography, corners, patchCentres2f, correctionFactor, mode, detector);
 
+    record->cornerTime = elapsedMS(stageStart);
+
 	if (DEBUG_MODE > 1) printf("%s << Reached here. (%d)\n", __FUNCTION__, 3);
 
     // refineCornerPositions
@@ -1472,6 +2868,7 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
     if (!found)
     {
         corners.clear();
+        record->rejection = REJECTION_CORNER_SEARCH_FAILED;
 
         if (DEBUG_MODE > 1)
         {
@@ -1487,6 +2884,7 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
     if (!found)
     {
         corners.clear();
+        record->rejection = REJECTION_CORNERS_OUT_OF_FRAME;
 
         if (DEBUG_MODE > 1)
         {
@@ -1502,9 +2900,257 @@ bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& cor
         debugDisplayPattern(image, cvSize(patternSize.width, patternSize.height), cornersMat);
     }
 
+    record->cornerCount = (int)corners.size();
+
     return found;
 }
 
+/// \brief      Root of a patch's cluster, halving the path on the way up
+static int findClusterRoot(vector<int>& parent, int index)
+{
+    while (parent[index] != index)
+    {
+        parent[index] = parent[parent[index]];
+        index = parent[index];
+    }
+
+    return index;
+}
+
+static bool largerCluster(const vector<int>& a, const vector<int>& b)
+{
+    return (a.size() > b.size());
+}
+
+int clusterPatchesIntoBoards(vector<mserPatch>& patches, int minPatches, vector<vector<int> >& clusters)
+{
+    clusters.clear();
+
+    vector<int> parent(patches.size());
+
+    for (unsigned int iii = 0; iii < patches.size(); iii++)
+    {
+        parent[iii] = iii;
+    }
+
+    // Neighbouring squares of one board are similar in size and about two widths apart, whereas
+    // squares from different boards are either far apart or (because of different ranges) differently sized
+    for (unsigned int iii = 0; iii < patches.size(); iii++)
+    {
+        for (unsigned int jjj = iii + 1; jjj < patches.size(); jjj++)
+        {
+            double smallerArea = min(patches[iii].area, patches[jjj].area);
+            double largerArea = max(patches[iii].area, patches[jjj].area);
+
+            if ((smallerArea <= 0.0) || (largerArea > MULTI_BOARD_AREA_RATIO * smallerArea))
+            {
+                continue;
+            }
+
+            double spacing = norm(patches[iii].centroid2f - patches[jjj].centroid2f);
+
+            if (spacing > MULTI_BOARD_LINK_DISTANCE * sqrt(largerArea))
+            {
+                continue;
+            }
+
+            int rootA = findClusterRoot(parent, iii);
+            int rootB = findClusterRoot(parent, jjj);
+
+            if (rootA != rootB)
+            {
+                parent[rootB] = rootA;
+            }
+        }
+    }
+
+    vector<int> clusterIndex(patches.size(), -1);
+    vector<vector<int> > components;
+
+    for (unsigned int iii = 0; iii < patches.size(); iii++)
+    {
+        int root = findClusterRoot(parent, iii);
+
+        if (clusterIndex[root] < 0)
+        {
+            clusterIndex[root] = (int)components.size();
+            components.push_back(vector<int>());
+        }
+
+        components[clusterIndex[root]].push_back(iii);
+    }
+
+    // Anything smaller than a whole board cannot be sorted into one
+    for (unsigned int iii = 0; iii < components.size(); iii++)
+    {
+        if ((int)components[iii].size() >= minPatches)
+        {
+            clusters.push_back(components[iii]);
+        }
+    }
+
+    sort(clusters.begin(), clusters.end(), largerCluster);
+
+    if (DEBUG_MODE > 1) printf("%s << %d patches form %d components, %d large enough for a board.\n", __FUNCTION__, (int)patches.size(), (int)components.size(), (int)clusters.size());
+
+    return (int)clusters.size();
+}
+
+/// \brief      Runs the per-board stages on each candidate cluster, each task writing only to its own slot
+class parallelBoardRefinement : public ParallelLoopBody
+{
+public:
+    parallelBoardRefinement(const Mat& image, Size patternSize, vector<vector<vector<Point> > >& clusterMsers, int mode, double correctionFactor, int detector, vector<vector<Point2f> >& corners, vector<int>& found, vector<detectionRecord>& records) :
+        searchImage(image),
+        cornersSize(patternSize),
+        candidateMsers(clusterMsers),
+        patternMode(mode),
+        correction(correctionFactor),
+        cornerDetector(detector),
+        cornerSets(corners),
+        foundFlags(found),
+        candidateRecords(records)
+    {
+    }
+
+    void operator()(const Range& range) const
+    {
+        for (int iii = range.start; iii < range.end; iii++)
+        {
+            bool found = findPatternCornersFromPatches(searchImage, cornersSize, candidateMsers[iii], cornerSets[iii], patternMode, correction, cornerDetector, &candidateRecords[iii]);
+
+            foundFlags[iii] = found ? 1 : 0;
+        }
+    }
+
+private:
+    const Mat& searchImage;
+    Size cornersSize;
+    vector<vector<vector<Point> > >& candidateMsers;
+    int patternMode;
+    double correction;
+    int cornerDetector;
+    vector<vector<Point2f> >& cornerSets;
+    vector<int>& foundFlags;
+    vector<detectionRecord>& candidateRecords;
+};
+
+int findMultiplePatternCorners(const Mat& image, Size patternSize, vector<vector<Point2f> >& boards, int mode, mserParameterGroup mserParams, double correctionFactor, int detector, int maxBoards, detectionRecord *record)
+{
+    boards.clear();
+
+    detectionRecord localRecord;
+    if (record == NULL) record = &localRecord;
+
+    int64 totalStart = getTickCount(), stageStart;
+
+    if (!checkAcutance())
+    {
+        return 0;
+    }
+
+    int patchCols, patchRows, desiredPatchQuantity;
+    determinePatchDistribution(patternSize, mode, patchRows, patchCols, desiredPatchQuantity);
+
+    vector<vector<Point> > msers;
+
+    stageStart = getTickCount();
+    findAllPatches(image, patternSize, msers, mserParams);
+    record->mserTime = elapsedMS(stageStart);
+    record->mserCount = (int)msers.size();
+
+    if (msers.size() < desiredPatchQuantity)
+    {
+        record->rejection = REJECTION_INSUFFICIENT_MSERS;
+        record->totalTime = elapsedMS(totalStart);
+        return 0;
+    }
+
+    // The shape and enclosure filters judge patches individually, so they can run before the frame is split up
+    vector<mserPatch> patches;
+    for (unsigned int iii = 0; iii < msers.size(); iii++)
+    {
+        patches.push_back(mserPatch(msers.at(iii), image));
+    }
+
+    stageStart = getTickCount();
+    shapeFilter(patches, msers);
+    record->shapeFilterTime = elapsedMS(stageStart);
+    record->shapeFilterCount = (int)msers.size();
+
+    stageStart = getTickCount();
+    enclosureFilter(patches, msers);
+    record->enclosureFilterTime = elapsedMS(stageStart);
+    record->enclosureFilterCount = (int)msers.size();
+
+    vector<vector<int> > clusters;
+    clusterPatchesIntoBoards(patches, desiredPatchQuantity, clusters);
+
+    if (clusters.size() == 0)
+    {
+        record->rejection = REJECTION_PATCH_COUNT;
+        record->totalTime = elapsedMS(totalStart);
+        return 0;
+    }
+
+    vector<vector<vector<Point> > > clusterMsers(clusters.size());
+
+    for (unsigned int iii = 0; iii < clusters.size(); iii++)
+    {
+        for (unsigned int jjj = 0; jjj < clusters[iii].size(); jjj++)
+        {
+            clusterMsers[iii].push_back(msers.at(clusters[iii][jjj]));
+        }
+    }
+
+    vector<vector<Point2f> > cornerSets(clusters.size());
+    vector<int> found(clusters.size(), 0);
+    vector<detectionRecord> clusterRecords(clusters.size());
+
+    // Every candidate gets the full single-board treatment (looping filters, sorting, verification, corners)
+    stageStart = getTickCount();
+    parallel_for_(Range(0, (int)clusters.size()), parallelBoardRefinement(image, patternSize, clusterMsers, mode, correctionFactor, detector, cornerSets, found, clusterRecords));
+    record->cornerTime = elapsedMS(stageStart);
+
+    record->cornerCount = 0;
+
+    for (unsigned int iii = 0; iii < clusters.size(); iii++)
+    {
+        record->clusterFilterTime += clusterRecords[iii].clusterFilterTime;
+        record->reduceClusterTime += clusterRecords[iii].reduceClusterTime;
+        record->verificationTime += clusterRecords[iii].verificationTime;
+
+        if (found[iii] && ((int)boards.size() < maxBoards))
+        {
+            boards.push_back(cornerSets[iii]);
+            record->cornerCount += (int)cornerSets[iii].size();
+        }
+    }
+
+    // With nothing found, the largest candidate is the one most likely to have been a board
+    record->rejection = (boards.size() > 0) ? REJECTION_NONE : clusterRecords[0].rejection;
+    record->totalTime = elapsedMS(totalStart);
+
+    if (DEBUG_MODE > 0) printf("%s << %d of %d candidate clusters accepted as boards.\n", __FUNCTION__, (int)boards.size(), (int)clusters.size());
+
+    return (int)boards.size();
+}
+
+int findMultipleMaskCorners(const Mat& image, Size patternSize, vector<vector<Point2f> >& boards, mserParameterGroup mserParams, double correctionFactor, int detector, int maxBoards, detectionRecord *record)
+{
+    Mat grayIm;
+    if (image.channels() > 1) {
+        cvtColor(image, grayIm, CV_RGB2GRAY);
+    } else {
+        grayIm = Mat(image);
+    }
+
+    // Convert pattern size from squares to corners
+    Size cornersSize(2*patternSize.width, 2*patternSize.height);
+
+    return findMultiplePatternCorners(grayIm, cornersSize, boards, 1, mserParams, correctionFactor, detector, maxBoards, record);
+}
+
 void interpolateCornerLocations2(const Mat& image, int mode, Size patternSize, vector<Point2f>& vCentres, vector<Point2f>& vCorners)
 {
 
@@ -1969,6 +3615,7 @@ double obtainSetScore(Mat& distributionMap,
 
 bool findPatchCorners(const Mat& image, Size patternSize, Mat& homography, vector<Point2f>& corners, vector<Point2f>& patchCentres2f, double correctionFactor, int mode, int detector)
 {
+    perfStageScope stageCounters(PERF_STAGE_FIND_PATCH_CORNERS);
 	
 	//printf("%s << correctionFactor = (%f)\n", __FUNCTION__, correctionFactor);
 
@@ -3952,68 +5599,124 @@ void reduceCluster(vector<mserPatch>& patches, vector<vector<Point> >& msers, in
     
 }
 
+/// \brief      Adds delta at a (0-based) position of a Fenwick tree
+static void fenwickAdd(vector<int>& tree, int position, int delta)
+{
+    for (int iii = position + 1; iii < (int)tree.size(); iii += iii & (-iii))
+    {
+        tree[iii] += delta;
+    }
+}
+
+/// \brief      (0-based) position of the k-th (0-based) set entry of a Fenwick tree of 0/1 counts
+static int fenwickFindKth(const vector<int>& tree, int k)
+{
+    int position = 0;
+    int step = 1;
+
+    while ((step << 1) < (int)tree.size())
+    {
+        step <<= 1;
+    }
+
+    for (; step > 0; step >>= 1)
+    {
+        if ((position + step < (int)tree.size()) && (tree[position + step] <= k))
+        {
+            position += step;
+            k -= tree[position];
+        }
+    }
+
+    return position;
+}
+
 void clusterFilter(vector<mserPatch>& patches, vector<vector<Point> >& msers, int totalPatches)
 {
 	// Try new approach which removes the most abnormal patch based on differences with median
 	
-	vector<double> patchAreas, patchAreasSorted;
+	// The patch furthest (in area) from the reference area is always the smallest or the largest remaining one,
+	// so a single sort lets the outliers be trimmed from either end of the sorted areas in turn
+	
+	if (patches.size() <= ((unsigned int)totalPatches)) {
+		return;
+	}
+	
+	vector<pair<double, int> > sortedAreas;
 	
 	for (unsigned int iii = 0; iii < patches.size(); iii++) {
 		
-		patchAreas.push_back(patches.at(iii).area);
+		sortedAreas.push_back(pair<double, int>(patches.at(iii).area, iii));
 		
 	}
 	
-	while (patches.size() > ((unsigned int)totalPatches)) {
+	sort(sortedAreas.begin(), sortedAreas.end());
+	
+	// Equal areas form runs (ordered by patch index); removing an area removes the earliest remaining patch with it
+	vector<int> runStart(sortedAreas.size()), runNext(sortedAreas.size());
+	
+	for (unsigned int iii = 0; iii < sortedAreas.size(); iii++) {
+		
+		runStart[iii] = ((iii > 0) && (sortedAreas[iii].first == sortedAreas[iii-1].first)) ? runStart[iii-1] : iii;
+		runNext[iii] = iii;
 		
-		// Determine medians:
-		patchAreasSorted.clear();
-		patchAreasSorted.insert(patchAreasSorted.end(), patchAreas.begin(), patchAreas.end());
-		sort(patchAreasSorted.begin(), patchAreasSorted.end());
+	}
+	
+	vector<bool> removed(patches.size(), false);
+	
+	// The reference area is that of the (n/2)-th surviving patch in original (not sorted) order, found by
+	// an order-statistic tree over the original indices
+	vector<int> survivors(patches.size() + 1, 0);
+	
+	for (unsigned int iii = 0; iii < patches.size(); iii++) {
+		fenwickAdd(survivors, iii, 1);
+	}
+	
+	int lo = 0, hi = int(sortedAreas.size()) - 1;
+	
+	while ((hi - lo + 1) > totalPatches) {
 		
-		double medianVal = patchAreas.at(int(patchAreasSorted.size() / 2));
+		double medianVal = patches[fenwickFindKth(survivors, (hi - lo + 1) / 2)].area;
 		
 		//printf("%s << medianVal = %f\n", __FUNCTION__, medianVal);
 		
-		double maxDiff = -1.0;;
-		int maxDiffIndex = -1;
+		// Ties go to the smaller area
+		int run;
 		
-		for (unsigned int iii = 0; iii < patchAreasSorted.size(); iii++) {
-		
-			if ((abs(patchAreasSorted.at(iii) - medianVal)) > maxDiff) {
-				maxDiff = abs(patchAreasSorted.at(iii) - medianVal);
-				maxDiffIndex = iii;
-			}
-			
-			//printf("%s << area(%d) = %f (diff = %f\n", __FUNCTION__, iii, patchAreas.at(iii), abs(patchAreas.at(iii) - medianVal));
-			
+		if ((medianVal - sortedAreas[lo].first) >= (sortedAreas[hi].first - medianVal)) {
+			run = runStart[lo];
+			lo++;
+		} else {
+			run = runStart[hi];
+			hi--;
 		}
 		
-		//printf("%s << maxDiffIndex = %d / %d\n", __FUNCTION__, maxDiffIndex, patchAreasSorted.size());
-		
-		double badArea = patchAreasSorted.at(maxDiffIndex);
+		removed[sortedAreas[runNext[run]].second] = true;
+		fenwickAdd(survivors, sortedAreas[runNext[run]].second, -1);
+		runNext[run]++;
 		
+	}
+	
+	// Compact in one pass, keeping the survivors in their original order
+	unsigned int kept = 0;
+	
+	for (unsigned int iii = 0; iii < patches.size(); iii++) {
 		
-		bool culpritFound = false;
-		unsigned int iii = 0;
-		while (!culpritFound) {
-			//printf("%s << iii = (%d / %d)\n", __FUNCTION__, iii, patchAreas.size());
-			if (patchAreas.at(iii) == badArea) {
-				culpritFound = true;
-			} else {
-				iii++;
+		if (!removed[iii]) {
+			
+			if (kept != iii) {
+				patches[kept] = patches[iii];
+				msers[kept].swap(msers[iii]);
 			}
+			
+			kept++;
 		}
 		
-		patchAreasSorted.erase(patchAreasSorted.begin() + maxDiffIndex);
-		patchAreas.erase(patchAreas.begin() + iii);
-
-		patches.erase(patches.begin() + iii);
-		msers.erase(msers.begin() + iii);
-		
-		
 	}
 	
+	patches.resize(kept);
+	msers.resize(kept);
+	
 	
 	return;
 	
@@ -4201,8 +5904,10 @@ void transferMserElement(vector<vector<Point> >& dst, vector<vector<Point> >& sr
     src.pop_back();
 }
 
-bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& msers, vector<Point2f>& patchCentres, int mode)
+bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& msers, vector<Point2f>& patchCentres, int mode, detectionRecord *record)
 {
+    perfStageScope stageCounters(PERF_STAGE_REFINE_PATCHES);
+
     // TODO:
     // Lots of room for improvement here, in terms of both accuracy and speed.
     // For Mode 0: include white squares for as long as possible before applying the “colour” filter.
@@ -4212,7 +5917,10 @@ bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& m
     //      between these two for a sold square MSER.
     // More specific "TODO"s are included throught this function.
 
-    int64 t = getTickCount();
+    int64 t = getTickCount(), stageStart;
+
+    detectionRecord localRecord;
+    if (record == NULL) record = &localRecord;
 
     vector<mserPatch> patches;
     vector<vector<Point> > newMsers, newerMsers, tmpMsers;
@@ -4285,6 +5993,9 @@ bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& m
     t = getTickCount();
 
     shapeFilter(patches, msers);
+
+    record->shapeFilterTime = elapsedMS(t);
+    record->shapeFilterCount = (int)msers.size();
     
     if (DEBUG_MODE > 0)
     {
@@ -4342,9 +6053,14 @@ bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& m
 
     enclosureFilter(patches, msers);
 
+    record->enclosureFilterTime = elapsedMS(t);
+    record->enclosureFilterCount = (int)msers.size();
+
     // If you've lost too many, return a failure
     if (patches.size() < ((unsigned int)totalPatches))
     {
+        record->rejection = REJECTION_ENCLOSURE_FILTER;
+
         if (DEBUG_MODE > 1)
         {
             printf("There are an insufficient (%d/%d) number of patches after enclosure filter.\n", (int)msers.size(), totalPatches);
@@ -4398,6 +6114,9 @@ bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& m
         t = getTickCount();
         clusterFilter(patches, msers, totalPatches);
 
+        record->clusterFilterTime += elapsedMS(t);
+        record->clusterFilterCount = (int)msers.size();
+
         if (DEBUG_MODE > 1)
         {
             printf("%s << Patches found after cluster filter = %d\n", __FUNCTION__, (int)msers.size());
@@ -4413,11 +6132,16 @@ bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& m
         }
 
         // If the cluster was larger than m x n (probably (m x n)+1)
+        stageStart = getTickCount();
+
         if (patches.size() > ((unsigned int)totalPatches))
         {
             reduceCluster(patches, msers, totalPatches);
         }
 
+        record->reduceClusterTime += elapsedMS(stageStart);
+        record->reduceClusterCount = (int)msers.size();
+
         if (DEBUG_MODE > 1)
         {
             printf("%s << Patches remaining after area-based reduction = %d\n", __FUNCTION__, (int)msers.size());
@@ -4498,6 +6222,8 @@ bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& m
     }
     else if (msers.size() > ((unsigned int)totalPatches))
     {
+        record->rejection = REJECTION_PATCH_COUNT;
+
         if (DEBUG_MODE > 1)
         {
             printf("%s << Too many final patches = %d/%d\n", __FUNCTION__, (int)msers.size(), totalPatches);
@@ -4506,6 +6232,8 @@ bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& m
     }
     else
     {
+        record->rejection = REJECTION_PATCH_COUNT;
+
         if (DEBUG_MODE > 1)
         {
             printf("%s << Too few final patches: %d/%d\n", __FUNCTION__, (int)msers.size(), totalPatches);
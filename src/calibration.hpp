@@ -9,6 +9,7 @@
 
 //#include "cv_utils.hpp"
 #include "improc.h"
+#include "diagnostics.hpp"
 
 // =============================================
 // INCLUDES
@@ -22,6 +23,7 @@
 
 #include <sys/stat.h>
 #include <stdio.h>
+#include <cfloat>
 
 #ifdef _WIN32
 #include <ctime>
@@ -39,6 +41,7 @@
 #define EXHAUSTIVE_SEARCH_OPTIMIZATION_CODE         5
 #define RANDOM_SEED_OPTIMIZATION_CODE               6
 #define SCORE_BASED_OPTIMIZATION_CODE               7
+#define PARTITIONED_GREEDY_OPTIMIZATION_CODE        8
 
 #define DEBUG_MODE 0
 
@@ -51,6 +54,9 @@
 #define PI 3.14159265
 
 #define MAX_CAMS 3
+
+#define CAMERA_MODEL_LENGTH 12    // fx, fy, cx, cy and eight distortion coefficients
+
 #define MAX_SEARCH_DIST 3
 
 #define REGULAR_OPENCV_CHESSBOARD_FINDER    0
@@ -69,6 +75,40 @@
 
 #define DEFAULT_CORRECTION_FACTOR 0.5
 
+// THUMBNAIL PRE-SCREEN SETTINGS
+#define DEFAULT_PRESCREEN_WIDTH         160     // thumbnail width in pixels (0 disables the pre-screen)
+#define PRESCREEN_MIN_FRACTION          0.6     // fraction of the expected patches that must be seen
+#define PRESCREEN_MAX_FRACTION          4.0     // more dark blobs than this (relative to expected) is clutter, not a board
+
+// MULTI-BOARD DETECTION SETTINGS
+#define DEFAULT_MAX_BOARDS              1
+#define MULTI_BOARD_LINK_DISTANCE       3.0     // patches further apart than this many patch widths are never lattice neighbours
+#define MULTI_BOARD_AREA_RATIO          2.5     // lattice neighbours may differ in area by at most this factor
+
+// PATTERN QUALITY SETTINGS
+#define QUALITY_MAX_STRAIGHTNESS_DIST   30.0    // as enforced by verifyPattern
+#define QUALITY_MAX_SPACING_FACTOR      2.0     // as enforced by verifyPattern
+#define QUALITY_SUBPIX_WINDOW           5       // largest half-window for the sub-pixel stability check
+#define QUALITY_RESIDUAL_SCALE          0.05    // lattice residual (fraction of corner spacing) that halves the score
+#define QUALITY_DISPLACEMENT_SCALE      0.5     // mean sub-pixel displacement (pixels) that halves the score
+#define QUALITY_SHARPNESS_SCALE         0.5     // relative sharpness at which the sharpness term is one half
+
+// DIVERSE SEEDING SETTINGS
+#define DIVERSE_SEED_SETS               4       // seed sets calibrated and scored by the N-seed search
+#define POSE_DESCRIPTOR_LENGTH          7       // board centre (2), scale, tilt (2), in-plane rotation (2)
+#define DIVERSE_SEED_RNG_STATE          0x5eed  // fixed, so that the same pool always gives the same seed sets
+
+// BATCH SELECTION SETTINGS
+#define DEFAULT_SELECTION_BATCH         1       // frames added per greedy round (1 is plain greedy selection)
+#define BATCH_MIN_SEPARATION            1.0     // least descriptor distance (in standard deviations) between frames of one batch
+#define BATCH_DIVERGENCE_TOLERANCE      0.02    // a batch may score this much worse than its best single frame and still be kept
+
+// SELECTION CONVERGENCE SETTINGS
+#define DEFAULT_PLATEAU_PATIENCE        3       // greedy rounds without a real gain before selection stops (0 runs every round)
+#define PLATEAU_MIN_RELATIVE_GAIN       0.01    // gains smaller than this fraction of the best ERE do not count
+#define PLATEAU_MIN_ROUNDS              4       // selection never stops with fewer frames than this
+#define PLATEAU_TREND_CONFIDENCE        2.0     // standard errors allowed for the ERE trend to still promise a gain
+
 // DEFAULT MSER SETTINGS
 #define MSER_delta				7.5
 #define MSER_max_variation		0.25
@@ -92,8 +132,73 @@ struct mserParameterGroup {
 	double min_margin;
 	int edge_blur_size;
 	
+	/// \brief		Pixels that MSERs may be extracted from (non-zero); empty means the whole frame
+	Mat mask;
+	
 	mserParameterGroup();
 	mserParameterGroup(double delta_, double max_variation_, double min_diversity_, int max_evolution_, double area_threshold_, double min_margin_, int edge_blur_size_);
+};
+
+/// \brief		How trustworthy a detected pattern is, measured once at detection time
+struct patternQuality {
+    /// \brief		Mean second difference along rows and columns, as a fraction of corner spacing
+    double latticeResidual;
+    /// \brief		Mean distance (in pixels) that corners move when refined again with cornerSubPix
+    double subpixDisplacement;
+    /// \brief		Mean gradient magnitude over the board relative to its intensity spread
+    double sharpness;
+    /// \brief		How far inside the verifyPattern straightness and spacing limits the pattern is (0 to 1)
+    double margin;
+    /// \brief		Combination of the above (higher is better)
+    double score;
+
+    /// \brief 		Default Constructor.
+    patternQuality();
+};
+
+/// \brief		Buffers reused by estimatePlanarPoses and the ERE evaluators, so that repeated evaluations do not allocate per view
+struct planarPoseWorkspace {
+    /// \brief		Corners of every view, concatenated
+    vector<Point2f> distorted;
+    /// \brief		The same corners undistorted into normalized camera co-ordinates
+    vector<Point2f> normalized;
+    /// \brief		Pose of every view from the last estimatePlanarPoses call: row-major rotation (9 per view) and translation (3 per view)
+    vector<double> rotations;
+    vector<double> translations;
+    /// \brief		Poses of several cameras' views, for evaluators that need them all at once (same layout, camera by camera)
+    vector<double> rigRotations;
+    vector<double> rigTranslations;
+    /// \brief		Reprojected corners, and per-corner errors
+    vector<Point2f> projected;
+    vector<Point2f> estimated;
+    vector<double> errors;
+};
+
+/// \brief		Decides when greedy selection rounds have stopped paying for themselves
+class selectionConvergence
+{
+public:
+    /// \brief 		Constructor (a patience of 0 or less never stops selection).
+    selectionConvergence(int patience = DEFAULT_PLATEAU_PATIENCE,
+                         double minRelativeGain = PLATEAU_MIN_RELATIVE_GAIN,
+                         int minRounds = PLATEAU_MIN_ROUNDS);
+
+    /// \brief      Records the best ERE of a round
+    /// \return     True once the last few rounds have brought no real gain, and the ERE trend over them promises none either
+    bool update(double roundScore);
+
+    /// \brief      Why selection stopped (empty if it has not)
+    const char *reason() const;
+
+private:
+    int patienceRounds;
+    double minGain;
+    int leastRounds;
+
+    vector<double> history;
+    double bestScore;
+    int roundsSinceGain;
+    char stopReason[256];
 };
 
 /// \brief		Class enables for storing an MSER feature beyond simply its bounding points
@@ -212,10 +317,24 @@ bool correctPatchCentres(const Mat& image, Size patternSize, vector<Point2f>& pa
 bool findPatchCorners(const Mat& image, Size patternSize, Mat& homography, vector<Point2f>& corners, vector<Point2f>& patchCentres2f, double correctionFactor, int mode, int detector = 0);
 
 /// \brief 		MSER-clustering mask corner locater
-bool findMaskCorners_1(const Mat& image, Size patternSize, vector<Point2f>& corners, mserParameterGroup mserParams, double correctionFactor, int detector = 0);
+bool findMaskCorners_1(const Mat& image, Size patternSize, vector<Point2f>& corners, mserParameterGroup mserParams, double correctionFactor, int detector = 0, detectionRecord *record = NULL);
 
 /// \brief 		Core pattern-finding function
-bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& corners, int mode, mserParameterGroup mserParams, double correctionFactor, int detector = 0);
+bool findPatternCorners(const Mat& image, Size patternSize, vector<Point2f>& corners, int mode, mserParameterGroup mserParams, double correctionFactor, int detector = 0, detectionRecord *record = NULL);
+
+/// \brief 		Refines, sorts and verifies the MSERs believed to hold a single board, and finds its corners
+bool findPatternCornersFromPatches(const Mat& image, Size patternSize, vector<vector<Point> >& msers, vector<Point2f>& corners, int mode, double correctionFactor, int detector = 0, detectionRecord *record = NULL);
+
+/// \brief      Groups patches into board candidates: connected neighbourhoods of similarly sized, evenly spaced patches
+/// \return     Number of candidates with at least minPatches patches (largest first)
+int clusterPatchesIntoBoards(vector<mserPatch>& patches, int minPatches, vector<vector<int> >& clusters);
+
+/// \brief      Finds up to maxBoards patterns in one frame, refining each candidate cluster in parallel
+/// \return     Number of boards found
+int findMultiplePatternCorners(const Mat& image, Size patternSize, vector<vector<Point2f> >& boards, int mode, mserParameterGroup mserParams, double correctionFactor, int detector = 0, int maxBoards = DEFAULT_MAX_BOARDS, detectionRecord *record = NULL);
+
+/// \brief 		Multi-board counterpart of findMaskCorners_1
+int findMultipleMaskCorners(const Mat& image, Size patternSize, vector<vector<Point2f> >& boards, mserParameterGroup mserParams, double correctionFactor, int detector = 0, int maxBoards = DEFAULT_MAX_BOARDS, detectionRecord *record = NULL);
 
 /// \brief 		Find all patches (MSERS - using default settings) in an image
 void findAllPatches(const Mat& image, Size patternSize, vector<vector<Point> >& msers, mserParameterGroup mserParams);
@@ -235,9 +354,60 @@ void randomCulling(vector<std::string>& inputList, int maxSearch, vector<vector<
 /// \brief      Culls some sets of patterns from a vector vector, and from the corresponding names list
 void randomCulling(vector<std::string>& inputList, int maxSearch, vector<vector<vector<Point2f> > >& patterns);
 
+/// \brief      Keeps the best maxSearch patterns by quality score, ordered best first, along with their names and scores
+void qualityCulling(vector<std::string>& inputList, int maxSearch, vector<vector<Point2f> >& patterns, vector<double>& scores);
+
+/// \brief      Scores a detected pattern on lattice regularity, sub-pixel stability, sharpness and verification margins
+/// \param      patternSize     Pattern size in corners
+patternQuality assessPatternQuality(const Mat& image, Size patternSize, const vector<Point2f>& corners);
+
+/// \brief      The calling thread's workspace, kept for the life of the thread (so each selection worker reuses its own)
+planarPoseWorkspace& threadPoseWorkspace();
+
+/// \brief      Board pose for every view, as solvePnP would give it, using an analytic planar (IPPE) solution
+///             Corners are undistorted with the current model, a homography is fitted and decomposed analytically, and
+///             (if refine is set) one Gauss-Newton step is taken. Non-planar object points fall back to solvePnP.
+///             Poses are left in workspace.rotations and workspace.translations.
+/// \return     Number of views posed analytically
+int estimatePlanarPoses(const vector<Point3f>& objectPoints,
+                        const vector< vector<Point2f> >& views,
+                        const Mat& cameraMatrix,
+                        const Mat& distCoeffs,
+                        planarPoseWorkspace& workspace,
+                        bool refine = true);
+
+/// \brief      Camera matrix and distortion (up to 8 coefficients, zero-padded) as fx, fy, cx, cy, k1, k2, p1, p2, k3, k4, k5, k6
+void unpackCameraModel(const Mat& cameraMatrix, const Mat& distCoeffs, double model[CAMERA_MODEL_LENGTH]);
+
+/// \brief      Projects object points under a rotation matrix and translation, as projectPoints() would
+void projectWithPose(const vector<Point3f>& objectPoints, const double R[9], const double t[3], const double model[CAMERA_MODEL_LENGTH], Point2f *imagePoints);
+
+/// \brief      Rotation matrix to rotation vector, and back (as Rodrigues() would)
+void rotationToVector(const double R[9], double rvec[3]);
+void vectorToRotation(const double rvec[3], double R[9]);
+
+/// \brief      Full planar pose of one view from normalized image points: homography, IPPE, translation, optional refinement
+/// \return     False if the view is degenerate (the caller should fall back to solvePnP)
+bool planarPoseFromNormalized(const Point3f *objectPoints, const Point2f *imagePoints, int count, bool refine, double R[9], double t[3]);
+
+/// \brief      Pose and coverage descriptor for each pattern (board centre, scale, tilt and in-plane rotation, taken
+///             from its homography), with each component standardized across the set. Needs no intrinsics.
+void patternPoseDescriptors(const vector< vector<Point2f> >& patterns, const vector<Point3f>& objectPoints, Size imSize, Mat& descriptors);
+
+/// \brief      Seed sets spread over descriptor space: the first by farthest-point sampling from the most typical pattern,
+///             the rest by k-means++ draws (from a fixed RNG state, so repeatable)
+void diverseSeedSets(const Mat& descriptors, int nSeeds, int nSets, vector< vector<int> >& seedSets);
+
+/// \brief      Best-scoring candidates (lowest positive score first) that are at least minSeparation apart in descriptor space
+/// \return     Number of candidates picked (at most batchSize; the first is always the best candidate)
+int pickDiverseBatch(const double *scores, int count, const Mat& descriptors, int batchSize, double minSeparation, vector<int>& batch);
+
 /// \brief      Checks validity of image for calibration
 bool checkAcutance();
 
+/// \brief      Cheap test on a small thumbnail for roughly the right number of evenly spaced dark patches (mask pattern)
+bool prescreenPattern(const Mat& image, Size patternSize, int thumbnailWidth = DEFAULT_PRESCREEN_WIDTH, int *blobCount = NULL);
+
 /// \brief 		Determines how many patches can be found in each row and extreme columns
 void determineFindablePatches(Size patternSize, int mode, int *XVec, int *YVec);
 
@@ -251,7 +421,7 @@ void determinePatchDistribution(Size patternSize, int mode, int& rows, int& cols
 void debugDisplayPatches(const Mat& image, vector<vector<Point> >& msers);
 
 /// \brief 		Applies various area, colour and positional filters to reduce no. of patches to desired amount
-bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& msers, vector<Point2f>& patchCentres, int mode);
+bool refinePatches(const Mat& image, Size patternSize, vector<vector<Point> >& msers, vector<Point2f>& patchCentres, int mode, detectionRecord *record = NULL);
 
 /// \brief          Checks that the entire pattern is inside the frame by at least a specified margin.
 bool patternInFrame(Size imSize, vector<Point2f>& patternPoints, int minBorder = 2);
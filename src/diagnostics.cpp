@@ -0,0 +1,786 @@
+#include "diagnostics.hpp"
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <algorithm>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+detectionRecord::detectionRecord() :
+    camera(-1),
+    frame(-1),
+    decodeTime(0.0),
+    prescreenTime(0.0),
+    mserTime(0.0),
+    shapeFilterTime(0.0),
+    enclosureFilterTime(0.0),
+    clusterFilterTime(0.0),
+    reduceClusterTime(0.0),
+    verificationTime(0.0),
+    cornerTime(0.0),
+    totalTime(0.0),
+    prescreenCount(-1),
+    mserCount(-1),
+    shapeFilterCount(-1),
+    enclosureFilterCount(-1),
+    clusterFilterCount(-1),
+    reduceClusterCount(-1),
+    cornerCount(0),
+    rejection(REJECTION_NONE)
+{
+}
+
+const char *rejectionReasonString(int rejection)
+{
+    static const char *reasons[REJECTION_CODE_COUNT] = {
+        "none",
+        "empty_frame",
+        "insufficient_msers",
+        "enclosure_filter",
+        "patch_count",
+        "patches_out_of_frame",
+        "verification_failed",
+        "corner_search_failed",
+        "corners_out_of_frame",
+        "chessboard_not_found",
+        "prescreen_failed"
+    };
+
+    if ((rejection < 0) || (rejection >= REJECTION_CODE_COUNT))
+    {
+        return "unknown";
+    }
+
+    return reasons[rejection];
+}
+
+detectionLog::detectionLog() :
+    file(NULL),
+    binary(false)
+{
+}
+
+detectionLog::~detectionLog()
+{
+    close();
+}
+
+bool detectionLog::open(const char *filename)
+{
+    close();
+
+    size_t length = strlen(filename);
+    binary = (length > 4) && !strcmp(filename + length - 4, ".bin");
+
+    file = fopen(filename, binary ? "wb" : "w");
+
+    if (file == NULL)
+    {
+        printf("%s << ERROR. Could not open (%s) for writing.\n", __FUNCTION__, filename);
+        return false;
+    }
+
+    if (binary)
+    {
+        // Records are dumped as-is, so readers check the record size as well as the version
+        unsigned int header[2] = { DETECTION_LOG_FILE_VERSION, (unsigned int) sizeof(detectionRecord) };
+        fwrite(DETECTION_LOG_MAGIC, 1, 4, file);
+        fwrite(header, sizeof(unsigned int), 2, file);
+    }
+    else
+    {
+        fprintf(file, "camera,frame,decode_ms,prescreen_ms,mser_ms,shape_filter_ms,enclosure_filter_ms,cluster_filter_ms,reduce_cluster_ms,verification_ms,corner_ms,total_ms,");
+        fprintf(file, "prescreen_blobs,mser_count,after_shape_filter,after_enclosure_filter,after_cluster_filter,after_reduce_cluster,corner_count,rejection\n");
+    }
+
+    return true;
+}
+
+void detectionLog::write(const detectionRecord& record)
+{
+    if (file == NULL)
+    {
+        return;
+    }
+
+    if (binary)
+    {
+        fwrite(&record, sizeof(detectionRecord), 1, file);
+        return;
+    }
+
+    fprintf(file, "%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%d,%d,%d,%d,%d,%d,%s\n",
+            record.camera,
+            record.frame,
+            record.decodeTime,
+            record.prescreenTime,
+            record.mserTime,
+            record.shapeFilterTime,
+            record.enclosureFilterTime,
+            record.clusterFilterTime,
+            record.reduceClusterTime,
+            record.verificationTime,
+            record.cornerTime,
+            record.totalTime,
+            record.prescreenCount,
+            record.mserCount,
+            record.shapeFilterCount,
+            record.enclosureFilterCount,
+            record.clusterFilterCount,
+            record.reduceClusterCount,
+            record.cornerCount,
+            rejectionReasonString(record.rejection));
+}
+
+void detectionLog::close()
+{
+    if (file != NULL)
+    {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+bool detectionLog::isOpen() const
+{
+    return (file != NULL);
+}
+
+progressReporter::progressReporter() :
+    enabled(false),
+    intervalTicks(0),
+    totalUnits(0),
+    completedUnits(0),
+    bestScore(-1.0),
+    stageStart(0),
+    lastReport(0)
+{
+}
+
+progressReporter::~progressReporter()
+{
+}
+
+void progressReporter::setInterval(double seconds)
+{
+    enabled = (seconds > 0.0);
+    intervalTicks = (int64)(seconds * getTickFrequency());
+}
+
+void progressReporter::setStatusFile(const char *filename)
+{
+    statusFilename = (filename == NULL) ? "" : filename;
+}
+
+void progressReporter::beginStage(const char *name, long total, const char *unit)
+{
+    stageName = name;
+    unitName = unit;
+    totalUnits = total;
+    completedUnits = 0;
+    bestScore = -1.0;
+    stageStart = getTickCount();
+    lastReport = stageStart;
+}
+
+void progressReporter::update(long completed, double score)
+{
+    if (!enabled)
+    {
+        return;
+    }
+
+    completedUnits = completed;
+
+    if ((score >= 0.0) && ((bestScore < 0.0) || (score < bestScore)))
+    {
+        bestScore = score;
+    }
+
+    // A single tick comparison is all it costs between reports
+    int64 now = getTickCount();
+
+    if ((now - lastReport) < intervalTicks)
+    {
+        return;
+    }
+
+    lastReport = now;
+    report(false);
+}
+
+void progressReporter::endStage()
+{
+    if (!enabled)
+    {
+        return;
+    }
+
+    report(true);
+}
+
+bool progressReporter::isEnabled() const
+{
+    return enabled;
+}
+
+void progressReporter::report(bool final)
+{
+    double elapsed = double(getTickCount() - stageStart) / getTickFrequency();
+    double rate = (elapsed > 0.0) ? (completedUnits / elapsed) : 0.0;
+
+    char line[512];
+    int length = 0;
+
+    if (totalUnits > 0)
+    {
+        length += sprintf(line + length, "[%s] %ld/%ld %s (%.1f%%) | %.2f %s/s", stageName.c_str(), completedUnits, totalUnits, unitName.c_str(), 100.0 * completedUnits / totalUnits, rate, unitName.c_str());
+    }
+    else
+    {
+        length += sprintf(line + length, "[%s] %ld %s | %.2f %s/s", stageName.c_str(), completedUnits, unitName.c_str(), rate, unitName.c_str());
+    }
+
+    if (bestScore >= 0.0)
+    {
+        length += sprintf(line + length, " | best %f", bestScore);
+    }
+
+    if (final)
+    {
+        length += sprintf(line + length, " | done in %.1fs", elapsed);
+    }
+    else if ((totalUnits > 0) && (rate > 0.0))
+    {
+        int remaining = int(max(totalUnits - completedUnits, 0L) / rate);
+        length += sprintf(line + length, " | ETA %02d:%02d:%02d", remaining / 3600, (remaining / 60) % 60, remaining % 60);
+    }
+
+    if (statusFilename.empty())
+    {
+        fprintf(stderr, "%s\n", line);
+        return;
+    }
+
+    // The status file always holds just the latest report, so it can be polled
+    FILE *file = fopen(statusFilename.c_str(), "w");
+
+    if (file != NULL)
+    {
+        fprintf(file, "%s\n", line);
+        fclose(file);
+    }
+}
+
+size_t currentResidentBytes()
+{
+#if defined(WIN32)
+    return 0;
+#else
+    long pages = 0, residentPages = 0;
+
+    FILE *file = fopen("/proc/self/statm", "r");
+
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    if (fscanf(file, "%ld %ld", &pages, &residentPages) != 2)
+    {
+        residentPages = 0;
+    }
+
+    fclose(file);
+
+    return (size_t) residentPages * (size_t) sysconf(_SC_PAGESIZE);
+#endif
+}
+
+size_t peakResidentBytes()
+{
+#if defined(WIN32)
+    return 0;
+#else
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+
+    // ru_maxrss is reported in kilobytes on Linux
+    return (size_t) usage.ru_maxrss * 1024;
+#endif
+}
+
+size_t matrixBytes(const Mat& mat)
+{
+    return mat.total() * mat.elemSize();
+}
+
+size_t pointSetBytes(const vector<vector<Point2f> >& pointSets)
+{
+    size_t total = 0;
+
+    for (unsigned int iii = 0; iii < pointSets.size(); iii++)
+    {
+        total += pointSets[iii].size() * sizeof(Point2f);
+    }
+
+    return total;
+}
+
+memoryAccount::memoryAccount() :
+    budget(0),
+    peakSample(0)
+{
+    for (int iii = 0; iii < MEMORY_STAGE_COUNT; iii++)
+    {
+        current[iii] = 0;
+        peak[iii] = 0;
+    }
+}
+
+void memoryAccount::setBudget(size_t bytes)
+{
+    budget = bytes;
+}
+
+bool memoryAccount::hasBudget() const
+{
+    return (budget > 0);
+}
+
+void memoryAccount::allocate(int stage, size_t bytes)
+{
+    current[stage] += bytes;
+    peak[stage] = max(peak[stage], current[stage]);
+}
+
+void memoryAccount::release(int stage, size_t bytes)
+{
+    current[stage] -= min(current[stage], bytes);
+}
+
+size_t memoryAccount::trackedBytes() const
+{
+    size_t total = 0;
+
+    for (int iii = 0; iii < MEMORY_STAGE_COUNT; iii++)
+    {
+        total += current[iii];
+    }
+
+    return total;
+}
+
+size_t memoryAccount::usedBytes() const
+{
+    // The resident set also covers untracked allocations (OpenCV internals, the heap itself), so trust whichever is larger
+    return max(trackedBytes(), currentResidentBytes());
+}
+
+bool memoryAccount::withinBudget(size_t additionalBytes) const
+{
+    if (budget == 0)
+    {
+        return true;
+    }
+
+    return ((usedBytes() + additionalBytes) <= budget);
+}
+
+unsigned int memoryAccount::inFlightLimit(size_t bufferBytes, unsigned int requested) const
+{
+    if ((budget == 0) || (bufferBytes == 0))
+    {
+        return requested;
+    }
+
+    size_t used = usedBytes();
+    size_t available = (used < budget) ? (budget - used) : 0;
+
+    return (unsigned int) max((size_t) 1, min((size_t) requested, available / bufferBytes));
+}
+
+void memoryAccount::sample(const char *label)
+{
+    size_t resident = currentResidentBytes();
+
+    if (resident > peakSample)
+    {
+        peakSample = resident;
+        peakLabel = label;
+    }
+}
+
+void memoryAccount::report() const
+{
+    static const char *stageNames[MEMORY_STAGE_COUNT] = {
+        "corner storage",
+        "candidate copies",
+        "distribution maps"
+    };
+
+    const double MB = 1024.0 * 1024.0;
+
+    printf("%s << Memory usage by stage (current / peak):\n", __FUNCTION__);
+
+    for (int iii = 0; iii < MEMORY_STAGE_COUNT; iii++)
+    {
+        printf("%s << %20s : %10.2f MB / %10.2f MB\n", __FUNCTION__, stageNames[iii], current[iii] / MB, peak[iii] / MB);
+    }
+
+    if (peakSample > 0)
+    {
+        printf("%s << Highest sampled RSS = %.2f MB (after %s)\n", __FUNCTION__, peakSample / MB, peakLabel.c_str());
+    }
+
+    printf("%s << Peak RSS = %.2f MB\n", __FUNCTION__, peakResidentBytes() / MB);
+
+    if (budget > 0)
+    {
+        printf("%s << Budget = %.2f MB\n", __FUNCTION__, budget / MB);
+    }
+}
+
+/// \brief      What has been accumulated against each stage
+struct perfStageTotals
+{
+    perfStageTotals();
+
+    /// \brief      Adds another set of totals to these
+    void add(const perfStageTotals& other);
+
+    long calls[PERF_STAGE_COUNT];
+    double wallTime[PERF_STAGE_COUNT];
+    unsigned long long totals[PERF_STAGE_COUNT][PERF_COUNTER_COUNT];
+};
+
+/// \brief      Counters opened for a single thread, and what they have accumulated against each stage
+class perfThreadCounters : public perfStageTotals
+{
+public:
+    perfThreadCounters(int id);
+
+    /// \brief      Closes the thread's counters
+    ~perfThreadCounters();
+
+    /// \brief      Reads the current value of every counter (unavailable counters read as 0)
+    void read(unsigned long long values[PERF_COUNTER_COUNT]) const;
+
+    int threadId;
+    int descriptors[PERF_COUNTER_COUNT];
+};
+
+static const char *perfStageNames[PERF_STAGE_COUNT] = {
+    "findAllPatches",
+    "refinePatches",
+    "findPatchCorners",
+    "calibrateCamera",
+    "calculateERE",
+    "calculateExtrinsicERE",
+    "estimatePlanarPoses"
+};
+
+static const char *perfCounterNames[PERF_COUNTER_COUNT] = {
+    "cycles",
+    "instructions",
+    "cache-misses",
+    "branch-misses"
+};
+
+static bool perfSamplingEnabled = false;
+static bool perfCounterAvailable[PERF_COUNTER_COUNT] = { true, true, true, true };
+static bool perfWarningGiven = false;
+
+static boost::mutex perfRegistryMutex;
+static vector<perfThreadCounters*> perfRegistry;
+static int perfThreadsSeen = 0;
+
+// Totals of threads that have exited (their counters are closed, so descriptors do not pile up across thread pools)
+static perfStageTotals perfRetired;
+static int perfRetiredThreads = 0;
+
+static void retirePerfCounters(perfThreadCounters *counters)
+{
+    boost::mutex::scoped_lock lock(perfRegistryMutex);
+
+    perfRetired.add(*counters);
+    perfRetiredThreads++;
+
+    perfRegistry.erase(remove(perfRegistry.begin(), perfRegistry.end(), counters), perfRegistry.end());
+
+    delete counters;
+}
+
+static boost::thread_specific_ptr<perfThreadCounters> perfThreadLocal(retirePerfCounters);
+
+static int openPerfCounter(int counter)
+{
+#if defined(__linux__)
+    static const unsigned long long configs[PERF_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[counter];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // Counts the calling thread only, on whichever CPU it happens to run
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+perfStageTotals::perfStageTotals()
+{
+    for (int iii = 0; iii < PERF_STAGE_COUNT; iii++)
+    {
+        calls[iii] = 0;
+        wallTime[iii] = 0.0;
+
+        for (int jjj = 0; jjj < PERF_COUNTER_COUNT; jjj++)
+        {
+            totals[iii][jjj] = 0;
+        }
+    }
+}
+
+void perfStageTotals::add(const perfStageTotals& other)
+{
+    for (int iii = 0; iii < PERF_STAGE_COUNT; iii++)
+    {
+        calls[iii] += other.calls[iii];
+        wallTime[iii] += other.wallTime[iii];
+
+        for (int jjj = 0; jjj < PERF_COUNTER_COUNT; jjj++)
+        {
+            totals[iii][jjj] += other.totals[iii][jjj];
+        }
+    }
+}
+
+perfThreadCounters::perfThreadCounters(int id) :
+    threadId(id)
+{
+    for (int iii = 0; iii < PERF_COUNTER_COUNT; iii++)
+    {
+        descriptors[iii] = perfCounterAvailable[iii] ? openPerfCounter(iii) : -1;
+
+        if (descriptors[iii] < 0)
+        {
+            // Not supported here (VM, old kernel, perf_event_paranoid) - wall time is still recorded
+            if (perfCounterAvailable[iii])
+            {
+                printf("%s << WARNING. Hardware counter (%s) is unavailable (%s); it will not be reported.\n", __FUNCTION__, perfCounterNames[iii], strerror(errno));
+                perfWarningGiven = true;
+            }
+
+            perfCounterAvailable[iii] = false;
+        }
+    }
+}
+
+perfThreadCounters::~perfThreadCounters()
+{
+#if !defined(WIN32)
+    for (int iii = 0; iii < PERF_COUNTER_COUNT; iii++)
+    {
+        if (descriptors[iii] >= 0)
+        {
+            close(descriptors[iii]);
+        }
+    }
+#endif
+}
+
+void perfThreadCounters::read(unsigned long long values[PERF_COUNTER_COUNT]) const
+{
+    for (int iii = 0; iii < PERF_COUNTER_COUNT; iii++)
+    {
+        values[iii] = 0;
+
+#if !defined(WIN32)
+        if (descriptors[iii] >= 0)
+        {
+            if (::read(descriptors[iii], &values[iii], sizeof(values[iii])) != sizeof(values[iii]))
+            {
+                values[iii] = 0;
+            }
+        }
+#endif
+    }
+}
+
+void enablePerfCounters(bool enable)
+{
+    perfSamplingEnabled = enable;
+}
+
+bool perfCountersEnabled()
+{
+    return perfSamplingEnabled;
+}
+
+perfStageScope::perfStageScope(int stageCode) :
+    counters(NULL),
+    stage(stageCode),
+    startTick(0)
+{
+    if (!perfSamplingEnabled)
+    {
+        return;
+    }
+
+    counters = perfThreadLocal.get();
+
+    if (counters == NULL)
+    {
+        // First sampled stage on this thread, so open its counters
+        boost::mutex::scoped_lock lock(perfRegistryMutex);
+
+        counters = new perfThreadCounters(perfThreadsSeen++);
+        perfRegistry.push_back(counters);
+        perfThreadLocal.reset(counters);
+    }
+
+    counters->read(startValues);
+    startTick = getTickCount();
+}
+
+perfStageScope::~perfStageScope()
+{
+    if (counters == NULL)
+    {
+        return;
+    }
+
+    unsigned long long endValues[PERF_COUNTER_COUNT];
+    counters->read(endValues);
+
+    counters->calls[stage]++;
+    counters->wallTime[stage] += elapsedMS(startTick);
+
+    for (int iii = 0; iii < PERF_COUNTER_COUNT; iii++)
+    {
+        counters->totals[stage][iii] += endValues[iii] - startValues[iii];
+    }
+}
+
+static void printPerfCounterLine(const char *label, long calls, double wallTime, const unsigned long long values[PERF_COUNTER_COUNT])
+{
+    char counts[PERF_COUNTER_COUNT][32];
+
+    for (int iii = 0; iii < PERF_COUNTER_COUNT; iii++)
+    {
+        if (perfCounterAvailable[iii])
+        {
+            sprintf(counts[iii], "%14llu", values[iii]);
+        }
+        else
+        {
+            sprintf(counts[iii], "%14s", "n/a");
+        }
+    }
+
+    char ipc[16];
+
+    if (perfCounterAvailable[PERF_COUNTER_CYCLES] && perfCounterAvailable[PERF_COUNTER_INSTRUCTIONS] && (values[PERF_COUNTER_CYCLES] > 0))
+    {
+        sprintf(ipc, "%5.2f", double(values[PERF_COUNTER_INSTRUCTIONS]) / double(values[PERF_COUNTER_CYCLES]));
+    }
+    else
+    {
+        sprintf(ipc, "%5s", "n/a");
+    }
+
+    printf("reportPerfCounters << %-28s %8ld %12.1f %s %s %s %s %s\n", label, calls, wallTime, counts[PERF_COUNTER_CYCLES], counts[PERF_COUNTER_INSTRUCTIONS], ipc, counts[PERF_COUNTER_CACHE_MISSES], counts[PERF_COUNTER_BRANCH_MISSES]);
+}
+
+void reportPerfCounters()
+{
+    boost::mutex::scoped_lock lock(perfRegistryMutex);
+
+    if ((perfRegistry.size() == 0) && (perfRetiredThreads == 0))
+    {
+        return;
+    }
+
+    printf("%s << %-28s %8s %12s %14s %14s %5s %14s %14s\n", __FUNCTION__, "stage [thread]", "calls", "wall ms", "cycles", "instructions", "IPC", "cache-misses", "branch-misses");
+
+    for (int stage = 0; stage < PERF_STAGE_COUNT; stage++)
+    {
+        long calls = perfRetired.calls[stage];
+        double wallTime = perfRetired.wallTime[stage];
+        unsigned long long values[PERF_COUNTER_COUNT] = { 0, 0, 0, 0 };
+
+        for (int jjj = 0; jjj < PERF_COUNTER_COUNT; jjj++)
+        {
+            values[jjj] = perfRetired.totals[stage][jjj];
+        }
+
+        for (unsigned int iii = 0; iii < perfRegistry.size(); iii++)
+        {
+            calls += perfRegistry[iii]->calls[stage];
+            wallTime += perfRegistry[iii]->wallTime[stage];
+
+            for (int jjj = 0; jjj < PERF_COUNTER_COUNT; jjj++)
+            {
+                values[jjj] += perfRegistry[iii]->totals[stage][jjj];
+            }
+        }
+
+        if (calls == 0)
+        {
+            continue;
+        }
+
+        printPerfCounterLine(perfStageNames[stage], calls, wallTime, values);
+
+        // Only break the stage down by thread when more than one thread ran it
+        if (perfRegistry.size() + perfRetiredThreads > 1)
+        {
+            for (unsigned int iii = 0; iii < perfRegistry.size(); iii++)
+            {
+                if (perfRegistry[iii]->calls[stage] == 0)
+                {
+                    continue;
+                }
+
+                char label[64];
+                sprintf(label, "  [%d]", perfRegistry[iii]->threadId);
+
+                printPerfCounterLine(label, perfRegistry[iii]->calls[stage], perfRegistry[iii]->wallTime[stage], perfRegistry[iii]->totals[stage]);
+            }
+
+            if (perfRetired.calls[stage] > 0)
+            {
+                char label[64];
+                sprintf(label, "  [%d exited]", perfRetiredThreads);
+
+                printPerfCounterLine(label, perfRetired.calls[stage], perfRetired.wallTime[stage], perfRetired.totals[stage]);
+            }
+        }
+    }
+
+    if (perfWarningGiven)
+    {
+        printf("%s << Some counters were unavailable; lowering /proc/sys/kernel/perf_event_paranoid may help.\n", __FUNCTION__);
+    }
+}
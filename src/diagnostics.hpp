@@ -0,0 +1,260 @@
+/*! \file	diagnostics.hpp
+ *  \brief	Header file for run-time diagnostics (per-frame detection log, progress reporting, memory accounting,
+ *          hardware performance counters).
+ *
+ * Everything here is intended to be cheap enough to leave switched on for full datasets.
+ */
+
+#ifndef DIAGNOSTICS_HPP
+#define DIAGNOSTICS_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#if !defined(WIN32)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace cv;
+
+#define DEFAULT_PROGRESS_INTERVAL       5.0     // seconds between progress reports (0 disables them)
+
+// Stages that memory is accounted against
+#define MEMORY_STAGE_CORNERS            0
+#define MEMORY_STAGE_CANDIDATES         1
+#define MEMORY_STAGE_MAPS               2
+#define MEMORY_STAGE_COUNT              3
+
+// Stages sampled with hardware performance counters (a stage includes any stages it calls)
+#define PERF_STAGE_FIND_ALL_PATCHES     0
+#define PERF_STAGE_REFINE_PATCHES       1
+#define PERF_STAGE_FIND_PATCH_CORNERS   2
+#define PERF_STAGE_CALIBRATE_CAMERA     3
+#define PERF_STAGE_CALCULATE_ERE        4
+#define PERF_STAGE_EXTRINSIC_ERE        5
+#define PERF_STAGE_PLANAR_POSE          6
+#define PERF_STAGE_COUNT                7
+
+#define PERF_COUNTER_CYCLES             0
+#define PERF_COUNTER_INSTRUCTIONS       1
+#define PERF_COUNTER_CACHE_MISSES       2
+#define PERF_COUNTER_BRANCH_MISSES      3
+#define PERF_COUNTER_COUNT              4
+
+#define DETECTION_LOG_MAGIC             "MMDL"
+#define DETECTION_LOG_FILE_VERSION      2
+
+// Reasons for a frame being rejected by the pattern finder
+#define REJECTION_NONE                  0
+#define REJECTION_EMPTY_FRAME           1
+#define REJECTION_INSUFFICIENT_MSERS    2
+#define REJECTION_ENCLOSURE_FILTER      3
+#define REJECTION_PATCH_COUNT           4
+#define REJECTION_PATCHES_OUT_OF_FRAME  5
+#define REJECTION_VERIFICATION_FAILED   6
+#define REJECTION_CORNER_SEARCH_FAILED  7
+#define REJECTION_CORNERS_OUT_OF_FRAME  8
+#define REJECTION_CHESSBOARD_NOT_FOUND  9
+#define REJECTION_PRESCREEN             10
+#define REJECTION_CODE_COUNT            11
+
+/// \brief      Everything measured while searching a single frame for a pattern (times are in ms, counts of -1 mean the stage was not reached)
+struct detectionRecord {
+    int camera;
+    int frame;
+
+    double decodeTime;
+    double prescreenTime;
+    double mserTime;
+    double shapeFilterTime;
+    double enclosureFilterTime;
+    double clusterFilterTime;
+    double reduceClusterTime;
+    double verificationTime;
+    double cornerTime;
+    double totalTime;
+
+    int prescreenCount;
+    int mserCount;
+    int shapeFilterCount;
+    int enclosureFilterCount;
+    int clusterFilterCount;
+    int reduceClusterCount;
+    int cornerCount;
+
+    int rejection;
+
+    /// \brief 		Default Constructor.
+    detectionRecord();
+};
+
+/// \brief      Milliseconds elapsed since a getTickCount() reading
+inline double elapsedMS(int64 startTick)
+{
+    return double(getTickCount() - startTick) * 1000.0 / getTickFrequency();
+}
+
+/// \brief      Short, CSV-safe description of a rejection code
+const char *rejectionReasonString(int rejection);
+
+/// \brief      Appends detectionRecords to a CSV file, or to a binary file if the filename ends in ".bin"
+class detectionLog
+{
+public:
+    /// \brief 		Default Constructor.
+    detectionLog();
+
+    /// \brief 		Destructor (closes the file).
+    ~detectionLog();
+
+    /// \brief      Opens the log (and writes its header)
+    bool open(const char *filename);
+
+    /// \brief      Appends a single record
+    void write(const detectionRecord& record);
+
+    /// \brief      Flushes and closes the log
+    void close();
+
+    /// \brief      Whether the log is currently accepting records
+    bool isOpen() const;
+
+private:
+    FILE *file;
+    bool binary;
+};
+
+/// \brief      Rate-limited reporter of throughput, best score and ETA for the current stage
+class progressReporter
+{
+public:
+    /// \brief 		Default Constructor (reporting disabled until an interval is set).
+    progressReporter();
+
+    /// \brief 		Destructor.
+    ~progressReporter();
+
+    /// \brief      Minimum number of seconds between reports (0 or less disables reporting)
+    void setInterval(double seconds);
+
+    /// \brief      Sends reports to a status file (rewritten on each report) instead of stderr
+    void setStatusFile(const char *filename);
+
+    /// \brief      Starts timing a new stage; a total of 0 means the amount of work is unknown (no ETA)
+    void beginStage(const char *name, long total, const char *unit);
+
+    /// \brief      Records progress within the current stage; only produces output once the interval has passed
+    void update(long completed, double bestScore = -1.0);
+
+    /// \brief      Emits a final report for the current stage
+    void endStage();
+
+    /// \brief      Whether reports will be produced at all
+    bool isEnabled() const;
+
+private:
+    void report(bool final);
+
+    bool enabled;
+    int64 intervalTicks;
+    string statusFilename;
+
+    string stageName;
+    string unitName;
+    long totalUnits;
+    long completedUnits;
+    double bestScore;
+    int64 stageStart;
+    int64 lastReport;
+};
+
+/// \brief      Current resident set size of this process in bytes (0 if unavailable)
+size_t currentResidentBytes();
+
+/// \brief      Peak resident set size of this process in bytes (0 if unavailable)
+size_t peakResidentBytes();
+
+/// \brief      Number of bytes of pixel data held by a matrix
+size_t matrixBytes(const Mat& mat);
+
+/// \brief      Number of bytes of point data held by a list of pointsets
+size_t pointSetBytes(const vector<vector<Point2f> >& pointSets);
+
+/// \brief      Tracks memory held by each pipeline stage against an optional budget
+class memoryAccount
+{
+public:
+    /// \brief 		Default Constructor (no budget).
+    memoryAccount();
+
+    /// \brief      Sets the budget in bytes (0 means unlimited)
+    void setBudget(size_t bytes);
+
+    /// \brief      Whether a budget has been set
+    bool hasBudget() const;
+
+    /// \brief      Records memory now held by a stage
+    void allocate(int stage, size_t bytes);
+
+    /// \brief      Records memory a stage has given back
+    void release(int stage, size_t bytes);
+
+    /// \brief      Total bytes currently accounted across all stages
+    size_t trackedBytes() const;
+
+    /// \brief      Whether holding a further number of bytes would keep the process within budget
+    bool withinBudget(size_t additionalBytes) const;
+
+    /// \brief      How many buffers of the given size may be in flight at once, capped at the requested number
+    unsigned int inFlightLimit(size_t bufferBytes, unsigned int requested) const;
+
+    /// \brief      Samples the resident set size, remembering the stage at which it peaked
+    void sample(const char *label);
+
+    /// \brief      Prints per-stage current and peak usage, plus the peak resident set size
+    void report() const;
+
+private:
+    size_t usedBytes() const;
+
+    size_t budget;
+    size_t current[MEMORY_STAGE_COUNT];
+    size_t peak[MEMORY_STAGE_COUNT];
+    size_t peakSample;
+    string peakLabel;
+};
+
+class perfThreadCounters;
+
+/// \brief      Turns hardware counter sampling on or off (off by default, in which case stages cost a single check)
+void enablePerfCounters(bool enable);
+
+/// \brief      Whether stages are currently being sampled
+bool perfCountersEnabled();
+
+/// \brief      Prints counter totals for each stage, overall and per thread
+void reportPerfCounters();
+
+/// \brief      Accumulates the calling thread's counters against a stage for as long as it is in scope
+class perfStageScope
+{
+public:
+    /// \brief 		Constructor with the stage to account to (one of the PERF_STAGE_* codes).
+    perfStageScope(int stageCode);
+
+    /// \brief 		Destructor (adds the counts since construction to the stage).
+    ~perfStageScope();
+
+private:
+    perfThreadCounters *counters;
+    int stage;
+    int64 startTick;
+    unsigned long long startValues[PERF_COUNTER_COUNT];
+};
+
+#endif
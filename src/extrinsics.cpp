@@ -2,76 +2,79 @@
 
 double calculateExtrinsicERE(int nCams,
                              cv::vector<Point3f>& physicalPoints,
-                             cv::vector< cv::vector< cv::vector<Point2f> > > corners,
+                             const cv::vector< cv::vector< cv::vector<Point2f> > >& corners,
                              Mat *cameraMatrix,
                              Mat *distCoeffs,
                              Mat *R,
                              Mat *T)
 {
+    perfStageScope stageCounters(PERF_STAGE_EXTRINSIC_ERE);
 
     int ptsPerSet = physicalPoints.size();
     int numFrames = corners.at(0).size();
 
-    Mat *fsRvec, *fsTvec, *esRvec, *esTvec;
-    fsRvec = new Mat[nCams];
-    fsTvec = new Mat[nCams];
-    esRvec = new Mat[nCams];
-    esTvec = new Mat[nCams];
+    // Buffers belong to the calling thread and are reused by every evaluation it makes
+    planarPoseWorkspace& poseWorkspace = threadPoseWorkspace();
 
-    cv::vector<Point2f> *estimatedPattern, *projectedPattern;
-    estimatedPattern = new cv::vector<Point2f>[nCams];
-    projectedPattern = new cv::vector<Point2f>[nCams];
+    poseWorkspace.estimated.resize(ptsPerSet);
+    poseWorkspace.projected.resize(ptsPerSet);
 
-    for (int k = 0; k < nCams; k++)
-    {
-        estimatedPattern[k].resize(physicalPoints.size());
-        projectedPattern[k].resize(physicalPoints.size());
-    }
+    double tSum = 0;
 
-    double *errors;
+    double xError, yError, error;
 
-    double tSum = 0, tMean = 0, tDev = 0;
+    // Estimate pose of every board in one batch per camera, keeping each camera's poses side by side
+    poseWorkspace.rigRotations.resize(nCams * numFrames * 9);
+    poseWorkspace.rigTranslations.resize(nCams * numFrames * 3);
 
-    double xError, yError;
+    double models[MAX_CAMS][CAMERA_MODEL_LENGTH];
 
-    int maxCapacity = numFrames*ptsPerSet*nCams;
+    for (int k = 0; k < nCams; k++)
+    {
+        unpackCameraModel(cameraMatrix[k], distCoeffs[k], models[k]);
 
-    errors = new double[maxCapacity];
+        estimatePlanarPoses(physicalPoints, corners.at(k), cameraMatrix[k], distCoeffs[k], poseWorkspace);
 
-    Mat physPtsMat = Mat(physicalPoints);
-    Mat cornersMat;
+        copy(poseWorkspace.rotations.begin(), poseWorkspace.rotations.begin() + numFrames * 9, poseWorkspace.rigRotations.begin() + k * numFrames * 9);
+        copy(poseWorkspace.translations.begin(), poseWorkspace.translations.begin() + numFrames * 3, poseWorkspace.rigTranslations.begin() + k * numFrames * 3);
+    }
 
-    int index = 0;
+    double fsRvec[3], esRvec[3], esRotation[9], esTvec[3];
 
     for (int i = 0; i < numFrames; i++)
     {
+        const double *baseRotation = &poseWorkspace.rigRotations[i * 9];
+        const double *baseTranslation = &poseWorkspace.rigTranslations[i * 3];
+
+        rotationToVector(baseRotation, fsRvec);
 
         for (int k = 0; k < nCams; k++)
         {
+            const double *frameRotation = &poseWorkspace.rigRotations[(k * numFrames + i) * 9];
+            const double *frameTranslation = &poseWorkspace.rigTranslations[(k * numFrames + i) * 3];
 
-            cornersMat = Mat(corners.at(k).at(i));
+            projectWithPose(physicalPoints, frameRotation, frameTranslation, models[k], &poseWorkspace.estimated[0]);
 
-            solvePnP(physPtsMat, cornersMat, cameraMatrix[k], distCoeffs[k], fsRvec[k], fsTvec[k], false);
-
-            projectPoints(Mat(physicalPoints), fsRvec[k], fsTvec[k], cameraMatrix[k], distCoeffs[k], estimatedPattern[k]);
-
-            esRvec[k] = R[k] * fsRvec[0];
+            // Camera 0's pose carried across by the extrinsics: R[k] * rvec, tvec + T[k]
+            for (int r = 0; r < 3; r++)
+            {
+                esRvec[r] = R[k].at<double>(r, 0) * fsRvec[0] + R[k].at<double>(r, 1) * fsRvec[1] + R[k].at<double>(r, 2) * fsRvec[2];
+                esTvec[r] = baseTranslation[r] + T[k].at<double>(r, 0);
+            }
 
-            esTvec[k] = fsTvec[0] + T[k];
+            vectorToRotation(esRvec, esRotation);
 
-            projectPoints(Mat(physicalPoints), esRvec[k], esTvec[k], cameraMatrix[k], distCoeffs[k], projectedPattern[k]);
+            projectWithPose(physicalPoints, esRotation, esTvec, models[k], &poseWorkspace.projected[0]);
 
-            for (unsigned int j = 0; j < estimatedPattern[k].size(); j++)
+            for (int j = 0; j < ptsPerSet; j++)
             {
 
-                xError = abs(projectedPattern[k].at(j).x - estimatedPattern[k].at(j).x);
-                yError = abs(projectedPattern[k].at(j).y - estimatedPattern[k].at(j).y);
+                xError = fabs(poseWorkspace.projected[j].x - poseWorkspace.estimated[j].x);
+                yError = fabs(poseWorkspace.projected[j].y - poseWorkspace.estimated[j].y);
 
-                errors[index] = pow(pow(xError, 2)+pow(yError, 2), 0.5);
+                error = pow(pow(xError, 2)+pow(yError, 2), 0.5);
 
-                tSum += (errors[index] / (double(ptsPerSet) * double(nCams)));
-
-                index++;
+                tSum += (error / (double(ptsPerSet) * double(nCams)));
             }
 
         }
@@ -79,16 +82,6 @@ double calculateExtrinsicERE(int nCams,
 
     double err = tSum / double(numFrames);
 
-    delete[] fsRvec;
-    delete[] fsTvec;
-    delete[] esRvec;
-    delete[] esTvec;
-
-    delete[] estimatedPattern;
-    delete[] projectedPattern;
-
-    delete[] errors;
-
     //printf("%s << Current EMRE = %f\n", __FUNCTION__, err);
 
     return err;
@@ -162,6 +155,21 @@ double obtainMultisetScore(int nCams, vector<Mat>& distributionMap, vector<Mat>&
     return score;
 }
 
+/// \brief      A frameset's descriptor is its pattern's pose descriptor in every camera, side by side
+static void framesetDescriptors(int nCams, cv::vector< cv::vector< cv::vector<Point2f> > >& frames, cv::vector<Point3f>& row, cv::vector<Size>& imSize, Mat& descriptors)
+{
+    descriptors = Mat::zeros(frames.at(0).size(), nCams * POSE_DESCRIPTOR_LENGTH, CV_64F);
+
+    Mat cameraDescriptors, descriptorBlock;
+
+    for (int k = 0; k < nCams; k++)
+    {
+        patternPoseDescriptors(frames.at(k), row, imSize.at(k), cameraDescriptors);
+        descriptorBlock = descriptors.colRange(k * POSE_DESCRIPTOR_LENGTH, (k + 1) * POSE_DESCRIPTOR_LENGTH);
+        cameraDescriptors.copyTo(descriptorBlock);
+    }
+}
+
 void optimizeCalibrationSets(cv::vector<Size> imSize,
                              int nCams,
                              Mat *cameraMatrix,
@@ -172,7 +180,10 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
                              cv::vector<Point3f> row,
                              int selection, int num,
                              cv::vector<cv::vector<int> >& tagNames,
-                             cv::vector<cv::vector<int> >& selectedTags)
+                             cv::vector<cv::vector<int> >& selectedTags,
+                             progressReporter *progress,
+                             int patience,
+                             int batchSize)
 {
 
     srand ( time(NULL) );
@@ -253,18 +264,31 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
 
     //printf("%s << Al variables initialized.\n", __FUNCTION__);
 
+    // Stops the greedy rounds once they no longer pay
+    selectionConvergence convergence(patience);
+
+    // Batched greedy rounds
+    Mat batchDescriptors;
+    vector<int> batch;
+    double batchScore;
+
     // SEED VARIABLES
     int nSeeds = 3;
-    int nSeedTrials = 50;
 
-    int *bestSeedSet, *currentSeedSet;
+    int *bestSeedSet;
 
     double bestSeedScore = 9e50, currentSeedScore;
 
-    bool alreadyUsed;
+    Mat seedDescriptors;
+    vector< vector<int> > seedSets;
 
     int newRandomNum;
 
+    progressReporter silentProgress;
+    if (progress == NULL) progress = &silentProgress;
+
+    long trialsCompleted = 0, expectedTrials = 0;
+
     switch (selection)
     {
         // ==================================================
@@ -429,6 +453,18 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
 
         prevBestScore = 9e50;
 
+        for (int N = 0; N < num; N++)
+        {
+            expectedTrials += (long)originalFramesCpy.at(0).size() - N;
+        }
+
+        if (batchSize > 1)
+        {
+            framesetDescriptors(nCams, originalFramesCpy, row, imSize, batchDescriptors);
+        }
+
+        progress->beginStage("extrinsic selection", expectedTrials, "trials");
+
         for (int N = 0; N < num; N++)
         {
 
@@ -515,6 +551,8 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
                         // Calculate ERE
                         err = calculateExtrinsicERE(nCams, objectPoints.at(0), testCorners, cameraMatrix, distCoeffs, R, T);
 
+                        progress->update(++trialsCompleted, err);
+
                     }
                     else
                     {
@@ -547,19 +585,78 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
 
             //printf("%s << DEBUG %d\n", __FUNCTION__, 5);
 
-            unrankedScores[bestIndex] = 9e50;
+            // Batched rounds add the best few mutually distinct framesets together, if a confirmation calibration agrees
+            batch.assign(1, bestIndex);
 
-            printf("%s << Best score for %d frameset calibration: %f\n", __FUNCTION__, N+1, bestScore);
+            if ((batchSize > 1) && (bestScore < 9e49) && (pickDiverseBatch(unrankedScores, originalFramesCpy.at(0).size(), batchDescriptors, min(batchSize, num - N), BATCH_MIN_SEPARATION, batch) > 1))
+            {
+                cv::vector< cv::vector<Point3f> > batchObjectPoints(selectedFrames.at(0).size() + batch.size(), row);
 
-            for (int k = 0; k < nCams; k++)
+                for (int k = 0; k < nCams; k++)
+                {
+                    tempFrameTester.at(k).assign(selectedFrames.at(k).begin(), selectedFrames.at(k).end());
+
+                    for (unsigned int b = 0; b < batch.size(); b++)
+                    {
+                        tempFrameTester.at(k).push_back(originalFramesCpy.at(k).at(batch.at(b)));
+                    }
+                }
+
+                R[0] = Mat::eye(3, 3, CV_64FC1);
+                T[0] = Mat::zeros(3, 1, CV_64FC1);
+
+                for (int k = 0; k < nCams-1; k++)
+                {
+                    stereoCalibrate(batchObjectPoints,
+                                    tempFrameTester.at(0), tempFrameTester.at(k+1),
+                                    cameraMatrix[0], distCoeffs[0],
+                                    cameraMatrix[k+1], distCoeffs[k+1],
+                                    imSize[0],
+                                    R[k+1], T[k+1], E[k+1], F[k+1],
+                                    term_crit,
+                                    EXTRINSICS_FLAGS);
+                }
+
+                batchScore = calculateExtrinsicERE(nCams, row, testCorners, cameraMatrix, distCoeffs, R, T);
+
+                progress->update(++trialsCompleted, batchScore);
+
+                if (batchScore <= bestScore * (1.0 + BATCH_DIVERGENCE_TOLERANCE))
+                {
+                    printf("%s << Adding (%d) framesets together (ERE = %f, best single frameset = %f)\n", __FUNCTION__, (int)batch.size(), batchScore, bestScore);
+                    bestScore = batchScore;
+                }
+                else
+                {
+                    printf("%s << Batch of (%d) diverged (ERE = %f, best single frameset = %f); adding single framesets from now on\n", __FUNCTION__, (int)batch.size(), batchScore, bestScore);
+                    batch.resize(1);
+                    batchSize = 1;
+                }
+            }
+
+            for (unsigned int b = 0; b < batch.size(); b++)
             {
-                selectedFrames.at(k).push_back(originalFramesCpy.at(k).at(bestIndex));
+                unrankedScores[batch.at(b)] = 9e50;
+
+                for (int k = 0; k < nCams; k++)
+                {
+                    selectedFrames.at(k).push_back(originalFramesCpy.at(k).at(batch.at(b)));
+
+                }
+
+                addedIndices.push_back(batch.at(b));
 
+                // One object row per frameset added beyond the first (the next sweep adds its own)
+                if (b > 0)
+                {
+                    objectPoints.push_back(row);
+                    N++;
+                }
             }
 
-            //printf("%s << DEBUG %d\n", __FUNCTION__, 6);
+            printf("%s << Best score for %d frameset calibration: %f\n", __FUNCTION__, N+1, bestScore);
 
-            addedIndices.push_back(bestIndex);
+            //printf("%s << DEBUG %d\n", __FUNCTION__, 6);
 
             if (bestScore < prevBestScore)
             {
@@ -569,12 +666,20 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
 
             //printf("%s << DEBUG %d\n", __FUNCTION__, 7);
 
+            if (convergence.update(bestScore))
+            {
+                printf("%s << Stopping with (%d) of (%d) framesets: %s\n", __FUNCTION__, N+1, num, convergence.reason());
+                break;
+            }
+
         }
 
         //printf("%s << Attempting to delete unrankedScores...\n", __FUNCTION__);
 
         //printf("%s << unrankedScores deleted!.\n", __FUNCTION__);
 
+        progress->endStage();
+
         printf("%s << Optimum number of framesets for calibration = %d\n", __FUNCTION__, optimumNum+1);
 
         for (int k = 0; k < nCams; k++)
@@ -588,7 +693,13 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
     case RANDOM_SEED_OPTIMIZATION_CODE:     //        Random N-seed accumulative search
         // ==================================================
 
-        printf("%s << Initiating Random N-seed accumulative search [seeds = %d; seed trials = %d]\n", __FUNCTION__, nSeeds, nSeedTrials);
+        nSeeds = min(nSeeds, (int)originalFramesCpy.at(0).size());
+
+        framesetDescriptors(nCams, originalFramesCpy, row, imSize, seedDescriptors);
+
+        diverseSeedSets(seedDescriptors, nSeeds, DIVERSE_SEED_SETS, seedSets);
+
+        printf("%s << Initiating diverse N-seed accumulative search [seeds = %d; seed sets = %d]\n", __FUNCTION__, nSeeds, (int)seedSets.size());
 
         for (int k = 0; k < nCams; k++)
         {
@@ -605,60 +716,40 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
 
 
         bestSeedSet = new int[nSeeds];
-        currentSeedSet = new int[nSeeds];
 
         R[0] = Mat::eye(3, 3, CV_64FC1);
         T[0] = Mat::zeros(3, 1, CV_64FC1);
 
         //printf("%s << DEBUG %d\n", __FUNCTION__, 0);
 
-        for (int iii = 0; iii < nSeedTrials; iii++)
+        expectedTrials = seedSets.size();
+
+        for (int N = nSeeds; N < num; N++)
         {
+            expectedTrials += (long)originalFramesCpy.at(0).size() - N;
+        }
 
-            //printf("%s << DEBUG [%d] %d\n", __FUNCTION__, iii, 0);
+        progress->beginStage("extrinsic selection", expectedTrials, "trials");
 
-            objectPoints.clear();
-
-            randomNum = rand() % originalFramesCpy.at(0).size();
+        for (unsigned int iii = 0; iii < seedSets.size(); iii++)
+        {
 
-            currentSeedSet[0] = randomNum;
-            objectPoints.push_back(row);
+            //printf("%s << DEBUG [%d] %d\n", __FUNCTION__, iii, 0);
 
-            //printf("%s << DEBUG [%d] %d\n", __FUNCTION__, iii, 1);
+            objectPoints.clear();
 
             for (int k = 0; k < nCams; k++)
             {
                 tempFrameTester.at(k).clear();
-                tempFrameTester.at(k).push_back(originalFramesCpy.at(k).at(currentSeedSet[0]));
             }
 
-            //printf("%s << DEBUG [%d] %d\n", __FUNCTION__, iii, 2);
-
-            for (int jjj = 1; jjj < nSeeds; jjj++)
+            for (int jjj = 0; jjj < nSeeds; jjj++)
             {
-                do
-                {
-                    alreadyUsed = false;
-
-                    randomNum = rand() % originalFramesCpy.at(0).size();
-
-                    for (int kkk = 0; kkk < jjj; kkk++)
-                    {
-                        if (randomNum == currentSeedSet[kkk])
-                        {
-                            alreadyUsed = true;
-                        }
-                    }
-                }
-                while (alreadyUsed);
-
-                currentSeedSet[jjj] = randomNum;
-
                 objectPoints.push_back(row);
 
                 for (int k = 0; k < nCams; k++)
                 {
-                    tempFrameTester.at(k).push_back(originalFramesCpy.at(k).at(currentSeedSet[jjj]));
+                    tempFrameTester.at(k).push_back(originalFramesCpy.at(k).at(seedSets[iii][jjj]));
                 }
 
             }
@@ -691,6 +782,8 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
 
             currentSeedScore = calculateExtrinsicERE(nCams, objectPoints.at(0), testCorners, cameraMatrix, distCoeffs, R, T);
 
+            progress->update(++trialsCompleted, currentSeedScore);
+
             if (currentSeedScore < bestSeedScore)
             {
                 bestSeedScore = currentSeedScore;
@@ -699,7 +792,7 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
 
                 for (int jjj = 0; jjj < nSeeds; jjj++)
                 {
-                    bestSeedSet[jjj] = currentSeedSet[jjj];
+                    bestSeedSet[jjj] = seedSets[iii][jjj];
                 }
 
             }
@@ -819,6 +912,8 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
                         // Calculate ERE
                         err = calculateExtrinsicERE(nCams, objectPoints.at(0), testCorners, cameraMatrix, distCoeffs, R, T);
 
+                        progress->update(++trialsCompleted, err);
+
                     }
                     else
                     {
@@ -879,6 +974,8 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
 
         //printf("%s << unrankedScores deleted!.\n", __FUNCTION__);
 
+        progress->endStage();
+
         printf("%s << Optimum number of framesets for calibration = %d\n", __FUNCTION__, optimumNum+1);
 
         for (int k = 0; k < nCams; k++)
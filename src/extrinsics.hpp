@@ -17,7 +17,7 @@
 /// \brief      Calculate the Extended Reprojection Error for the extrinsic case.
 double calculateExtrinsicERE(int nCams,
                              cv::vector<Point3f>& physicalPoints,
-                             cv::vector< cv::vector< cv::vector<Point2f> > > corners,
+                             const cv::vector< cv::vector< cv::vector<Point2f> > >& corners,
                              Mat *cameraMatrix,
                              Mat *distCoeffs,
                              Mat *R,
@@ -35,7 +35,10 @@ void optimizeCalibrationSets(cv::vector<Size> imSize,
                              int selection,
                              int num,
                              cv::vector<cv::vector<int> >& tagNames,
-                             cv::vector<cv::vector<int> >& selectedTags);
+                             cv::vector<cv::vector<int> >& selectedTags,
+                             progressReporter *progress = NULL,
+                             int patience = DEFAULT_PLATEAU_PATIENCE,
+                             int batchSize = DEFAULT_SELECTION_BATCH);
 
 /// \brief      Calculate the scores for a set if pointsets in terms of their contribution to extrinsic calibration
 double obtainMultisetScore(int nCams,
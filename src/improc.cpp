@@ -1111,7 +1111,10 @@ void findPercentiles(const Mat& img, double *vals, double *percentiles, unsigned
 
 	//cin.get();
 
-	if (img.type() == CV_16UC1) {
+	// calcHist needs 8U or 32F input, and the bins below span the full 16-bit range either way
+	if (img.type() == CV_8UC1) {
+		mx = img;
+	} else {
 		img.convertTo(mx, CV_32FC1);
 	}
 
@@ -1147,6 +1150,7 @@ void findPercentiles(const Mat& img, double *vals, double *percentiles, unsigned
 		}
 
 		if (allCountsReached) {
+			delete[] aimedPixelCounts;
 			return;
 		}
 
@@ -1156,6 +1160,8 @@ void findPercentiles(const Mat& img, double *vals, double *percentiles, unsigned
 
 	//cin.get();
 
+	delete[] aimedPixelCounts;
+
 }
 
 void shiftIntensities(Mat& im, double scaler, double shifter, double downer) {
@@ -1,5 +1,173 @@
 #include "intrinsics.hpp"
 
+/// \brief      calibrateCamera(), accounted to its own performance counter stage
+static double calibrateCameraTrial(const cv::vector<cv::vector<Point3f> >& objectPoints,
+                                   const cv::vector<cv::vector<Point2f> >& imagePoints,
+                                   Size imSize,
+                                   Mat& cameraMatrix,
+                                   Mat& distCoeffs,
+                                   cv::vector<Mat>& rvecs,
+                                   cv::vector<Mat>& tvecs,
+                                   int flags,
+                                   const cameraPrior *prior)
+{
+    perfStageScope stageCounters(PERF_STAGE_CALIBRATE_CAMERA);
+
+    // Every trial starts from the same place, rather than from wherever the previous trial finished
+    if (prior != NULL)
+    {
+        seedFromPrior(*prior, cameraMatrix, distCoeffs, flags);
+    }
+
+    return calibrateCamera(objectPoints, imagePoints, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, flags);
+}
+
+cameraPrior::cameraPrior() :
+    fromStore(false)
+{
+}
+
+void defaultCameraPrior(Size imSize, cameraPrior& prior)
+{
+    prior.cameraMatrix = Mat::eye(3, 3, CV_64F);
+    prior.cameraMatrix.at<double>(0,0) = DEFAULT_PRIOR_FOCAL_RATIO * imSize.width;
+    prior.cameraMatrix.at<double>(1,1) = DEFAULT_PRIOR_FOCAL_RATIO * imSize.width;
+    prior.cameraMatrix.at<double>(0,2) = (imSize.width - 1) / 2.0;
+    prior.cameraMatrix.at<double>(1,2) = (imSize.height - 1) / 2.0;
+
+    prior.distCoeffs = Mat::zeros(1, 8, CV_64F);
+    prior.fromStore = false;
+}
+
+/// \brief      Store key for a camera at a given image size, e.g. "prior_camera0_640x480"
+static string priorKey(const char *cameraId, Size imSize)
+{
+    char key[256];
+    sprintf(key, "prior_%.200s_%dx%d", cameraId, imSize.width, imSize.height);
+
+    // FileStorage keys may only hold letters, digits, '_' and '-'
+    for (char *ptr = key; *ptr != '\0'; ptr++)
+    {
+        if (!isalnum((unsigned char)(*ptr)) && (*ptr != '_') && (*ptr != '-'))
+        {
+            *ptr = '_';
+        }
+    }
+
+    return string(key);
+}
+
+bool loadCameraPrior(const char *filename, const char *cameraId, Size imSize, cameraPrior& prior)
+{
+    defaultCameraPrior(imSize, prior);
+
+    FileStorage fs(filename, FileStorage::READ);
+
+    if (!fs.isOpened())
+    {
+        printf("%s << No priors store (%s) yet; starting (%s) from the image size.\n", __FUNCTION__, filename, cameraId);
+        return false;
+    }
+
+    string key = priorKey(cameraId, imSize);
+
+    Mat storedMatrix, storedCoeffs;
+    fs[key + "_cameraMatrix"] >> storedMatrix;
+    fs[key + "_distCoeffs"] >> storedCoeffs;
+
+    fs.release();
+
+    if ((storedMatrix.rows != 3) || (storedMatrix.cols != 3) || storedCoeffs.empty() || (storedCoeffs.total() > 8))
+    {
+        printf("%s << No prior stored for (%s) at %d x %d; starting from the image size.\n", __FUNCTION__, cameraId, imSize.width, imSize.height);
+        return false;
+    }
+
+    storedMatrix.convertTo(prior.cameraMatrix, CV_64F);
+
+    Mat storedRow, storedPart;
+    storedCoeffs.reshape(1, 1).convertTo(storedRow, CV_64F);
+    storedPart = prior.distCoeffs.colRange(0, storedRow.cols);
+    storedRow.copyTo(storedPart);
+
+    prior.fromStore = true;
+
+    printf("%s << Prior for (%s) at %d x %d: fx = %f, fy = %f, cx = %f, cy = %f\n", __FUNCTION__, cameraId, imSize.width, imSize.height,
+           prior.cameraMatrix.at<double>(0,0), prior.cameraMatrix.at<double>(1,1), prior.cameraMatrix.at<double>(0,2), prior.cameraMatrix.at<double>(1,2));
+
+    return true;
+}
+
+bool saveCameraPrior(const char *filename, const char *cameraId, Size imSize, const Mat& cameraMatrix, const Mat& distCoeffs)
+{
+    string key = priorKey(cameraId, imSize);
+
+    // FileStorage cannot update a file in place, so everything else in the store is carried over by hand
+    vector<string> names;
+    vector<Mat> values;
+
+    FileStorage in(filename, FileStorage::READ);
+
+    if (in.isOpened())
+    {
+        FileNode root = in.root();
+
+        for (FileNodeIterator it = root.begin(); it != root.end(); ++it)
+        {
+            string name = (*it).name();
+
+            if ((name == key + "_cameraMatrix") || (name == key + "_distCoeffs"))
+            {
+                continue;
+            }
+
+            Mat value;
+            (*it) >> value;
+
+            names.push_back(name);
+            values.push_back(value);
+        }
+
+        in.release();
+    }
+
+    FileStorage out(filename, FileStorage::WRITE);
+
+    if (!out.isOpened())
+    {
+        printf("%s << ERROR. Could not open priors store (%s) for writing.\n", __FUNCTION__, filename);
+        return false;
+    }
+
+    for (unsigned int iii = 0; iii < names.size(); iii++)
+    {
+        out << names[iii] << values[iii];
+    }
+
+    out << key + "_cameraMatrix" << cameraMatrix;
+    out << key + "_distCoeffs" << distCoeffs;
+
+    out.release();
+
+    return true;
+}
+
+void seedFromPrior(const cameraPrior& prior, Mat& cameraMatrix, Mat& distCoeffs, int& flags)
+{
+    prior.cameraMatrix.copyTo(cameraMatrix);
+
+    // The plumb-bob model keeps its usual five coefficients; the rational model needs all eight
+    int coeffCount = (flags & CV_CALIB_RATIONAL_MODEL) ? 8 : 5;
+
+    distCoeffs = Mat::zeros(1, coeffCount, CV_64F);
+    prior.distCoeffs.colRange(0, coeffCount).copyTo(distCoeffs);
+
+    if (prior.fromStore)
+    {
+        flags |= CV_CALIB_USE_INTRINSIC_GUESS;
+    }
+}
+
 double calculateERE( Size imSize,
                      cv::vector<Point3f>& physicalPoints,
                      cv::vector< cv::vector<Point2f> >& corners,
@@ -7,54 +175,48 @@ double calculateERE( Size imSize,
                      const Mat& distCoeffs,
                      double errValues[])
 {
+    perfStageScope stageCounters(PERF_STAGE_CALCULATE_ERE);
 
-    double *errors_in_x, *errors_in_y;
-
-    bool tmpErrorValuesOnly = false;
-
+    // Buffers belong to the calling thread and are reused by every evaluation it makes
+    planarPoseWorkspace& poseWorkspace = threadPoseWorkspace();
 
     if (!errValues)
     {
-        tmpErrorValuesOnly = true;
-        errValues = new double[corners.size() * corners.at(0).size()];
+        poseWorkspace.errors.resize(corners.size() * corners.at(0).size());
+        errValues = &poseWorkspace.errors[0];
     }
 
+    poseWorkspace.projected.resize(physicalPoints.size());
+    Point2f *cornerSet = &poseWorkspace.projected[0];
+    unsigned int cornerCount = physicalPoints.size();
+
+    double err = 0.0, tSum = 0;
 
-    Mat fsRvec, fsTvec;
-    cv::vector<Point2f> cornerSet;
-    cornerSet.resize(physicalPoints.size());
+    Point2f imageDec, predictedDec;
 
-    double err = 0.0, xSum = 0, ySum = 0, tSum = 0, xMean = 0, yMean = 0, tMean = 0, xDev = 0, yDev = 0, tDev = 0;
+    double model[CAMERA_MODEL_LENGTH];
+    unpackCameraModel(cameraMatrix, distCoeffs, model);
 
-    Point2f imLoc, imageDec, predictedDec;
+    // Estimate pose of every board in one batch
+    estimatePlanarPoses(physicalPoints, corners, cameraMatrix, distCoeffs, poseWorkspace);
 
     for (unsigned int i = 0; i < corners.size(); i++)
     {
-        // Estimate pose of board
-        solvePnP(Mat(physicalPoints), Mat(corners.at(i)), cameraMatrix, distCoeffs, fsRvec, fsTvec, false);
-
-        // Reproject the object points using estimated rvec/tvec
-        projectPoints(Mat(physicalPoints), fsRvec, fsTvec, cameraMatrix, distCoeffs, cornerSet);
+        // Reproject the object points using the estimated pose
+        projectWithPose(physicalPoints, &poseWorkspace.rotations[i * 9], &poseWorkspace.translations[i * 3], model, cornerSet);
         // do we want distortion vector or not? (noDistVector) it would make undistorted comparison better..
 
         //image.copyTo(debugImage);
 
         // Find the mean and standard deviations for differences between results (conventional)
-        for (unsigned int j = 0; j < cornerSet.size(); j++)
+        for (unsigned int j = 0; j < cornerCount; j++)
         {
 
-            imageDec = Point2f(corners.at(i).at(j).x, corners.at(i).at(j).y);
-            predictedDec = Point2f(cornerSet.at(j).x, cornerSet.at(j).y);
-
-            if (errValues)
-            {
-                errValues[i*cornerSet.size()+j] = pow(pow(imageDec.x-predictedDec.x, 2)+pow(imageDec.y-predictedDec.y, 2), 0.5);
-                //printf("%s << errValues[%d] = %f\n", __FUNCTION__, i*cornerSet.size()+j, errValues[i*cornerSet.size()+j]);
-            }
-
+            imageDec = corners[i][j];
+            predictedDec = cornerSet[j];
 
-            // Expand the vector between the actual and predicted points
-            predictedDec = imageDec + 3*(predictedDec - imageDec);
+            errValues[i*cornerCount+j] = pow(pow(imageDec.x-predictedDec.x, 2)+pow(imageDec.y-predictedDec.y, 2), 0.5);
+            //printf("%s << errValues[%d] = %f\n", __FUNCTION__, i*cornerCount+j, errValues[i*cornerCount+j]);
         }
 
 
@@ -63,21 +225,13 @@ double calculateERE( Size imSize,
     // Calculate means
     for (unsigned int i = 0; i < corners.size(); i++)
     {
-        for (unsigned int j = 0; j < cornerSet.size(); j++)
+        for (unsigned int j = 0; j < cornerCount; j++)
         {
-            //xSum += errors_in_x[i*cornerSet.size()+j];
-            //ySum += errors_in_y[i*cornerSet.size()+j];
-            if (errValues)
-            {
-                tSum += errValues[i*cornerSet.size()+j];
-            }
-
+            tSum += errValues[i*cornerCount+j];
         }
     }
 
-    //xMean = xSum / (fullSetCorners.size()*cornerSet.size());
-    //yMean = ySum / (fullSetCorners.size()*cornerSet.size());
-    err = tSum / (corners.size()*cornerSet.size());
+    err = tSum / (corners.size()*cornerCount);
 
     /*
     errTotal = pow(pow(xMean, 2)+pow(yMean, 2), 0.5);
@@ -109,13 +263,521 @@ double calculateERE( Size imSize,
     //waitKey(0);
 
 
-    if (tmpErrorValuesOnly)
+    return err;
+}
+
+void calculateEREBlock(Size imSize,
+                       cv::vector<Point3f>& physicalPoints,
+                       cv::vector< cv::vector<Point2f> >& corners,
+                       const cv::vector<Mat>& cameraMatrices,
+                       const cv::vector<Mat>& distCoeffs,
+                       double *eres)
+{
+    int models = (int)cameraMatrices.size();
+    int count = (int)physicalPoints.size();
+
+    bool planar = (count >= 4);
+
+    for (int j = 0; j < count; j++)
     {
-        //printf("%s << deleting temporary errValues array...\n", __FUNCTION__);
-        delete[] errValues;
+        if (physicalPoints[j].z != 0.0f)
+        {
+            planar = false;
+        }
     }
 
-    return err;
+    for (unsigned int i = 0; i < corners.size(); i++)
+    {
+        if ((int)corners[i].size() != count)
+        {
+            planar = false;
+        }
+    }
+
+    if (!planar || (corners.size() == 0))
+    {
+        for (int m = 0; m < models; m++)
+        {
+            eres[m] = calculateERE(imSize, physicalPoints, corners, cameraMatrices[m], distCoeffs[m]);
+        }
+
+        return;
+    }
+
+    perfStageScope stageCounters(PERF_STAGE_CALCULATE_ERE);
+
+    planarPoseWorkspace& poseWorkspace = threadPoseWorkspace();
+    poseWorkspace.projected.resize(count);
+
+    double model[CAMERA_MODEL_LENGTH];
+
+    for (int m = 0; m < models; m++)
+    {
+        unpackCameraModel(cameraMatrices[m], distCoeffs[m], model);
+
+        // Every view posed under this model, into the thread's reusable pose buffers
+        estimatePlanarPoses(physicalPoints, corners, cameraMatrices[m], distCoeffs[m], poseWorkspace);
+
+        double errorSum = 0.0;
+
+        for (unsigned int i = 0; i < corners.size(); i++)
+        {
+            projectWithPose(physicalPoints, &poseWorkspace.rotations[i * 9], &poseWorkspace.translations[i * 3], model, &poseWorkspace.projected[0]);
+
+            for (int j = 0; j < count; j++)
+            {
+                double dx = corners[i][j].x - poseWorkspace.projected[j].x;
+                double dy = corners[i][j].y - poseWorkspace.projected[j].y;
+
+                errorSum += sqrt(dx * dx + dy * dy);
+            }
+        }
+
+        eres[m] = errorSum / (corners.size() * count);
+    }
+}
+
+/// \brief      Greedy selection trials, each adding one candidate (after an assumed winner, for speculative trials) to the frames
+///             selected so far. Trials run in blocks, whose models are then scored together by calculateEREBlock().
+class parallelSelectionTrials : public ParallelLoopBody
+{
+public:
+    parallelSelectionTrials(Size imSize, cv::vector< cv::vector<Point2f> >& selected, cv::vector< cv::vector<Point2f> >& candidates, cv::vector< cv::vector<Point2f> >& testPatterns, cv::vector<Point3f>& row, int intrinsicsFlags, const cameraPrior *prior, const vector<int>& taskWinners, const vector<int>& taskCandidates, int taskBlock, vector<double>& taskScores) :
+        imageSize(imSize),
+        selectedFrames(selected),
+        candidatePatterns(candidates),
+        testSet(testPatterns),
+        objectRow(row),
+        flags(intrinsicsFlags),
+        startingPrior(prior),
+        winners(taskWinners),
+        trialCandidates(taskCandidates),
+        blockSize(taskBlock),
+        scores(taskScores)
+    {
+    }
+
+    void operator()(const Range& range) const
+    {
+        cv::vector< cv::vector<Point2f> > frames;
+        cv::vector< cv::vector<Point3f> > objectPoints;
+        cv::vector<Mat> rvecs, tvecs;
+        cv::vector<Mat> cameraMatrices, distCoeffs;
+
+        for (int block = range.start; block < range.end; block++)
+        {
+            int first = block * blockSize;
+            int last = min(first + blockSize, (int)trialCandidates.size());
+
+            cameraMatrices.resize(last - first);
+            distCoeffs.resize(last - first);
+
+            for (int iii = first; iii < last; iii++)
+            {
+                frames.assign(selectedFrames.begin(), selectedFrames.end());
+
+                if (winners[iii] >= 0)
+                {
+                    frames.push_back(candidatePatterns[winners[iii]]);
+                }
+
+                frames.push_back(candidatePatterns[trialCandidates[iii]]);
+                objectPoints.assign(frames.size(), objectRow);
+
+                cameraMatrices[iii - first] = Mat::eye(3, 3, CV_64F);
+                distCoeffs[iii - first] = Mat(1, 8, CV_64F);
+
+                calibrateCameraTrial(objectPoints, frames, imageSize, cameraMatrices[iii - first], distCoeffs[iii - first], rvecs, tvecs, flags, startingPrior);
+            }
+
+            calculateEREBlock(imageSize, objectRow, testSet, cameraMatrices, distCoeffs, &scores[first]);
+        }
+    }
+
+private:
+    Size imageSize;
+    cv::vector< cv::vector<Point2f> >& selectedFrames;
+    cv::vector< cv::vector<Point2f> >& candidatePatterns;
+    cv::vector< cv::vector<Point2f> >& testSet;
+    cv::vector<Point3f>& objectRow;
+    int flags;
+    const cameraPrior *startingPrior;
+    const vector<int>& winners;
+    const vector<int>& trialCandidates;
+    int blockSize;
+    vector<double>& scores;
+};
+
+/// \brief      Runs the greedy selector on each shard of a partitioned pool, each task writing only to its own slot
+class parallelShardSelection : public ParallelLoopBody
+{
+public:
+    parallelShardSelection(Size imSize, cv::vector< cv::vector< cv::vector<Point2f> > >& shardPatterns, cv::vector<Point3f>& row, int num, int intrinsicsFlags, const cameraPrior *prior, int patience, int batchSize, vector< vector<int> >& shardWinners) :
+        imageSize(imSize),
+        patterns(shardPatterns),
+        objectRow(row),
+        framesWanted(num),
+        flags(intrinsicsFlags),
+        startingPrior(prior),
+        plateauPatience(patience),
+        framesPerRound(batchSize),
+        winners(shardWinners)
+    {
+    }
+
+    void operator()(const Range& range) const
+    {
+        for (int iii = range.start; iii < range.end; iii++)
+        {
+            // Each shard is judged against its own patterns only, which is what keeps a shard's cost bounded
+            cv::vector< cv::vector<Point2f> > candidates(patterns[iii]);
+
+            optimizeCalibrationSet(imageSize, candidates, patterns[iii], objectRow, winners[iii], ENHANCED_MCM_OPTIMIZATION_CODE, framesWanted, false, flags, NULL, DEFAULT_SELECTION_SHARDS, startingPrior, plateauPatience, framesPerRound);
+        }
+    }
+
+private:
+    Size imageSize;
+    cv::vector< cv::vector< cv::vector<Point2f> > >& patterns;
+    cv::vector<Point3f>& objectRow;
+    int framesWanted;
+    int flags;
+    const cameraPrior *startingPrior;
+    int plateauPatience;
+    int framesPerRound;
+    vector< vector<int> >& winners;
+};
+
+/// \brief      Distributed greedy (GreeDi) selection: greedy on each shard in parallel, then greedy over the shard winners
+static void partitionedGreedySelection(Size imSize,
+                                       cv::vector< cv::vector<Point2f> >& pool,
+                                       cv::vector< cv::vector<Point2f> >& testPatterns,
+                                       cv::vector<Point3f>& row,
+                                       int num,
+                                       int shards,
+                                       int intrinsicsFlags,
+                                       progressReporter *progress,
+                                       const cameraPrior *prior,
+                                       int patience,
+                                       int batchSize,
+                                       vector<int>& selectedIndices)
+{
+    selectedIndices.clear();
+
+    // Every shard has to be able to supply a full set on its own
+    shards = max(1, min(shards, (int)pool.size() / max(num, 1)));
+
+    // Dealt out in turn, so that each shard samples the whole capture rather than one stretch of it
+    cv::vector< cv::vector< cv::vector<Point2f> > > shardPatterns(shards);
+    vector< vector<int> > shardIndices(shards);
+
+    for (unsigned int iii = 0; iii < pool.size(); iii++)
+    {
+        shardPatterns[iii % shards].push_back(pool[iii]);
+        shardIndices[iii % shards].push_back(iii);
+    }
+
+    printf("%s << Selecting from (%d) patterns in (%d) shards of about (%d)...\n", __FUNCTION__, (int)pool.size(), shards, (int)shardPatterns[0].size());
+
+    vector< vector<int> > shardWinners(shards);
+
+    parallel_for_(Range(0, shards), parallelShardSelection(imSize, shardPatterns, row, num, intrinsicsFlags, prior, patience, batchSize, shardWinners));
+
+    cv::vector< cv::vector<Point2f> > finalists;
+    vector<int> finalistIndices;
+
+    for (int sss = 0; sss < shards; sss++)
+    {
+        for (unsigned int iii = 0; iii < shardWinners[sss].size(); iii++)
+        {
+            finalists.push_back(shardPatterns[sss][shardWinners[sss][iii]]);
+            finalistIndices.push_back(shardIndices[sss][shardWinners[sss][iii]]);
+        }
+    }
+
+    printf("%s << Final selection from (%d) shard winners...\n", __FUNCTION__, (int)finalists.size());
+
+    // The final pass is judged against the full test set, as plain greedy selection would be
+    vector<int> finalTags;
+    optimizeCalibrationSet(imSize, finalists, testPatterns, row, finalTags, ENHANCED_MCM_OPTIMIZATION_CODE, num, false, intrinsicsFlags, progress, DEFAULT_SELECTION_SHARDS, prior, patience, batchSize);
+
+    for (unsigned int iii = 0; iii < finalTags.size(); iii++)
+    {
+        selectedIndices.push_back(finalistIndices.at(finalTags[iii]));
+    }
+}
+
+/// \brief      Calibrates from the selected patterns and measures the ERE over the whole pool
+static double selectionERE(Size imSize,
+                           cv::vector< cv::vector<Point2f> >& selectedPatterns,
+                           cv::vector< cv::vector<Point2f> >& pool,
+                           cv::vector<Point3f>& row,
+                           int intrinsicsFlags,
+                           const cameraPrior *prior)
+{
+    if (selectedPatterns.size() == 0)
+    {
+        return -1.0;
+    }
+
+    cv::vector< cv::vector<Point3f> > objectPoints(selectedPatterns.size(), row);
+    Mat cameraMatrix = Mat::eye(3, 3, CV_64F);
+    Mat distCoeffs = Mat(1, 8, CV_64F);
+    cv::vector<Mat> rvecs, tvecs;
+
+    calibrateCameraTrial(objectPoints, selectedPatterns, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags, prior);
+
+    return calculateERE(imSize, row, pool, cameraMatrix, distCoeffs);
+}
+
+void comparePartitionedSelection(Size imSize,
+                                 cv::vector< cv::vector<Point2f> >& candidatePatterns,
+                                 cv::vector<Point3f> row,
+                                 int num,
+                                 int shards,
+                                 int intrinsicsFlags,
+                                 const cameraPrior *prior,
+                                 int patience,
+                                 int batchSize)
+{
+    if (candidatePatterns.size() > PARTITIONED_COMPARISON_MAX_POOL)
+    {
+        printf("%s << Pool of (%d) is too large for a plain greedy comparison (limit %d); skipping.\n", __FUNCTION__, (int)candidatePatterns.size(), PARTITIONED_COMPARISON_MAX_POOL);
+        return;
+    }
+
+    cv::vector< cv::vector<Point2f> > greedySelection(candidatePatterns), partitionedSelection(candidatePatterns);
+    vector<int> greedyTags, partitionedTags;
+
+    int64 selectionStart = getTickCount();
+    optimizeCalibrationSet(imSize, greedySelection, candidatePatterns, row, greedyTags, ENHANCED_MCM_OPTIMIZATION_CODE, num, false, intrinsicsFlags, NULL, shards, prior, patience, batchSize);
+    double greedyTime = elapsedMS(selectionStart);
+
+    selectionStart = getTickCount();
+    optimizeCalibrationSet(imSize, partitionedSelection, candidatePatterns, row, partitionedTags, PARTITIONED_GREEDY_OPTIMIZATION_CODE, num, false, intrinsicsFlags, NULL, shards, prior, patience, batchSize);
+    double partitionedTime = elapsedMS(selectionStart);
+
+    double greedyERE = selectionERE(imSize, greedySelection, candidatePatterns, row, intrinsicsFlags, prior);
+    double partitionedERE = selectionERE(imSize, partitionedSelection, candidatePatterns, row, intrinsicsFlags, prior);
+
+    printf("%s << Plain greedy:       (%d) frames, ERE = %f, %.1f s\n", __FUNCTION__, (int)greedySelection.size(), greedyERE, greedyTime / 1000.0);
+    printf("%s << Partitioned (x%d):  (%d) frames, ERE = %f, %.1f s\n", __FUNCTION__, shards, (int)partitionedSelection.size(), partitionedERE, partitionedTime / 1000.0);
+
+    if (greedyERE > 0.0)
+    {
+        printf("%s << Partitioned ERE is %.1f%% of plain greedy, in %.1f%% of the time.\n", __FUNCTION__, 100.0 * partitionedERE / greedyERE, 100.0 * partitionedTime / max(greedyTime, 1e-3));
+    }
+}
+
+modelComparisonResult::modelComparisonResult() :
+    intrinsicsFlags(DEFAULT_INTRINSICS_FLAGS),
+    reprojError(-1.0),
+    ere(-1.0),
+    crossValidatedError(-1.0),
+    time(0.0)
+{
+}
+
+void distortionModelVariants(int intrinsicsFlags, vector<int>& flagVariants)
+{
+    int plumbBob = intrinsicsFlags & ~CV_CALIB_RATIONAL_MODEL;
+
+    flagVariants.clear();
+    flagVariants.push_back(plumbBob);
+    flagVariants.push_back(plumbBob | CV_CALIB_RATIONAL_MODEL);
+}
+
+/// \brief      Mean error on each fold of the selected frames, under a model solved from the remaining folds
+static double crossValidatedERE(Size imSize,
+                                cv::vector< cv::vector<Point2f> >& selectedPatterns,
+                                cv::vector<Point3f>& row,
+                                int intrinsicsFlags,
+                                const cameraPrior *prior)
+{
+    int folds = min(MODEL_COMPARISON_FOLDS, (int)selectedPatterns.size() / 2);
+
+    if (folds < 2)
+    {
+        return -1.0;
+    }
+
+    double errorSum = 0.0;
+    int heldOutCount = 0;
+
+    cv::vector< cv::vector<Point2f> > training, heldOut;
+    cv::vector< cv::vector<Point3f> > objectPoints;
+    cv::vector<Mat> rvecs, tvecs;
+
+    for (int fold = 0; fold < folds; fold++)
+    {
+        training.clear();
+        heldOut.clear();
+
+        for (int iii = 0; iii < (int)selectedPatterns.size(); iii++)
+        {
+            if (iii % folds == fold)
+            {
+                heldOut.push_back(selectedPatterns[iii]);
+            }
+            else
+            {
+                training.push_back(selectedPatterns[iii]);
+            }
+        }
+
+        objectPoints.assign(training.size(), row);
+
+        Mat cameraMatrix = Mat::eye(3, 3, CV_64F);
+        Mat distCoeffs = Mat(1, 8, CV_64F);
+
+        calibrateCameraTrial(objectPoints, training, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags, prior);
+
+        errorSum += calculateERE(imSize, row, heldOut, cameraMatrix, distCoeffs) * heldOut.size();
+        heldOutCount += (int)heldOut.size();
+    }
+
+    return errorSum / heldOutCount;
+}
+
+/// \brief      One distortion model per task: selection, final solve, ERE and cross-validation, each writing only to its own result
+class parallelModelComparison : public ParallelLoopBody
+{
+public:
+    parallelModelComparison(Size imSize, cv::vector< cv::vector<Point2f> >& candidates, cv::vector<Point3f>& row, const vector<int>& flagVariants, int selection, int num, int shards, const cameraPrior *prior, int patience, int batchSize, vector<modelComparisonResult>& results) :
+        imageSize(imSize),
+        candidatePatterns(candidates),
+        objectRow(row),
+        variants(flagVariants),
+        selectionCode(selection),
+        maxFrames(num),
+        shardCount(shards),
+        startingPrior(prior),
+        plateauPatience(patience),
+        selectionBatch(batchSize),
+        modelResults(results)
+    {
+    }
+
+    void operator()(const Range& range) const
+    {
+        for (int iii = range.start; iii < range.end; iii++)
+        {
+            modelComparisonResult& result = modelResults[iii];
+
+            int64 modelStart = getTickCount();
+
+            result.intrinsicsFlags = variants[iii];
+            result.selection.assign(candidatePatterns.begin(), candidatePatterns.end());
+
+            optimizeCalibrationSet(imageSize, result.selection, candidatePatterns, objectRow, result.selectedTags, selectionCode, maxFrames, false, result.intrinsicsFlags, NULL, shardCount, startingPrior, plateauPatience, selectionBatch);
+
+            if (result.selection.size() == 0)
+            {
+                continue;
+            }
+
+            cv::vector< cv::vector<Point3f> > objectPoints(result.selection.size(), objectRow);
+            cv::vector<Mat> rvecs, tvecs;
+
+            result.cameraMatrix = Mat::eye(3, 3, CV_64F);
+            result.distCoeffs = Mat(1, 8, CV_64F);
+
+            result.reprojError = calibrateCameraTrial(objectPoints, result.selection, imageSize, result.cameraMatrix, result.distCoeffs, rvecs, tvecs, result.intrinsicsFlags, startingPrior);
+            result.ere = calculateERE(imageSize, objectRow, candidatePatterns, result.cameraMatrix, result.distCoeffs);
+            result.crossValidatedError = crossValidatedERE(imageSize, result.selection, objectRow, result.intrinsicsFlags, startingPrior);
+
+            result.time = elapsedMS(modelStart);
+        }
+    }
+
+private:
+    Size imageSize;
+    cv::vector< cv::vector<Point2f> >& candidatePatterns;
+    cv::vector<Point3f>& objectRow;
+    const vector<int>& variants;
+    int selectionCode;
+    int maxFrames;
+    int shardCount;
+    const cameraPrior *startingPrior;
+    int plateauPatience;
+    int selectionBatch;
+    vector<modelComparisonResult>& modelResults;
+};
+
+int compareDistortionModels(Size imSize,
+                            cv::vector< cv::vector<Point2f> >& candidatePatterns,
+                            cv::vector<Point3f> row,
+                            const vector<int>& flagVariants,
+                            vector<modelComparisonResult>& results,
+                            int selection,
+                            int num,
+                            int shards,
+                            const cameraPrior *prior,
+                            int patience,
+                            int batchSize)
+{
+    results.assign(flagVariants.size(), modelComparisonResult());
+
+    if (flagVariants.size() == 0)
+    {
+        return -1;
+    }
+
+    cameraPrior sizePrior;
+    if (prior == NULL) {
+        defaultCameraPrior(imSize, sizePrior);
+        prior = &sizePrior;
+    }
+
+    int64 comparisonStart = getTickCount();
+
+    // Detection has already been paid for once; only selection and the solve are repeated per model
+    parallel_for_(Range(0, (int)flagVariants.size()), parallelModelComparison(imSize, candidatePatterns, row, flagVariants, selection, num, shards, prior, patience, batchSize, results));
+
+    int winner = -1;
+    bool crossValidated = true;
+
+    for (unsigned int iii = 0; iii < results.size(); iii++)
+    {
+        if (results[iii].crossValidatedError < 0.0)
+        {
+            crossValidated = false;
+        }
+    }
+
+    for (unsigned int iii = 0; iii < results.size(); iii++)
+    {
+        const modelComparisonResult& result = results[iii];
+
+        printf("%s << %-10s (%d) frames, MRE = %f, ERE = %f, cross-validated = %f, %.1f s\n",
+               __FUNCTION__,
+               (result.intrinsicsFlags & CV_CALIB_RATIONAL_MODEL) ? "Rational:" : "Plumb-bob:",
+               (int)result.selection.size(),
+               result.reprojError,
+               result.ere,
+               result.crossValidatedError,
+               result.time / 1000.0);
+
+        if (result.ere < 0.0)
+        {
+            continue;
+        }
+
+        double score = crossValidated ? result.crossValidatedError : result.ere;
+        double bestScore = (winner < 0) ? 0.0 : (crossValidated ? results[winner].crossValidatedError : results[winner].ere);
+
+        if ((winner < 0) || (score < bestScore))
+        {
+            winner = iii;
+        }
+    }
+
+    if (winner >= 0)
+    {
+        printf("%s << Keeping the %s model (compared in %.1f s).\n", __FUNCTION__, (results[winner].intrinsicsFlags & CV_CALIB_RATIONAL_MODEL) ? "rational" : "plumb-bob", elapsedMS(comparisonStart) / 1000.0);
+    }
+
+    return winner;
 }
 
 void optimizeCalibrationSet(Size imSize,
@@ -126,7 +788,12 @@ void optimizeCalibrationSet(Size imSize,
                             int selection,
                             int num,
                             bool debugMode,
-                            int intrinsicsFlags) 
+                            int intrinsicsFlags,
+                            progressReporter *progress,
+                            int shards,
+                            const cameraPrior *prior,
+                            int patience,
+                            int batchSize) 
 {
 	
 	if (INTRINSICS_HPP_DEBUG_MODE > 0) printf("%s << DEBUG [%d].\n", __FUNCTION__, 0);
@@ -135,6 +802,17 @@ void optimizeCalibrationSet(Size imSize,
     
     Mat distributionMap;
 
+    progressReporter silentProgress;
+    if (progress == NULL) progress = &silentProgress;
+
+    cameraPrior sizePrior;
+    if (prior == NULL) {
+        defaultCameraPrior(imSize, sizePrior);
+        prior = &sizePrior;
+    }
+
+    long trialsCompleted = 0, expectedTrials = 0;
+
     // If no optimization is desired
     if (selection == 0) {
         return;
@@ -146,14 +824,6 @@ void optimizeCalibrationSet(Size imSize,
     // Calibration Variables
     cv::vector< cv::vector<Point3f> > objectPoints;
     Mat cameraMatrix = Mat::eye(3, 3, CV_64F);
-    
-    if (intrinsicsFlags == SEARCH_ONLY_FOR_BASIC_PARAMETERS) {
-		cameraMatrix.at<double>(0,0) = 525.0;
-		cameraMatrix.at<double>(1,1) = 525.0;
-		cameraMatrix.at<double>(0,2) = 319.5;
-		cameraMatrix.at<double>(1,2) = 239.5;
-	}
-	
     Mat distCoeffs = Mat(1, 8, CV_64F);
     cv::vector<Mat> rvecs, tvecs;
 
@@ -229,15 +899,29 @@ void optimizeCalibrationSet(Size imSize,
 
     num = min((int)num, (int)candidatePatterns.size());
 
+    // Stops the greedy rounds once they no longer pay
+    selectionConvergence convergence(patience);
+
+    // Batched greedy rounds
+    Mat batchDescriptors;
+    vector<int> batch;
+    double batchScore;
+
+    // Speculative greedy rounds
+    vector<int> taskWinners, taskCandidates, speculativeWinners;
+    vector<double> taskScores, previousScores;
+    vector< vector<double> > speculativeScores;
+    int speculativeHit = -1;
+
     // SEED VARIABLES
     int nSeeds = 5;
-    int nSeedTrials = 500;
 
-    int *bestSeedSet, *currentSeedSet;
+    int *bestSeedSet;
 
     double bestSeedScore = 9e50, currentSeedScore;
 
-    bool alreadyUsed;
+    Mat seedDescriptors;
+    vector< vector<int> > seedSets;
 
     int newRandomNum;
     
@@ -368,6 +1052,17 @@ void optimizeCalibrationSet(Size imSize,
         
         if (INTRINSICS_HPP_DEBUG_MODE > 1) printf("%s << DEBUG [%d] \n", __FUNCTION__, 11);
 
+        for (int N = 0; N < num; N++)
+        {
+            expectedTrials += (long)candidatePatternsCpy.size() - N;
+        }
+
+        if (batchSize > 1) {
+            patternPoseDescriptors(candidatePatternsCpy, row, imSize, batchDescriptors);
+        }
+
+        progress->beginStage("intrinsic selection", expectedTrials, "trials");
+
         for (int N = 0; N < num; N++)
         {
 			
@@ -375,105 +1070,114 @@ void optimizeCalibrationSet(Size imSize,
 
             objectPoints.push_back(row);
 
-            //printf("%s << candidatePatternsCpy.size() = %d\n", __FUNCTION__, candidatePatternsCpy.size());
-
-            for (unsigned int i = 0; i < candidatePatternsCpy.size(); i++)
-            {
+			// Trials of this round that the last sweep already ran, on the assumption that this winner would be chosen
+			vector<double> knownScores(candidatePatternsCpy.size(), -1.0);
+			
+            if (speculativeHit >= 0) {
+				knownScores = speculativeScores.at(speculativeHit);
+			}
+			
+			taskWinners.clear();
+			taskCandidates.clear();
+			
+			int speculated = 0;
+			
+			for (unsigned int i = 0; i < candidatePatternsCpy.size(); i++)
+			{
+				unrankedScores[i] = -1.0;
 				
-				if (INTRINSICS_HPP_DEBUG_MODE > 0) printf("%s << Frame = [%d]\n", __FUNCTION__, i);
-
-                tempFrameTester.clear();
-                tempFrameTester.assign(selectedFrames.begin(), selectedFrames.end());
-                tempFrameTester.push_back(candidatePatternsCpy.at(i));
-                
-                if (INTRINSICS_HPP_DEBUG_MODE > 1) printf("%s << DEBUG [%d][%d][%d][%d]\n", __FUNCTION__, 11, N, i, 1);
-
-                bool alreadyAdded = false;
-
-                for (int k = 0; k < addedIndices.size(); k++)
-                {
-                    if (i == addedIndices.at(k))       // this was addedIndices[N] before - but that doesn't make sense...
-                    {
-                        alreadyAdded = true;
-                        //printf("%s << WTF?\n", __FUNCTION__);
-                    }
-                }
-                
-                if (INTRINSICS_HPP_DEBUG_MODE > 1) printf("%s << DEBUG [%d][%d][%d][%d]\n", __FUNCTION__, 11, N, i, 2);
-
-                if (alreadyAdded == true)
-                {
-                    err = -1.0;
-                }
-                else
-                {
+				if (find(addedIndices.begin(), addedIndices.end(), (int)i) != addedIndices.end()) {
+					continue;
+				}
+				
+				if (knownScores[i] > 0.0) {
+					unrankedScores[i] = knownScores[i];
+					progress->update(++trialsCompleted, unrankedScores[i]);
+					speculated++;
+					continue;
+				}
+				
+				randomNum = rand() % 1000 + 1;  // random number between 1 and 1000 (inclusive)
+				
+				// If the frame is not to be tested (more likely with lower testingProbability) it keeps a score of -1
+				if (randomNum > (1 - testingProbability)*1000.0) {
+					taskWinners.push_back(-1);
+					taskCandidates.push_back(i);
+				}
+			}
+			
+			if (debugMode && (speculated > 0)) {
+				printf("%s << (%d) trials for frame #%d were computed speculatively\n", __FUNCTION__, speculated, N+1);
+			}
+			
+			// Blocks only as large as keeps every thread busy
+			int threads = max(getNumThreads(), 1);
+			int roundTasks = (int)taskCandidates.size();
+			int taskBlock = max(1, min(ERE_MODEL_BLOCK, roundTasks / threads));
+			int taskBlocks = (roundTasks + taskBlock - 1) / taskBlock;
+			
+			// Threads that this round's last wave leaves idle start on the next round instead, for its likeliest winners
+			// (the best runners-up of the last round), taking the likeliest candidates first until the wave is full
+			speculativeWinners.clear();
+			
+			int slack = 0;
+			
+			if ((roundTasks > 0) && (N > 0) && (N + 1 < num) && (batchSize == 1)) {
+				slack = ((threads - taskBlocks % threads) % threads) * taskBlock + (taskBlocks * taskBlock - roundTasks);
+			}
+			
+			if (slack > 0) {
+				
+				vector< pair<double, int> > likeliness;
+				
+				for (unsigned int i = 0; i < candidatePatternsCpy.size(); i++) {
+					if (find(addedIndices.begin(), addedIndices.end(), (int)i) == addedIndices.end()) {
+						bool scored = (previousScores.at(i) > 0.0) && (previousScores.at(i) < 1e49);
+						likeliness.push_back(pair<double, int>(scored ? previousScores.at(i) : 9e50, i));
+					}
+				}
+				
+				sort(likeliness.begin(), likeliness.end());
+				
+				for (unsigned int w = 0; (w < likeliness.size()) && ((int)speculativeWinners.size() < SPECULATIVE_MAX_BRANCHES) && (slack > 0); w++) {
 					
-					if (INTRINSICS_HPP_DEBUG_MODE > 1) printf("%s << DEBUG [%d][%d][%d][%d]\n", __FUNCTION__, 11, N, i, 30);
-
-                    randomNum = rand() % 1000 + 1;  // random number between 1 and 1000 (inclusive)
-
-                    Mat fovMat, errMat;
-                    double fovScore, errScore;
-                    
-                    if (INTRINSICS_HPP_DEBUG_MODE > 1) printf("%s << DEBUG [%d][%d][%d][%d]\n", __FUNCTION__, 11, N, i, 31);
-
-                    if (randomNum > (1 - testingProbability)*1000.0)
-                    {
-						
-						if (INTRINSICS_HPP_DEBUG_MODE > 1) {
-							printf("%s << DEBUG [%d][%d][%d][%d]\n", __FUNCTION__, 11, N, i, 32);
-							printf("%s << Calibrating pattern #%d\n", __FUNCTION__, i);
-							printf("%s << objectPoints.size() = %d; tempFrameTester.size() = %d\n", __FUNCTION__, (int)objectPoints.size(), (int)tempFrameTester.size());
-							printf("%s << imSize = (%d, %d); objectPoints.at(0).size() = %d; tempFrameTester.at(0).size() = %d\n", __FUNCTION__, imSize.height, imSize.width, (int)objectPoints.at(0).size(), (int)tempFrameTester.at(0).size());
-							
-						}
-						
-						if (INTRINSICS_HPP_DEBUG_MODE > 0) {
-							printf("%s << About to calibrate: (%d)...\n", __FUNCTION__, (int)objectPoints.size());
-							cout << "cameraMatrix = " << cameraMatrix << endl;
-						}
-						
-						if (intrinsicsFlags == SEARCH_ONLY_FOR_BASIC_PARAMETERS) {
-							cameraMatrix = Mat::eye(3, 3, CV_64FC1);
-							cameraMatrix.at<double>(0,0) = 525.0;
-							cameraMatrix.at<double>(1,1) = 525.0;
-							cameraMatrix.at<double>(0,2) = 319.5;
-							cameraMatrix.at<double>(1,2) = 239.5;
+					if (likeliness.at(w).first > 1e49) {
+						break;
+					}
+					
+					int likeliest = likeliness.at(w).second;
+					speculativeWinners.push_back(likeliest);
+					
+					for (unsigned int t = 0; (t < likeliness.size()) && (slack > 0); t++) {
+						if (likeliness.at(t).second != likeliest) {
+							taskWinners.push_back(likeliest);
+							taskCandidates.push_back(likeliness.at(t).second);
+							slack--;
 						}
-
-                        double tmpErr = calibrateCamera(objectPoints, tempFrameTester, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags);
-
-						
-                        //printf("%s << objectPoints.at(0).size() = %d; fullSetCorners.size() = %d\n", __FUNCTION__, objectPoints.at(0).size(), fullSetCorners.size());
-
-						
-
-                        err = calculateERE(imSize, objectPoints.at(0), fullSetCorners, cameraMatrix, distCoeffs);
-                        
-                        if (INTRINSICS_HPP_DEBUG_MODE > 0) {
-							printf("%s << DEBUG [%d][%d][%d][%d]; tmpErr = (%f), err = (%f)\n", __FUNCTION__, 11, N, i, 34, tmpErr, err);
-						} 
-                        //printf("%s << err = %f\n", __FUNCTION__, err);
-                    }
-                    else
-                    {
-						
-						if (INTRINSICS_HPP_DEBUG_MODE > 0) printf("%s << DEBUG [%d][%d][%d][%d]\n", __FUNCTION__, 11, N, i, 35);
-						
-                        // If the frame is not to be tested (more likely with lower testingProbability)
-                        err = -1.0;
-                    }
-
-                }
-                
-                if (INTRINSICS_HPP_DEBUG_MODE > 0) printf("%s << DEBUG [%d][%d][%d][%d]\n", __FUNCTION__, 11, N, i, 3);
-
-                unrankedScores[i] = err;
-                //printf("%s << score = %f\n", __FUNCTION__, err);
-                
-                
-
-            }
+					}
+				}
+			}
+			
+			taskScores.assign(taskCandidates.size(), -1.0);
+			taskBlocks = ((int)taskCandidates.size() + taskBlock - 1) / taskBlock;
+			
+			parallel_for_(Range(0, taskBlocks), parallelSelectionTrials(imSize, selectedFrames, candidatePatternsCpy, fullSetCorners, row, intrinsicsFlags, prior, taskWinners, taskCandidates, taskBlock, taskScores));
+			
+			speculativeScores.assign(speculativeWinners.size(), vector<double>(candidatePatternsCpy.size(), -1.0));
+			
+			for (unsigned int t = 0; t < taskCandidates.size(); t++) {
+				
+				if (taskWinners.at(t) < 0) {
+					unrankedScores[taskCandidates.at(t)] = taskScores.at(t);
+					progress->update(++trialsCompleted, taskScores.at(t));
+				} else {
+					int branch = find(speculativeWinners.begin(), speculativeWinners.end(), taskWinners.at(t)) - speculativeWinners.begin();
+					speculativeScores.at(branch).at(taskCandidates.at(t)) = taskScores.at(t);
+				}
+			}
+			
+			speculativeHit = -1;
+			previousScores.assign(unrankedScores, unrankedScores + candidatePatternsCpy.size());
             
             if (INTRINSICS_HPP_DEBUG_MODE > 0) printf("%s << DEBUG [%d][%d]\n", __FUNCTION__, 11, N, 2);
 
@@ -496,19 +1200,65 @@ void optimizeCalibrationSet(Size imSize,
             
             if (INTRINSICS_HPP_DEBUG_MODE > 0) printf("%s << DEBUG [%d][%d]\n", __FUNCTION__, 11, N, 3);
 
-            unrankedScores[bestIndex] = 9e50;
+            // Batched rounds add the best few mutually distinct candidates together, if a confirmation calibration agrees
+            batch.assign(1, bestIndex);
+
+            if ((batchSize > 1) && (bestScore < 9e49) && (pickDiverseBatch(unrankedScores, candidatePatternsCpy.size(), batchDescriptors, min(batchSize, num - N), BATCH_MIN_SEPARATION, batch) > 1)) {
+				
+				tempFrameTester.assign(selectedFrames.begin(), selectedFrames.end());
+				
+				for (unsigned int b = 0; b < batch.size(); b++) {
+					tempFrameTester.push_back(candidatePatternsCpy.at(batch.at(b)));
+				}
+				
+				cv::vector< cv::vector<Point3f> > batchObjectPoints(tempFrameTester.size(), row);
+				
+				calibrateCameraTrial(batchObjectPoints, tempFrameTester, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags, prior);
+				batchScore = calculateERE(imSize, row, fullSetCorners, cameraMatrix, distCoeffs);
+				
+				progress->update(++trialsCompleted, batchScore);
+				
+				if (batchScore <= bestScore * (1.0 + BATCH_DIVERGENCE_TOLERANCE)) {
+					printf("%s << Adding (%d) frames together (ERE = %f, best single frame = %f)\n", __FUNCTION__, (int)batch.size(), batchScore, bestScore);
+					bestScore = batchScore;
+				} else {
+					printf("%s << Batch of (%d) diverged (ERE = %f, best single frame = %f); adding single frames from now on\n", __FUNCTION__, (int)batch.size(), batchScore, bestScore);
+					batch.resize(1);
+					batchSize = 1;
+				}
+			}
 
             //printf("%s << Best score for %d frame calibration: %f\n", __FUNCTION__, N+1, bestScore);
 
-            selectedFrames.push_back(candidatePatternsCpy.at(bestIndex));
+            for (unsigned int b = 0; b < batch.size(); b++) {
+				
+				unrankedScores[batch.at(b)] = 9e50;
 
-            // Corrupt best frame in 'originalFramesCpy'
-            for (unsigned int i = 0; i < candidatePatternsCpy.at(bestIndex).size(); i++)
-            {
-                candidatePatternsCpy.at(bestIndex).at(i) = Point2f(0.0,0.0);
-            }
+                selectedFrames.push_back(candidatePatternsCpy.at(batch.at(b)));
 
-            addedIndices.push_back(bestIndex);
+                // Corrupt best frame in 'originalFramesCpy'
+                for (unsigned int i = 0; i < candidatePatternsCpy.at(batch.at(b)).size(); i++)
+                {
+                    candidatePatternsCpy.at(batch.at(b)).at(i) = Point2f(0.0,0.0);
+                }
+
+                addedIndices.push_back(batch.at(b));
+                
+                // One object row per frame added beyond the first (the next sweep adds its own)
+                if (b > 0) {
+					objectPoints.push_back(row);
+					N++;
+				}
+			}
+
+            // A lone winner that was speculated on already has its next round computed
+            if (batch.size() == 1) {
+				for (unsigned int b = 0; b < speculativeWinners.size(); b++) {
+					if (speculativeWinners.at(b) == batch.at(0)) {
+						speculativeHit = b;
+					}
+				}
+			}
 
             if (bestScore < prevBestScore)
             {
@@ -522,9 +1272,16 @@ void optimizeCalibrationSet(Size imSize,
 			
 			if (INTRINSICS_HPP_DEBUG_MODE > 0) printf("%s << DEBUG [%d][%d]\n", __FUNCTION__, 11, N, 4);
 
+            if (convergence.update(bestScore)) {
+				printf("%s << Stopping with (%d) of (%d) frames: %s\n", __FUNCTION__, N+1, num, convergence.reason());
+				break;
+			}
+
         }
 
         delete[] unrankedScores;
+
+        progress->endStage();
         
         if (INTRINSICS_HPP_DEBUG_MODE > 0) printf("%s << DEBUG [%d] \n", __FUNCTION__, 12);
 
@@ -542,6 +1299,21 @@ void optimizeCalibrationSet(Size imSize,
         
         //printf("%s << ENTERED. (%d)\n", __FUNCTION__, 3);
 
+        break;
+        // ==================================================
+    case PARTITIONED_GREEDY_OPTIMIZATION_CODE:     //        PARTITIONED (DISTRIBUTED) GREEDY SELECTION
+        // ==================================================
+
+        partitionedGreedySelection(imSize, candidatePatternsCpy, fullSetCorners, row, num, shards, intrinsicsFlags, progress, prior, patience, batchSize, addedIndices);
+
+        candidatePatterns.clear();
+
+        for (unsigned int i = 0; i < addedIndices.size(); i++)
+        {
+            candidatePatterns.push_back(candidatePatternsCpy.at(addedIndices.at(i)));
+            selectedTags.push_back(tagNames.at(addedIndices.at(i)));
+        }
+
         break;
         // ==================================================
     case RANDOM_SEED_OPTIMIZATION_CODE:     //        Random N-seed accumulative search
@@ -557,53 +1329,41 @@ void optimizeCalibrationSet(Size imSize,
 
 
 
+        // Only a handful of pose-diverse seed sets are worth calibrating
+        nSeeds = min(nSeeds, (int)candidatePatternsCpy.size());
+
+        patternPoseDescriptors(candidatePatternsCpy, row, imSize, seedDescriptors);
+        diverseSeedSets(seedDescriptors, nSeeds, DIVERSE_SEED_SETS, seedSets);
+
         bestSeedSet = new int[nSeeds];
-        currentSeedSet = new int[nSeeds];
 
+        expectedTrials = seedSets.size();
+
+        for (int N = nSeeds; N < num; N++)
+        {
+            expectedTrials += (long)candidatePatternsCpy.size() - N;
+        }
 
+        progress->beginStage("intrinsic selection", expectedTrials, "trials");
 
-        for (int iii = 0; iii < nSeedTrials; iii++)
+        for (unsigned int iii = 0; iii < seedSets.size(); iii++)
         {
 
             objectPoints.clear();
             tempFrameTester.clear();
 
-            randomNum = rand() % candidatePatternsCpy.size();
-
-            currentSeedSet[0] = randomNum;
-            objectPoints.push_back(row);
-
-
-            tempFrameTester.push_back(candidatePatternsCpy.at(currentSeedSet[0]));
-
-            for (int jjj = 1; jjj < nSeeds; jjj++)
+            for (int jjj = 0; jjj < nSeeds; jjj++)
             {
-                do
-                {
-                    alreadyUsed = false;
-
-                    randomNum = rand() % candidatePatternsCpy.size();
-
-                    for (int kkk = 0; kkk < jjj; kkk++)
-                    {
-                        if (randomNum == currentSeedSet[kkk])
-                        {
-                            alreadyUsed = true;
-                        }
-                    }
-                }
-                while (alreadyUsed);
-
-                currentSeedSet[jjj] = randomNum;
-
                 objectPoints.push_back(row);
-                tempFrameTester.push_back(candidatePatternsCpy.at(currentSeedSet[jjj]));
+                tempFrameTester.push_back(candidatePatternsCpy.at(seedSets[iii][jjj]));
             }
 
-            calibrateCamera(objectPoints, tempFrameTester, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags);
+            calibrateCameraTrial(objectPoints, tempFrameTester, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags, prior);
 
             currentSeedScore = calculateERE(imSize, objectPoints.at(0), fullSetCorners, cameraMatrix, distCoeffs);
 
+            progress->update(++trialsCompleted, currentSeedScore);
+
             if (currentSeedScore < bestSeedScore)
             {
                 bestSeedScore = currentSeedScore;
@@ -612,7 +1372,7 @@ void optimizeCalibrationSet(Size imSize,
 
                 for (int jjj = 0; jjj < nSeeds; jjj++)
                 {
-                    bestSeedSet[jjj] = currentSeedSet[jjj];
+                    bestSeedSet[jjj] = seedSets[iii][jjj];
                 }
 
             }
@@ -682,11 +1442,13 @@ void optimizeCalibrationSet(Size imSize,
                         //printf("%s << objectPoints.size() = %d; tempFrameTester.size() = %d\n", __FUNCTION__, objectPoints.size(), tempFrameTester.size());
                         
                         
-                        calibrateCamera(objectPoints, tempFrameTester, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags);
+                        calibrateCameraTrial(objectPoints, tempFrameTester, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags, prior);
 
                         //printf("%s << objectPoints.at(0).size() = %d; fullSetCorners.size() = %d\n", __FUNCTION__, objectPoints.at(0).size(), fullSetCorners.size());
 
                         err = calculateERE(imSize, objectPoints.at(0), fullSetCorners, cameraMatrix, distCoeffs);
+
+                        progress->update(++trialsCompleted, err);
                         //printf("%s << err = %f\n", __FUNCTION__, err);
                     }
                     else
@@ -738,6 +1500,8 @@ void optimizeCalibrationSet(Size imSize,
 
         delete[] unrankedScores;
 
+        progress->endStage();
+
         printf("%s << Optimum number of frames for calibration = %d\n", __FUNCTION__, optimumNum+1);
 
         candidatePatterns.clear();
@@ -765,6 +1529,13 @@ void optimizeCalibrationSet(Size imSize,
 
         bestScore = 9e99;
 
+        for (int N = 0; N < num; N++)
+        {
+            expectedTrials += (long)(factorial(candidatePatternsCpy.size()) / (factorial(N+1) * factorial(candidatePatternsCpy.size() - N - 1)));
+        }
+
+        progress->beginStage("intrinsic selection", expectedTrials, "trials");
+
         // For each different value of N
         for (int N = 0; N < num; N++)
         {
@@ -796,13 +1567,15 @@ void optimizeCalibrationSet(Size imSize,
                     tempFrameTester.push_back(candidatePatternsCpy.at(currentIndices.at(j)));
                 }
 
-                err = calibrateCamera(objectPoints, tempFrameTester, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags);
+                err = calibrateCameraTrial(objectPoints, tempFrameTester, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags, prior);
 
                 Mat fovMat, errMat;
                 double fovScore, errScore;
 
                 err = calculateERE(imSize, objectPoints.at(0), fullSetCorners, cameraMatrix, distCoeffs);
 
+                progress->update(++trialsCompleted, err);
+
                 if (err < topScore)
                 {
                     topScore = err;
@@ -828,6 +1601,8 @@ void optimizeCalibrationSet(Size imSize,
 
         }
 
+        progress->endStage();
+
         candidatePatterns.clear();
 
         printf("%s << Optimum number of frames for calibration = %d\n", __FUNCTION__, (int)bestIndices.size());
@@ -848,6 +1623,8 @@ void optimizeCalibrationSet(Size imSize,
 
         printf("%s << Random trial selection\n", __FUNCTION__);
 
+        progress->beginStage("intrinsic selection", (long)nTrials * num, "trials");
+
         for (unsigned int k = 0; k < nTrials; k++)
         {
 
@@ -870,12 +1647,14 @@ void optimizeCalibrationSet(Size imSize,
                 candidatePatterns.erase(candidatePatterns.begin()+randomNum);
                 //printf("%s << oP.size() = %d; nC.size() = %d\n", __FUNCTION__, objectPoints.size(), newCorners.size());
 
-                err = calibrateCamera(objectPoints, newCorners, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags);
+                err = calibrateCameraTrial(objectPoints, newCorners, imSize, cameraMatrix, distCoeffs, rvecs, tvecs, intrinsicsFlags, prior);
 
                 Mat fovMat, errMat;
                 double fovScore, errScore;
                 err = calculateERE(imSize, objectPoints.at(0), fullSetCorners, cameraMatrix, distCoeffs);
 
+                progress->update(++trialsCompleted, err);
+
                 values[N*nTrials+k] = err;
 
                 //printf("%s << trial #%d, N = %d, score = %f\n", __FUNCTION__, k, N, err);
@@ -896,6 +1675,8 @@ void optimizeCalibrationSet(Size imSize,
             }
         }
 
+        progress->endStage();
+
         candidatePatterns.clear();
 
         for (int N = 0; N < num; N++)
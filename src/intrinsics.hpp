@@ -18,6 +18,17 @@
 #define RADIAL_LENGTH 						1000
 #define DEFAULT_NUM							10
 
+#define DEFAULT_SELECTION_SHARDS			4
+#define PARTITIONED_COMPARISON_MAX_POOL		200		// largest pool that plain greedy selection is run on for comparison
+
+#define SPECULATIVE_MAX_BRANCHES			2		// likeliest winners whose next greedy round is started on otherwise idle threads
+
+#define ERE_MODEL_BLOCK						8		// most candidate models scored together in one pass over the test patterns
+
+#define MODEL_COMPARISON_FOLDS				4		// cross-validation folds over each model's selected frames
+
+#define DEFAULT_PRIOR_FOCAL_RATIO			0.8203125	// fallback focal length as a fraction of image width (525 px at 640 x 480)
+
 #define INTRINSICS_HPP_DEBUG_MODE 			0
 
 //#include "cv_utils.hpp"
@@ -28,6 +39,50 @@
 using namespace std;
 using namespace cv;
 
+/// \brief      Starting intrinsics for a camera: a previous calibration from the priors store, or a guess from the image size
+struct cameraPrior {
+    Mat cameraMatrix;
+    Mat distCoeffs;
+    /// \brief		True if taken from the store, in which case every solve starts from it rather than only the focal-length search
+    bool fromStore;
+
+    /// \brief 		Default Constructor.
+    cameraPrior();
+};
+
+/// \brief      How one distortion model fared in compareDistortionModels()
+struct modelComparisonResult {
+    int intrinsicsFlags;
+    cv::vector< cv::vector<Point2f> > selection;
+    vector<int> selectedTags;
+    Mat cameraMatrix;
+    Mat distCoeffs;
+    /// \brief		OpenCV MRE over the selected frames
+    double reprojError;
+    /// \brief		ERE over the whole candidate pool
+    double ere;
+    /// \brief		Mean error on frames held out of each fold's solve (-1 if too few frames were selected to fold)
+    double crossValidatedError;
+    /// \brief		Selection and solve time in ms
+    double time;
+
+    /// \brief 		Default Constructor.
+    modelComparisonResult();
+};
+
+/// \brief      Fallback prior from the image size alone: centred principal point, focal length a fixed fraction of the width, no distortion
+void defaultCameraPrior(Size imSize, cameraPrior& prior);
+
+/// \brief      Loads the prior stored for a camera at a given image size, falling back to defaultCameraPrior()
+/// \return     False if the store (or the entry) was missing and the fallback was used
+bool loadCameraPrior(const char *filename, const char *cameraId, Size imSize, cameraPrior& prior);
+
+/// \brief      Adds or replaces a camera's entry in the priors store, keeping the entries of every other camera
+bool saveCameraPrior(const char *filename, const char *cameraId, Size imSize, const Mat& cameraMatrix, const Mat& distCoeffs);
+
+/// \brief      Resets cameraMatrix and distCoeffs to the prior before a solve, adding CV_CALIB_USE_INTRINSIC_GUESS for stored priors
+void seedFromPrior(const cameraPrior& prior, Mat& cameraMatrix, Mat& distCoeffs, int& flags);
+
 /// \brief      Cut down the given vector of pointsets to those optimal for calibration
 void optimizeCalibrationSet(Size imSize,
                             cv::vector< cv::vector<Point2f> >& candidatePatterns,
@@ -37,7 +92,40 @@ void optimizeCalibrationSet(Size imSize,
                             int selection = ENHANCED_MCM_OPTIMIZATION_CODE,
                             int num = DEFAULT_NUM,
                             bool debugMode = false,
-                            int intrinsicsFlags = DEFAULT_INTRINSICS_FLAGS);
+                            int intrinsicsFlags = DEFAULT_INTRINSICS_FLAGS,
+                            progressReporter *progress = NULL,
+                            int shards = DEFAULT_SELECTION_SHARDS,
+                            const cameraPrior *prior = NULL,
+                            int patience = DEFAULT_PLATEAU_PATIENCE,
+                            int batchSize = DEFAULT_SELECTION_BATCH);
+
+/// \brief      Runs plain and partitioned greedy selection on the same (small) pool and reports the ERE and time of each
+void comparePartitionedSelection(Size imSize,
+                                 cv::vector< cv::vector<Point2f> >& candidatePatterns,
+                                 cv::vector<Point3f> row,
+                                 int num,
+                                 int shards = DEFAULT_SELECTION_SHARDS,
+                                 int intrinsicsFlags = DEFAULT_INTRINSICS_FLAGS,
+                                 const cameraPrior *prior = NULL,
+                                 int patience = DEFAULT_PLATEAU_PATIENCE,
+                                 int batchSize = DEFAULT_SELECTION_BATCH);
+
+/// \brief      The distortion models worth comparing for the given flags: plumb-bob (5 coefficients) and rational (8 coefficients)
+void distortionModelVariants(int intrinsicsFlags, vector<int>& flagVariants);
+
+/// \brief      Runs selection and the final solve for every flag variant concurrently, on the same detected candidate pool
+/// \return     Index of the winning variant (lowest cross-validated error, or lowest ERE if none could be cross-validated)
+int compareDistortionModels(Size imSize,
+                            cv::vector< cv::vector<Point2f> >& candidatePatterns,
+                            cv::vector<Point3f> row,
+                            const vector<int>& flagVariants,
+                            vector<modelComparisonResult>& results,
+                            int selection = ENHANCED_MCM_OPTIMIZATION_CODE,
+                            int num = DEFAULT_NUM,
+                            int shards = DEFAULT_SELECTION_SHARDS,
+                            const cameraPrior *prior = NULL,
+                            int patience = DEFAULT_PLATEAU_PATIENCE,
+                            int batchSize = DEFAULT_SELECTION_BATCH);
 
 /// \brief      Calculate the Extended Reprojection Error: The reprojection error over a desired set of frames.
 double calculateERE(Size imSize,
@@ -47,5 +135,14 @@ double calculateERE(Size imSize,
                     const Mat& distCoeffs,
                     double errValues[] = NULL);
 
+/// \brief      calculateERE() for a block of models at once: each test pattern is posed and reprojected under every model
+///             while its corners are still in cache, rather than the whole test set being streamed once per model
+void calculateEREBlock(Size imSize,
+                       cv::vector<Point3f>& physicalPoints,
+                       cv::vector< cv::vector<Point2f> >& corners,
+                       const cv::vector<Mat>& cameraMatrices,
+                       const cv::vector<Mat>& distCoeffs,
+                       double *eres);
+
 
 #endif
@@ -21,6 +21,28 @@ int main(int argc, char* argv[])
     bool wantsToWrite = false;
     double correctionFactor = DEFAULT_CORRECTION_FACTOR;
     bool outputFoundPatterns = false;
+    char *overlayFormat = NULL;
+    int overlayQuality = DEFAULT_WRITER_QUALITY;
+    char *diagnosticsFile = NULL;
+    double progressInterval = DEFAULT_PROGRESS_INTERVAL;
+    char *statusFile = NULL;
+    double memoryBudgetMB = 0.0;
+    int benchmarkThreads = 0;
+    double benchmarkFrameRate = DEFAULT_BENCHMARK_FPS;
+    bool wantsPerfCounters = false;
+    int tuningSampleSize = 0;
+    bool wantsROIMasks = false;
+    int backgroundSampleSize = 0;
+    int prescreenWidth = 0;
+    bool wantsThermalLocalization = false;
+    char *rigEstimateFile = NULL;
+    int maxBoardsPerFrame = DEFAULT_MAX_BOARDS;
+    bool wantsQualityRanking = false;
+    int selectionShards = DEFAULT_SELECTION_SHARDS;
+    char *priorsFile = NULL;
+    int plateauPatience = DEFAULT_PLATEAU_PATIENCE;
+    int selectionBatch = DEFAULT_SELECTION_BATCH;
+    bool wantsModelComparison = false;
 
     // Currently only contains support for input being in the form of a folder (and maybe AVI video)
     bool inputIsFolder = true;
@@ -56,7 +78,7 @@ int main(int argc, char* argv[])
     {
 
 
-        while ((c = getopt(argc, argv, "a:b:c:d:efg:hin:o:p:qrst:uvx:y:z")) != -1)
+        while ((c = getopt(argc, argv, "a:b:c:d:efg:hij:k:l:n:o:p:qrst:uvx:y:zA:B:D:E:F:G:HI:LM:N:P:Q:RS:T:UX:Y")) != -1)
         {
 
             switch (c)
@@ -91,6 +113,72 @@ int main(int argc, char* argv[])
                 break;
 			case 'z':
                 outputFoundPatterns = true;
+                break;
+			case 'D':
+                diagnosticsFile = optarg;
+                break;
+			case 'F':
+                overlayFormat = optarg;
+                break;
+			case 'Q':
+                overlayQuality = atoi(optarg);
+                break;
+			case 'M':
+                memoryBudgetMB = atof(optarg);
+                break;
+			case 'P':
+                progressInterval = atof(optarg);
+                break;
+			case 'S':
+                statusFile = optarg;
+                break;
+			case 'B':
+                benchmarkThreads = atoi(optarg);
+                break;
+			case 'j':
+                benchmarkFrameRate = atof(optarg);
+                break;
+			case 'H':
+                wantsPerfCounters = true;
+                break;
+			case 'A':
+                tuningSampleSize = atoi(optarg);
+                break;
+			case 'L':
+                wantsROIMasks = true;
+                break;
+			case 'l':
+                backgroundSampleSize = atoi(optarg);
+                break;
+			case 'T':
+                prescreenWidth = atoi(optarg);
+                break;
+			case 'R':
+                wantsThermalLocalization = true;
+                break;
+			case 'X':
+                rigEstimateFile = optarg;
+                break;
+			case 'N':
+                maxBoardsPerFrame = max(atoi(optarg), 1);
+                break;
+			case 'Y':
+                wantsQualityRanking = true;
+                break;
+			case 'G':
+                selectionShards = max(atoi(optarg), 1);
+                break;
+			case 'I':
+                priorsFile = optarg;
+                break;
+			case 'E':
+                plateauPatience = atoi(optarg);
+                break;
+			case 'k':
+                selectionBatch = max(atoi(optarg), 1);
+                break;
+			case 'U':
+                wantsModelComparison = true;
                 break;
             case 'g':
                 gridSize = atof(optarg);
@@ -140,6 +228,28 @@ int main(int argc, char* argv[])
 
     }
 
+    // Hardware counters are sampled around the detection and selection hot paths only when asked for
+    enablePerfCounters(wantsPerfCounters);
+
+    if (benchmarkThreads > 0)
+    {
+        // Benchmark mode replays a synthetic board, so no input directory or video is needed
+        benchmarkSettings settings;
+        settings.patternSize = cvSize(x, y);
+        settings.patternFinderCode = patternFinderCode;
+        settings.correctionFactor = correctionFactor;
+        settings.frameRate = benchmarkFrameRate;
+
+        if (providedMSERparams) {
+            obtainMSERparameters(parametersFile, settings.mserParams);
+        }
+
+        runThroughputBenchmark(settings, benchmarkThreads);
+
+        reportPerfCounters();
+
+        return 0;
+    }
 
     int maxFramesToLoad = DEFAULT_FRAMES_TO_LOAD;   // DANGER!! THIS HAS BEEN SET LOW FOR TESTING / DEVELOPMENT
 
@@ -515,14 +625,27 @@ int main(int argc, char* argv[])
 
     Mat inputMat[MAX_CAMS];
 
-    vector<Mat> allImages[MAX_CAMS];
-
     Mat tmpMat, dispMat;
 
     bool patternFound = false;
 
     vector<bool> foundRecord[MAX_CAMS];
 
+    // Boards beyond the first in a frame, with the frame each came from; these only feed the intrinsics
+    cv::vector<cv::vector<Point2f> > extraBoards[MAX_CAMS];
+    vector<int> extraBoardFrames[MAX_CAMS];
+    cv::vector<cv::vector<Point2f> > frameBoards;
+
+    // Frames in which a camera found several boards, and frames whose board was matched to camera 0's through the rig prediction;
+    // a frame only feeds the extrinsics if every camera is known to have kept the same physical board
+    vector<bool> multiBoardRecord[MAX_CAMS];
+    vector<bool> matchedRecord[MAX_CAMS];
+
+    // Detection quality scores, parallel to cornersList and extraBoards (only filled in with -Y)
+    vector<double> qualityRecord[MAX_CAMS];
+    vector<double> extraBoardQuality[MAX_CAMS];
+    Size boardSize = (patternFinderCode == MASK_FINDER_CODE) ? cvSize(2*x, 2*y) : cvSize(x, y);
+
     int index = 0, frameIndex = 0;
     
     mserParameterGroup mserParams;
@@ -530,9 +653,159 @@ int main(int argc, char* argv[])
     if (providedMSERparams) {
 		obtainMSERparameters(parametersFile, mserParams);
 	}
+
+    // Each camera starts from the same MSER parameters, which auto-tuning may then adjust per camera
+    mserParameterGroup cameraMserParams[MAX_CAMS];
+
+    for (unsigned int nnn = 0; nnn < numCams; nnn++)
+    {
+        cameraMserParams[nnn] = mserParams;
+    }
+
+    // A provisional rig lets cameras 1..N search only where camera 0's board should appear
+    rigEstimate rig;
+
+    if ((rigEstimateFile != NULL) && (numCams > 1))
+    {
+        if (loadRigEstimate(rigEstimateFile, numCams, rig))
+        {
+            printf("%s << Predicting search regions from rig estimate (%s)\n", __FUNCTION__, rigEstimateFile);
+        }
+    }
+
+    // Restrict each camera's MSER search to a hand-drawn mask and / or away from learned static clutter
+    if (wantsROIMasks || (backgroundSampleSize > 0))
+    {
+        for (unsigned int nnn = 0; nnn < numCams; nnn++)
+        {
+            vector<Mat> sampleFrames;
+
+            int sampleSize = max(backgroundSampleSize, 1);
+
+            if (inputIsFolder)
+            {
+                sampleFramesFromList(inStream[nnn], culledList, sampleSize, sampleFrames);
+            }
+            else
+            {
+                sampleFramesFromVideo(inStream[nnn], videoFrameCount[nnn], sampleSize, sampleFrames);
+            }
+
+            if (sampleFrames.size() == 0)
+            {
+                printf("%s << WARNING. No frames could be sampled for camera (%d); searching the whole frame.\n", __FUNCTION__, nnn);
+                continue;
+            }
+
+            Mat roiMask;
+
+            if (wantsROIMasks)
+            {
+                char maskFilename[256];
+                sprintf(maskFilename, "%s/%d-mask.png", directory, nnn);
+
+                if (loadROIMask(maskFilename, sampleFrames.at(0).size(), roiMask))
+                {
+                    printf("%s << Loaded ROI mask (%s)\n", __FUNCTION__, maskFilename);
+                }
+            }
+
+            if (backgroundSampleSize > 0)
+            {
+                Mat backgroundMask;
+                learnBackgroundMask(sampleFrames, backgroundMask);
+
+                if (!backgroundMask.empty())
+                {
+                    char backgroundFilename[256];
+                    sprintf(backgroundFilename, "%s/%d-background.png", directory, nnn);
+                    imwrite(backgroundFilename, backgroundMask);
+
+                    printf("%s << Learned background mask written to (%s); rename it to %d-mask.png and use -L to reuse it.\n", __FUNCTION__, backgroundFilename, nnn);
+
+                    combineROIMasks(roiMask, backgroundMask);
+                }
+            }
+
+            if (!roiMask.empty())
+            {
+                printf("%s << Camera (%d) searches %.1f%% of each frame.\n", __FUNCTION__, nnn, 100.0 * maskCoverage(roiMask));
+            }
+
+            cameraMserParams[nnn].mask = roiMask;
+        }
+    }
+
+    if ((tuningSampleSize > 0) && (patternFinderCode != MASK_FINDER_CODE))
+    {
+        printf("%s << WARNING. Only the MSER mask finder has parameters to tune; ignoring -A.\n", __FUNCTION__);
+    }
+    else if (tuningSampleSize > 0)
+    {
+        for (unsigned int nnn = 0; nnn < numCams; nnn++)
+        {
+            vector<Mat> sampleFrames;
+
+            if (inputIsFolder)
+            {
+                sampleFramesFromList(inStream[nnn], culledList, tuningSampleSize, sampleFrames);
+            }
+            else
+            {
+                sampleFramesFromVideo(inStream[nnn], videoFrameCount[nnn], tuningSampleSize, sampleFrames);
+            }
+
+            if (sampleFrames.size() == 0)
+            {
+                printf("%s << WARNING. No frames could be sampled for camera (%d); keeping its MSER parameters.\n", __FUNCTION__, nnn);
+                continue;
+            }
+
+            printf("%s << Tuning MSER parameters for camera (%d) on %d frames...\n", __FUNCTION__, nnn, (int)sampleFrames.size());
+
+            mserTuningResult tuned = tuneMSERparameters(sampleFrames, cvSize(x,y), cameraMserParams[nnn], correctionFactor);
+
+            cameraMserParams[nnn] = tuned.params;
+
+            char tunedFilename[256];
+            sprintf(tunedFilename, "%s/mser-%d.txt", directory, nnn);
+
+            if (writeMSERparameters(tunedFilename, tuned.params))
+            {
+                printf("%s << Tuned MSER parameters written to (%s); pass them back with -p to skip tuning.\n", __FUNCTION__, tunedFilename);
+            }
+        }
+    }
     
     // --------------------------------------------- THE PATTERN SEARCH
 
+    // Memory held by each stage, checked against the (optional) budget as frames are ingested
+    memoryAccount memory;
+    memory.setBudget((size_t)(memoryBudgetMB * 1024.0 * 1024.0));
+
+    // Annotated frames are encoded and written by a background pool so that detection never waits on disk
+    // (created on the first overlay, once the frame size is known and the queue can be sized to the budget)
+    asyncImageWriter *overlayWriter = NULL;
+    vector<int> overlayParams;
+
+    if (outputFoundPatterns) {
+		buildEncoderParameters(overlayFormat, overlayQuality, overlayParams);
+	}
+
+    // Per-frame record of where detection time goes and why frames are rejected
+    detectionLog detectionDiagnostics;
+
+    if (diagnosticsFile != NULL) {
+		if (detectionDiagnostics.open(diagnosticsFile)) {
+			printf("%s << Writing detection diagnostics to (%s)\n", __FUNCTION__, diagnosticsFile);
+		}
+	}
+
+    // Periodic throughput / ETA reports, so a slow run can be told apart from a hung one
+    progressReporter progress;
+    progress.setInterval(progressInterval);
+    progress.setStatusFile(statusFile);
+
     // Run through each camera separately to find the patterns
     for (unsigned int nnn = 0; nnn < numCams; nnn++)
     {
@@ -570,10 +843,21 @@ int main(int argc, char* argv[])
 
 
 
+        int predictedSearches = 0, predictedFallbacks = 0;
+
+        char stageName[64];
+        sprintf(stageName, "detection %d", nnn);
+        progress.beginStage(stageName, numFramesToCapture, "frames");
+
         // For each frame for each camera
         while (index < numFramesToCapture)
         {
 
+            detectionRecord frameRecord;
+            frameRecord.camera = nnn;
+            frameRecord.frame = inputIsFolder ? index : randomIndexArray[index];
+
+            int64 decodeStart = getTickCount();
 
             if (inputIsFolder)
             {
@@ -601,15 +885,19 @@ int main(int argc, char* argv[])
 
 
             }
+
+            frameRecord.decodeTime = elapsedMS(decodeStart);
             
             if (outputFoundPatterns) {
-				sprintf(outputFilename, "%s/%s", patternDirectoryPath, (culledList.at(index)).c_str());
+				if (inputIsFolder) {
+					sprintf(outputFilename, "%s/%s", patternDirectoryPath, (culledList.at(index)).c_str());
+				} else {
+					sprintf(outputFilename, "%s/%06d.jpg", patternDirectoryPath, randomIndexArray[index]);
+				}
 			}
 
             //printf("%s << filename = %s\n", __FUNCTION__, filename);
 
-            allImages[nnn].push_back(inputMat[nnn]);
-            
             //if (verboseMode) printf("%s << Image pushed back.\n", __FUNCTION__);
 
             //printf("%s << DEBUG {%d}{%d}\n", __FUNCTION__, 0, 5);
@@ -629,56 +917,246 @@ int main(int argc, char* argv[])
             patternFound = false;
 
             cornerSet.clear();
+            frameBoards.clear();
+
+            int64 detectionStart = getTickCount();
+
+            Mat searchMat = inputMat[nnn];
+            Rect searchRegion(0, 0, inputMat[nnn].cols, inputMat[nnn].rows);
+            mserParameterGroup frameMserParams = cameraMserParams[nnn];
 
-            switch (patternFinderCode)
+            vector<Point2f> predictedCorners;
+            bool regionFound = false;
+
+            // Once camera 0 has seen the board in this frame, the rig estimate says where to look in the others
+            if ((nnn > 0) && rig.valid && (index < (int)foundRecord[0].size()) && foundRecord[0][index])
             {
-            case CHESSBOARD_FINDER_CODE:
-                patternFound = findChessboardCorners(inputMat[nnn], cvSize(x,y), cornerSet);
-                break;
-            case MASK_FINDER_CODE:
-                //printf("%s << DEBUG {%d}{%d}\n", __FUNCTION__, x, y);
-                patternFound = findMaskCorners_1(inputMat[nnn], cvSize(x,y), cornerSet, mserParams, correctionFactor, PATTERN_FINDER_CV_CORNER_SUBPIX_FLAG);
-                break;
-            case HEATED_CHESSBOARD_FINDER_CODE:
-                invertMatIntensities(inputMat[nnn], tmpMat);
-                tmpMat.copyTo(inputMat[nnn]);
-                patternFound = findChessboardCorners(inputMat[nnn], cvSize(x,y), cornerSet);
-                break;
-            default:
-                patternFound = findChessboardCorners(inputMat[nnn], cvSize(x,y), cornerSet);
-                break;
+                regionFound = predictPatternRegion(rig, nnn, row, cornersList[0][index], inputMat[nnn].size(), predictedCorners, searchRegion);
+
+                if (regionFound) predictedSearches++;
+            }
+
+            // In thermal captures the board is the warmest large region, so only a padded box around it is searched
+            if (!regionFound && wantsThermalLocalization)
+            {
+                regionFound = localizeWarmRegion(inputMat[nnn], searchRegion);
+            }
+
+            if (regionFound)
+            {
+                searchMat = inputMat[nnn](searchRegion);
+
+                if (!frameMserParams.mask.empty())
+                {
+                    frameMserParams.mask = cameraMserParams[nnn].mask(searchRegion);
+                }
+            }
+
+            // A search confined to the predicted region that fails is repeated on the whole frame, since the rig estimate may be stale
+            bool predictedRegion = regionFound && !predictedCorners.empty();
+
+            for (int attempt = 0; attempt < 2; attempt++)
+            {
+                // A thumbnail blob count rejects frames without the board before the full-resolution MSER search
+                bool worthSearching = true;
+
+                if ((prescreenWidth > 0) && (patternFinderCode == MASK_FINDER_CODE))
+                {
+                    int64 prescreenStart = getTickCount();
+                    worthSearching = prescreenPattern(searchMat, cvSize(x,y), prescreenWidth, &frameRecord.prescreenCount);
+                    frameRecord.prescreenTime = elapsedMS(prescreenStart);
+
+                    if (!worthSearching)
+                    {
+                        frameRecord.rejection = REJECTION_PRESCREEN;
+                    }
+                }
+
+                switch (patternFinderCode)
+                {
+                case CHESSBOARD_FINDER_CODE:
+                    patternFound = findChessboardCorners(searchMat, cvSize(x,y), cornerSet);
+                    break;
+                case MASK_FINDER_CODE:
+                    //printf("%s << DEBUG {%d}{%d}\n", __FUNCTION__, x, y);
+                    if (maxBoardsPerFrame > 1)
+                    {
+                        // The largest board (or, with a rig prediction, the one nearest it) keeps the frame's place in cornersList
+                        patternFound = worthSearching && (findMultipleMaskCorners(searchMat, cvSize(x,y), frameBoards, frameMserParams, correctionFactor, PATTERN_FINDER_CV_CORNER_SUBPIX_FLAG, maxBoardsPerFrame, &frameRecord) > 0);
+
+                        if (patternFound) cornerSet = frameBoards[0];
+                    }
+                    else
+                    {
+                        patternFound = worthSearching && findMaskCorners_1(searchMat, cvSize(x,y), cornerSet, frameMserParams, correctionFactor, PATTERN_FINDER_CV_CORNER_SUBPIX_FLAG, &frameRecord);
+                    }
+                    break;
+                case HEATED_CHESSBOARD_FINDER_CODE:
+                    // Inverted in place, so only once however many times the frame is searched
+                    if (attempt == 0)
+                    {
+                        invertMatIntensities(inputMat[nnn], tmpMat);
+                        tmpMat.copyTo(inputMat[nnn]);
+                    }
+                    patternFound = findChessboardCorners(searchMat, cvSize(x,y), cornerSet);
+                    break;
+                default:
+                    patternFound = findChessboardCorners(searchMat, cvSize(x,y), cornerSet);
+                    break;
+                }
+
+                if (patternFound || !predictedRegion || (attempt > 0))
+                {
+                    break;
+                }
+
+                predictedFallbacks++;
+
+                searchMat = inputMat[nnn];
+                searchRegion = Rect(0, 0, inputMat[nnn].cols, inputMat[nnn].rows);
+                frameMserParams.mask = cameraMserParams[nnn].mask;
+                frameRecord.rejection = REJECTION_NONE;
+                frameBoards.clear();
+                cornerSet.clear();
+            }
+
+            // Of several boards, the one camera 0's board projects onto is the same physical board
+            bool boardMatched = false;
+
+            if ((frameBoards.size() > 1) && !predictedCorners.empty())
+            {
+                Point2f predictedCentre = pointSetCentroid(predictedCorners);
+                int nearest = 0;
+                double nearestDistance = DBL_MAX;
+
+                for (unsigned int bbb = 0; bbb < frameBoards.size(); bbb++)
+                {
+                    Point2f boardCentre = pointSetCentroid(frameBoards[bbb]) + Point2f(float(searchRegion.x), float(searchRegion.y));
+                    double distance = norm(boardCentre - predictedCentre);
+
+                    if (distance < nearestDistance)
+                    {
+                        nearestDistance = distance;
+                        nearest = bbb;
+                    }
+                }
+
+                swap(frameBoards[0], frameBoards[nearest]);
+                cornerSet = frameBoards[0];
+                boardMatched = true;
+            }
+            else if (patternFound && !predictedCorners.empty())
+            {
+                boardMatched = true;
+            }
+
+            if (searchRegion.tl() != Point(0, 0))
+            {
+                offsetPoints(cornerSet, searchRegion.tl());
+            }
+
+            for (unsigned int bbb = 1; bbb < frameBoards.size(); bbb++)
+            {
+                offsetPoints(frameBoards[bbb], searchRegion.tl());
+
+                extraBoards[nnn].push_back(frameBoards[bbb]);
+                extraBoardFrames[nnn].push_back(index);
+                extraBoardQuality[nnn].push_back(wantsQualityRanking ? assessPatternQuality(inputMat[nnn], boardSize, frameBoards[bbb]).score : 0.0);
+                memory.allocate(MEMORY_STAGE_CORNERS, frameBoards[bbb].size() * sizeof(Point2f));
+            }
+
+            if (patternFound && !predictedCorners.empty())
+            {
+                alignToPrediction(cornerSet, predictedCorners);
+            }
+
+            double frameQuality = 0.0;
+
+            if (patternFound && wantsQualityRanking)
+            {
+                frameQuality = assessPatternQuality(inputMat[nnn], boardSize, cornerSet).score;
             }
             
              if (verboseMode) printf("%s << Pattern searched for. Result = (%d); cornerSet.size() = (%d)\n", __FUNCTION__, patternFound, (int)cornerSet.size());
 
+            if (detectionDiagnostics.isOpen())
+            {
+                // The MSER finder fills in its own stage breakdown; the OpenCV finders only report the outcome
+                frameRecord.totalTime = elapsedMS(detectionStart);
+                frameRecord.cornerCount = patternFound ? (int)cornerSet.size() : 0;
+
+                if (inputMat[nnn].empty())
+                {
+                    frameRecord.rejection = REJECTION_EMPTY_FRAME;
+                }
+                else if (!patternFound && (frameRecord.rejection == REJECTION_NONE))
+                {
+                    frameRecord.rejection = REJECTION_CHESSBOARD_NOT_FOUND;
+                }
+
+                detectionDiagnostics.write(frameRecord);
+            }
+
 			
 
             //printf("%s << Pattern found? %d\n", __FUNCTION__, patternFound);
 
-            inputMat[nnn].copyTo(dispMat);
+            // Only render the overlay if it is going to be shown or saved
+            if (wantsToDisplay || outputFoundPatterns)
+            {
+                // clone() rather than copyTo() so the writer pool never sees this buffer reused
+                dispMat = inputMat[nnn].clone();
 
-			if (patternFinderCode == MASK_FINDER_CODE) {
-				drawChessboardCorners(dispMat, cvSize(2*x, 2*y), Mat(cornerSet), patternFound);
-			} else {
-				drawChessboardCorners(dispMat, cvSize(x, y), Mat(cornerSet), patternFound);
-			}
-            
+				if (patternFinderCode == MASK_FINDER_CODE) {
+					drawChessboardCorners(dispMat, cvSize(2*x, 2*y), Mat(cornerSet), patternFound);
 
-            if (wantsToDisplay)
-            {
-                imshow("displayWindow", dispMat);
-                waitKey(40);
+					for (unsigned int bbb = 1; bbb < frameBoards.size(); bbb++) {
+						drawChessboardCorners(dispMat, cvSize(2*x, 2*y), Mat(frameBoards[bbb]), true);
+					}
+				} else {
+					drawChessboardCorners(dispMat, cvSize(x, y), Mat(cornerSet), patternFound);
+				}
+
+
+                if (wantsToDisplay)
+                {
+                    imshow("displayWindow", dispMat);
+                    waitKey(40);
+                }
+
+                if (outputFoundPatterns) {
+					if (overlayWriter == NULL) {
+						unsigned int queueLength = memory.inFlightLimit(matrixBytes(dispMat), DEFAULT_STREAM_QUEUE_LENGTH);
+						overlayWriter = new asyncImageWriter(min((int)queueLength, DEFAULT_WRITER_THREADS), queueLength, overlayParams);
+					}
+
+					overlayWriter->enqueue(replaceExtension(outputFilename, overlayFormat), dispMat);
+				}
             }
-            
-            if (outputFoundPatterns) {
-				imwrite(outputFilename, dispMat);
-			}
 
             index++;
 
+            progress.update(index);
+
             foundRecord[nnn].push_back(patternFound);
+            multiBoardRecord[nnn].push_back(frameBoards.size() > 1);
+            matchedRecord[nnn].push_back(boardMatched);
             cornersList[nnn].push_back(cornerSet);
+            qualityRecord[nnn].push_back(frameQuality);
+            memory.allocate(MEMORY_STAGE_CORNERS, cornerSet.size() * sizeof(Point2f));
+
+        }
+
+        progress.endStage();
+
+        if (extraBoards[nnn].size() > 0)
+        {
+            printf("%s << Camera (%d): %d additional boards found in multi-board frames.\n", __FUNCTION__, nnn, (int)extraBoards[nnn].size());
+        }
 
+        if (rig.valid && (nnn > 0))
+        {
+            printf("%s << Camera (%d): %d of %d frames searched within a predicted region; %d of those missed it and were searched again in full.\n", __FUNCTION__, nnn, predictedSearches, numFramesToCapture, predictedFallbacks);
         }
 
         if (!inputIsFolder)
@@ -688,6 +1166,24 @@ int main(int argc, char* argv[])
 
     }
 
+    memory.sample("detection");
+
+    detectionDiagnostics.close();
+
+    if (overlayWriter != NULL)
+    {
+        printf("%s << Flushing pattern overlays...\n", __FUNCTION__);
+
+        overlayWriter->finish();
+
+        if (overlayWriter->failures() > 0)
+        {
+            printf("%s << WARNING. %d overlay images could not be written.\n", __FUNCTION__, overlayWriter->failures());
+        }
+
+        delete overlayWriter;
+    }
+
     cv::vector<Mat> distributionMap;
 
     double radialDistribution[RADIAL_LENGTH];
@@ -710,9 +1206,12 @@ int main(int argc, char* argv[])
             Mat tmpMat = Mat(inputMat[nnn].size(), CV_8UC1);
 
             distributionMap.at(nnn) = Mat(inputMat[nnn].size(), CV_8UC1);
+            size_t mapBytes = matrixBytes(distributionMap.at(nnn));
+            memory.allocate(MEMORY_STAGE_MAPS, mapBytes);
 
             cv::vector<cv::vector<Point2f> > intrinsicsList;
             vector<string> extractedList;
+            vector<double> intrinsicsScores;
 
             for (unsigned int iii = 0; iii < cornersList[nnn].size(); iii++)
             {
@@ -720,14 +1219,28 @@ int main(int argc, char* argv[])
                 {
                     intrinsicsList.push_back(cornersList[nnn].at(iii));
                     extractedList.push_back(culledList.at(iii));
+                    intrinsicsScores.push_back(qualityRecord[nnn].at(iii));
                     tagNames[nnn].push_back(iii);
 
                     //printf("%s << tagNames[%d].at(%d) = %d\n", __FUNCTION__, nnn, iii, tagNames[nnn].at(iii));
                 }
             }
 
+            // Each extra board is a pattern in its own right as far as the intrinsics are concerned
+            for (unsigned int iii = 0; iii < extraBoards[nnn].size(); iii++)
+            {
+                intrinsicsList.push_back(extraBoards[nnn].at(iii));
+                extractedList.push_back(culledList.at(extraBoardFrames[nnn].at(iii)));
+                intrinsicsScores.push_back(extraBoardQuality[nnn].at(iii));
+                tagNames[nnn].push_back(extraBoardFrames[nnn].at(iii));
+            }
 
-            if (intrinsicsList.size() > maxPatternsToKeep)
+            if (wantsQualityRanking)
+            {
+                // Keeps the most trustworthy patterns, and puts them first so that the selectors try them first
+                qualityCulling(extractedList, maxPatternsToKeep, intrinsicsList, intrinsicsScores);
+            }
+            else if (intrinsicsList.size() > maxPatternsToKeep)
             {
                 //randomCulling(extractedList, maxPatternsToKeep, intrinsicsList);
                 randomCulling(extractedList, maxPatternsToKeep, intrinsicsList);
@@ -738,6 +1251,10 @@ int main(int argc, char* argv[])
                 candidatesList[nnn].push_back(intrinsicsList[iii]);
             }
 
+            size_t intrinsicsListBytes = pointSetBytes(intrinsicsList);
+            size_t candidateBytes = pointSetBytes(candidatesList[nnn]);
+            memory.allocate(MEMORY_STAGE_CANDIDATES, intrinsicsListBytes + candidateBytes);
+
             printf("%s << Optimizing Pattern Set...\n", __FUNCTION__);
             
             if (verboseMode) {
@@ -752,9 +1269,50 @@ int main(int argc, char* argv[])
 			}
 			
 			
+            // Every trial, and the final solve, starts from this camera's prior
+            char cameraId[32];
+            sprintf(cameraId, "camera%d", nnn);
+
+            cameraPrior prior;
+            if (priorsFile != NULL) {
+				loadCameraPrior(priorsFile, cameraId, inputMat[nnn].size(), prior);
+			} else {
+				defaultCameraPrior(inputMat[nnn].size(), prior);
+			}
+
+            int cameraFlags = intrinsicsFlags;
+
+            if (wantsModelComparison && searchOnlyForFocalLengths) {
+				printf("%s << WARNING. Distortion is fixed when searching only for focal lengths; skipping the model comparison.\n", __FUNCTION__);
+			}
+
             // Optimize which frames to use here, replacing the corners vector and other vectors with new set
             //optimizeCalibrationSet(inputMat[nnn], distributionMap.at(nnn), candidatesList[nnn], intrinsicsList, row, optimizationCode, min((int)maxPatternsPerSet, (int)intrinsicsList.size()), radialDistribution, tagNames[nnn], selectedTags[nnn]);
-			optimizeCalibrationSet(inputMat[nnn].size(), candidatesList[nnn], candidatesList[nnn], row, selectedTags[nnn], ENHANCED_MCM_OPTIMIZATION_CODE, maxPatternsPerSet, false, intrinsicsFlags);
+			if (wantsModelComparison && !searchOnlyForFocalLengths) {
+				vector<int> flagVariants;
+				distortionModelVariants(intrinsicsFlags, flagVariants);
+				
+				int selectionCode = (optimizationCode == PARTITIONED_GREEDY_OPTIMIZATION_CODE) ? PARTITIONED_GREEDY_OPTIMIZATION_CODE : ENHANCED_MCM_OPTIMIZATION_CODE;
+				
+				vector<modelComparisonResult> comparison;
+				int winner = compareDistortionModels(inputMat[nnn].size(), candidatesList[nnn], row, flagVariants, comparison, selectionCode, maxPatternsPerSet, selectionShards, &prior, plateauPatience, selectionBatch);
+				
+				if (winner >= 0) {
+					candidatesList[nnn] = comparison[winner].selection;
+					selectedTags[nnn] = comparison[winner].selectedTags;
+					cameraFlags = comparison[winner].intrinsicsFlags;
+				} else {
+					candidatesList[nnn].clear();
+				}
+			} else if (optimizationCode == PARTITIONED_GREEDY_OPTIMIZATION_CODE) {
+				if (verboseMode) {
+					comparePartitionedSelection(inputMat[nnn].size(), candidatesList[nnn], row, maxPatternsPerSet, selectionShards, intrinsicsFlags, &prior, plateauPatience, selectionBatch);
+				}
+				
+				optimizeCalibrationSet(inputMat[nnn].size(), candidatesList[nnn], candidatesList[nnn], row, selectedTags[nnn], PARTITIONED_GREEDY_OPTIMIZATION_CODE, maxPatternsPerSet, false, intrinsicsFlags, &progress, selectionShards, &prior, plateauPatience, selectionBatch);
+			} else {
+				optimizeCalibrationSet(inputMat[nnn].size(), candidatesList[nnn], candidatesList[nnn], row, selectedTags[nnn], ENHANCED_MCM_OPTIMIZATION_CODE, maxPatternsPerSet, false, intrinsicsFlags, &progress, selectionShards, &prior, plateauPatience, selectionBatch);
+			}
 
             cv::vector< cv::vector<Point3f> > objectPoints;
             cv::vector<Mat> rvecs, tvecs;
@@ -769,6 +1327,11 @@ int main(int argc, char* argv[])
 
             printf("%s << Optimization Complete.\n", __FUNCTION__);
 
+            // The pool has been replaced by the selection
+            memory.release(MEMORY_STAGE_CANDIDATES, candidateBytes);
+            candidateBytes = pointSetBytes(candidatesList[nnn]);
+            memory.allocate(MEMORY_STAGE_CANDIDATES, candidateBytes);
+
             if (candidatesList[nnn].size() == 0)
             {
                 printf("%s << No patterns remaining - cannot calibrate. Returning.\n", __FUNCTION__);
@@ -781,16 +1344,10 @@ int main(int argc, char* argv[])
 
             double reprojError, extendedReprojError;
             
-            if (intrinsicsFlags == SEARCH_ONLY_FOR_BASIC_PARAMETERS) {
-				cameraMatrix[nnn] = Mat::eye(3,3,CV_64FC1);
-				cameraMatrix[nnn].at<double>(0,0) = 525.0;
-				cameraMatrix[nnn].at<double>(1,1) = 525.0;
-				cameraMatrix[nnn].at<double>(0,2) = 319.5;
-				cameraMatrix[nnn].at<double>(1,2) = 239.5;
-			}
-						
+            int finalFlags = cameraFlags;
+            seedFromPrior(prior, cameraMatrix[nnn], distCoeffs[nnn], finalFlags);
 
-            reprojError = calibrateCamera(objectPoints, candidatesList[nnn], inputMat[nnn].size(), cameraMatrix[nnn], distCoeffs[nnn], rvecs, tvecs, intrinsicsFlags);
+            reprojError = calibrateCamera(objectPoints, candidatesList[nnn], inputMat[nnn].size(), cameraMatrix[nnn], distCoeffs[nnn], rvecs, tvecs, finalFlags);
 
             printf("%s << Calibration DONE.\n", __FUNCTION__);
 
@@ -833,80 +1390,96 @@ int main(int argc, char* argv[])
 
             fs.release();
 
+            if (priorsFile != NULL) {
+				saveCameraPrior(priorsFile, cameraId, inputMat[nnn].size(), cameraMatrix[nnn], distCoeffs[nnn]);
+			}
+
             printf("%s << Writing to file...DONE.\n", __FUNCTION__);
 
             if (wantsToUndistort)
             {
 
+                // Build (or reload) the fixed-point maps once rather than recomputing them for every frame
+                char mapsFilename[256];
+                sprintf(mapsFilename, "%s/undistortion-%d.maps", directory, nnn);
 
-                // Create directories
+                Mat undistortMap1, undistortMap2;
+                obtainRectificationMaps(mapsFilename, cameraMatrix[nnn], distCoeffs[nnn], Mat(), newCamMat[nnn], imageSize_size[nnn], undistortMap1, undistortMap2);
 
-                char newDirectoryPath[256];
+                char inputFilename[256], outputFilename[256];
 
-                sprintf(newDirectoryPath, "%s/%d-u", directory, nnn);
+                if (!inputIsFolder)
+                {
+                    // Stream the whole capture rather than just the frames that were sampled for calibration
+                    sprintf(outputFilename, "%s/%d-u.avi", directory, nnn);
 
-#if defined(WIN32)
-                //boost::filesystem::create_directory(newDirectoryPath);
+                    printf("%s << Undistorting Video... (%s)\n", __FUNCTION__, inStream[nnn]);
 
-                CreateDirectory(newDirectoryPath, NULL);
-#else
-                mkdir(newDirectoryPath, DEFAULT_MKDIR_PERMISSIONS);
-#endif
+                    // Two queues of frames are in flight (decoded and rectified)
+                    unsigned int queueLength = memory.inFlightLimit(2 * imageSize_size[nnn].area() * 3, DEFAULT_STREAM_QUEUE_LENGTH);
+
+                    rectifyVideoStream(inStream[nnn], outputFilename, undistortMap1, undistortMap2, Rect(), 1.0, wantsToDisplay, queueLength);
+                }
+                else
+                {
 
+                    // Create directories
 
-                printf("%s << Undistorting Images... (%d)\n", __FUNCTION__, (int)inputList[nnn].size());
-                Mat undistortedMat(inputMat[nnn].size(), CV_8UC3);
+                    char newDirectoryPath[256];
 
-                //videoReader.set(CV_CAP_PROP_POS_AVI_RATIO, 0.00);
+                    sprintf(newDirectoryPath, "%s/%d-u", directory, nnn);
 
-                char inputFilename[256], outputFilename[256];
+#if defined(WIN32)
+                    //boost::filesystem::create_directory(newDirectoryPath);
 
+                    CreateDirectory(newDirectoryPath, NULL);
+#else
+                    mkdir(newDirectoryPath, DEFAULT_MKDIR_PERMISSIONS);
+#endif
 
-                for (int i = 0; i < inputList[nnn].size(); i++)
-                {
-					
-					
 
-                    if (inputIsFolder)
+                    printf("%s << Undistorting Images... (%d)\n", __FUNCTION__, (int)inputList[nnn].size());
+                    Mat undistortedMat(inputMat[nnn].size(), CV_8UC3);
+
+                    for (int i = 0; i < inputList[nnn].size(); i++)
                     {
                         //sprintf(inputFilename, "%s%d.%s", input, i+1, "jpg");
                         sprintf(inputFilename, "%s%s", inStream[nnn], (inputList[nnn].at(i)).c_str());
                         inputMat[nnn] = imread(inputFilename);
 
-                    }
-                    else
-                    {
-                        //videoReader >> inputMat;
-                    }
-                    
-                    //printf("%s << Undistorting (%s)...\n", __FUNCTION__, inputFilename);
+                        //printf("%s << Undistorting (%s)...\n", __FUNCTION__, inputFilename);
 
-                    undistort(inputMat[nnn], undistortedMat, cameraMatrix[nnn], distCoeffs[nnn], newCamMat[nnn]);
+                        remap(inputMat[nnn], undistortedMat, undistortMap1, undistortMap2, INTER_LINEAR);
 
-                    imshow("undistortedWin", undistortedMat);
-                    waitKey(40);
+                        imshow("undistortedWin", undistortedMat);
+                        waitKey(40);
 
-                    if (inputIsFolder)
-                    {
                         //sprintf(outputFilename, "%s/%d.jpg", newDirectoryPath, i);
                         sprintf(outputFilename, "%s/%s", newDirectoryPath, (inputList[nnn].at(i)).c_str());
-                    }
-                    else
-                    {
-                        //sprintf(outputFilename, "%s%s%s", inputFolderString, "undistorted/", (inputList.at(i)).c_str());
-                    }
 
-                    //printf("%s << writing to file: %s\n", __FUNCTION__, outputFilename);
+                        //printf("%s << writing to file: %s\n", __FUNCTION__, outputFilename);
 
-                    imwrite(outputFilename, undistortedMat);
+                        imwrite(outputFilename, undistortedMat);
 
+                    }
                 }
             }
+
+            // Only the selection outlives this camera
+            memory.release(MEMORY_STAGE_CANDIDATES, intrinsicsListBytes);
+
+            distributionMap.at(nnn).release();
+            memory.release(MEMORY_STAGE_MAPS, mapBytes);
         }
 
 
     }
 
+    if (wantsIntrinsics)
+    {
+        memory.sample("intrinsics");
+    }
+
     if (wantsExtrinsics)
     {
 
@@ -921,6 +1494,9 @@ int main(int argc, char* argv[])
         cv::vector<cv::vector<cv::vector<Point2f> > > extrinsicsList, extrinsicsCandidates;
         vector<string> extractedList;
 
+        size_t extrinsicsMapBytes = 0;
+        vector<size_t> extrinsicsListBytes(numCams, 0), extrinsicsCandidateBytes(numCams, 0);
+
         for (unsigned int nnn = 0; nnn < numCams; nnn++)
         {
             extrinsicsList.push_back(emptyPointSetVector);
@@ -928,12 +1504,38 @@ int main(int argc, char* argv[])
             extrinsicTagNames.push_back(emptyIntVector);
 
             extrinsicsDistributionMap.at(nnn) = Mat(inputMat[nnn].size(), CV_8UC1);
+            extrinsicsMapBytes += matrixBytes(extrinsicsDistributionMap.at(nnn));
+            memory.allocate(MEMORY_STAGE_MAPS, matrixBytes(extrinsicsDistributionMap.at(nnn)));
         }
 
+        int ambiguousFrames = 0;
+
+        // With -Y, frames are offered best first, ranked by the weakest of their views
+        vector<pair<double, int> > frameOrder;
+
         for (unsigned int iii = 0; iii < cornersList[0].size(); iii++)
         {
+            double weakestView = qualityRecord[0].at(iii);
+
+            for (unsigned int nnn = 1; nnn < numCams; nnn++)
+            {
+                weakestView = min(weakestView, qualityRecord[nnn].at(iii));
+            }
+
+            frameOrder.push_back(pair<double, int>(wantsQualityRanking ? -weakestView : 0.0, iii));
+        }
+
+        if (wantsQualityRanking)
+        {
+            sort(frameOrder.begin(), frameOrder.end());
+        }
+
+        for (unsigned int ooo = 0; ooo < frameOrder.size(); ooo++)
+        {
+            unsigned int iii = frameOrder[ooo].second;
 
             bool allPatternsFound = true;
+            bool ambiguous = false;
 
             for (unsigned int nnn = 0; nnn < numCams; nnn++)
             {
@@ -941,6 +1543,18 @@ int main(int argc, char* argv[])
                 {
                     allPatternsFound = false;
                 }
+
+                // With several boards in view, size order says nothing about which board each camera kept
+                if ((nnn > 0) && !matchedRecord[nnn][iii] && (multiBoardRecord[nnn][iii] || multiBoardRecord[0][iii]))
+                {
+                    ambiguous = true;
+                }
+            }
+
+            if (allPatternsFound && ambiguous)
+            {
+                allPatternsFound = false;
+                ambiguousFrames++;
             }
 
             if (allPatternsFound)
@@ -961,6 +1575,17 @@ int main(int argc, char* argv[])
 
         }
 
+        if (ambiguousFrames > 0)
+        {
+            printf("%s << %d frames with several boards in view left out of the extrinsics (boards could not be matched across cameras).\n", __FUNCTION__, ambiguousFrames);
+        }
+
+        for (unsigned int nnn = 0; nnn < numCams; nnn++)
+        {
+            extrinsicsListBytes[nnn] = pointSetBytes(extrinsicsList.at(nnn));
+            extrinsicsCandidateBytes[nnn] = pointSetBytes(extrinsicsCandidates.at(nnn));
+            memory.allocate(MEMORY_STAGE_CANDIDATES, extrinsicsListBytes[nnn] + extrinsicsCandidateBytes[nnn]);
+        }
 
         vector<Size> extrinsicsSizes;
 
@@ -969,7 +1594,18 @@ int main(int argc, char* argv[])
             extrinsicsSizes.push_back(imageSize_size[nnn]);
         }
 
-        optimizeCalibrationSets(extrinsicsSizes, numCams, cameraMatrix, distCoeffs, extrinsicsDistributionMap, extrinsicsCandidates, extrinsicsList, row, optimizationCode, maxPatternsPerSet, extrinsicTagNames, extrinsicSelectedTags);
+        // Partitioned selection is only implemented for intrinsics, so extrinsics fall back to the plain greedy search
+        int extrinsicsSelection = (optimizationCode == PARTITIONED_GREEDY_OPTIMIZATION_CODE) ? ENHANCED_MCM_OPTIMIZATION_CODE : optimizationCode;
+
+        optimizeCalibrationSets(extrinsicsSizes, numCams, cameraMatrix, distCoeffs, extrinsicsDistributionMap, extrinsicsCandidates, extrinsicsList, row, extrinsicsSelection, maxPatternsPerSet, extrinsicTagNames, extrinsicSelectedTags, &progress, plateauPatience, selectionBatch);
+
+        // Each camera's pool has been replaced by its selection
+        for (unsigned int nnn = 0; nnn < numCams; nnn++)
+        {
+            memory.release(MEMORY_STAGE_CANDIDATES, extrinsicsCandidateBytes[nnn]);
+            extrinsicsCandidateBytes[nnn] = pointSetBytes(extrinsicsCandidates.at(nnn));
+            memory.allocate(MEMORY_STAGE_CANDIDATES, extrinsicsCandidateBytes[nnn]);
+        }
 
         // UNCHECKED
 
@@ -1133,7 +1769,7 @@ int main(int argc, char* argv[])
 
             printf("%s << Undistorting\n", __FUNCTION__);
 
-            Mat mapx[MAX_CAMS], mapy[MAX_CAMS];
+            Mat map1[MAX_CAMS], map2[MAX_CAMS];
 
             int topValidHeight = 0, botValidHeight = 65535, leftValid[MAX_CAMS], rightValid[MAX_CAMS];
 
@@ -1142,14 +1778,17 @@ int main(int argc, char* argv[])
             for (int i = 0; i < numCams; i++)
             {
 
-                initUndistortRectifyMap(cameraMatrix[i],
+                char mapsFilename[256];
+                sprintf(mapsFilename, "%s/rectification-%d-%d.maps", directory, numCams, i);
+
+                obtainRectificationMaps(mapsFilename,
+                                        cameraMatrix[i],
                                         distCoeffs[i],
                                         R_[i],
                                         P_[i],  // newCamMat[i]
                                         imageSize_size[i],
-                                        CV_32F,     // CV_16SC2
-                                        mapx[i],    // map1[i]
-                                        mapy[i]);   // map2[i]
+                                        map1[i],
+                                        map2[i]);
 
                 pt1 = Point(validROI[i].x, validROI[i].y);
                 pt2 = Point(validROI[i].x + validROI[i].width, validROI[i].y + validROI[i].height);
@@ -1200,6 +1839,20 @@ int main(int argc, char* argv[])
             for (int i = 0; i < numCams; i++)
             {
 
+                if (!inputIsFolder)
+                {
+                    Point x_1 = Point(leftValid[i], topValidHeight);
+                    Point x_2 = Point(rightValid[i], botValidHeight);
+
+                    sprintf(filename, "%s/%d-r.avi", directory, i);
+
+                    unsigned int queueLength = memory.inFlightLimit(2 * imageSize_size[i].area() * 3, DEFAULT_STREAM_QUEUE_LENGTH);
+
+                    rectifyVideoStream(inStream[i], filename, map1[i], map2[i], Rect(x_1, x_2), 2.0, wantsToDisplay, queueLength);
+
+                    continue;
+                }
+
                 for (int index = 0; index < inputList[i].size(); index++)
                 {
 
@@ -1223,7 +1876,7 @@ int main(int argc, char* argv[])
 
                     Mat undistortedMat;
 
-                    remap(inputMat[i], undistortedMat, mapx[i], mapy[i], INTER_LINEAR);
+                    remap(inputMat[i], undistortedMat, map1[i], map2[i], INTER_LINEAR);
 
 
                     Point x_1 = Point(leftValid[i], topValidHeight);
@@ -1275,8 +1928,22 @@ int main(int argc, char* argv[])
 
         }
 
+        memory.sample("extrinsics");
+
+        // The extrinsics pools and maps go out of scope here
+        for (unsigned int nnn = 0; nnn < numCams; nnn++)
+        {
+            memory.release(MEMORY_STAGE_CANDIDATES, extrinsicsListBytes[nnn] + extrinsicsCandidateBytes[nnn]);
+        }
+
+        memory.release(MEMORY_STAGE_MAPS, extrinsicsMapBytes);
+
     }
 
+    memory.report();
+
+    reportPerfCounters();
+
     return 0;
 
 }
@@ -13,6 +13,11 @@
 #include "calibration.hpp"
 #include "intrinsics.hpp"
 #include "extrinsics.hpp"
+#include "rectification.hpp"
+#include "streaming.hpp"
+#include "benchmark.hpp"
+#include "tuning.hpp"
+#include "roi.hpp"
 
 //#include "cv_utils.hpp"
 #include "improc.h"
@@ -73,13 +78,37 @@ static void usage(const char *argv0)
 			[2] First N patterns\n\
 			[3] Enhanced MCM\n\
 			[4] Best of random trials\n\
-			[5] Exhaustive search\n");
+			[5] Exhaustive search\n\
+			[8] Partitioned greedy (intrinsics only; extrinsics use [3])\n");
+    printf("	-G	Number of shards for partitioned greedy selection (default %d).\n", DEFAULT_SELECTION_SHARDS);
+    printf("	-k	Frames added per greedy selection round, kept apart in pose and coverage and confirmed by one extra calibration (default %d).\n", DEFAULT_SELECTION_BATCH);
+    printf("	-E	Stop greedy selection after this many rounds without a real ERE gain (default %d). Later rounds could still have found a\n\
+		lower ERE, so stopping early can select different frames; 0 runs every round, as before, and reproduces older results.\n", DEFAULT_PLATEAU_PATIENCE);
+    printf("	-U	Compare the plumb-bob and rational distortion models on the same detections, and keep the one with the lower cross-validated error.\n");
+    printf("	-I	Camera priors store: each camera starts from its previous calibration at this image size, and the result is written back.\n");
     printf("	-q	Input (and output) is video.\n");
     printf("	-u	Undistort images.\n");
     printf("	-z	Write original images with pattern overlayed.\n");
+    printf("	-D	Write per-frame detection diagnostics to this file (CSV, or binary if it ends in .bin).\n");
+    printf("	-H	Sample hardware performance counters (cycles, instructions, cache and branch misses) around the main stages.\n");
+    printf("	-M	Memory budget in MB; the overlay writer and video streaming queues shrink to stay under it.\n");
+    printf("	-P	Seconds between progress reports (0 disables them).\n");
+    printf("	-S	Write progress reports to this status file instead of stderr.\n");
+    printf("	-F	Image format for overlays written with -z (e.g. jpg, png; default keeps the input format).\n");
+    printf("	-Q	Encoder quality (0-100) for overlays written with -z (used with -F).\n");
+    printf("	-B	Benchmark sustained throughput on a synthetic board video with 1 to this many detection threads, then exit.\n");
+    printf("	-j	Frame rate offered during the benchmark (default %.0f fps).\n", DEFAULT_BENCHMARK_FPS);
     printf("	-w	Write undistorted images.\n");
     printf("	-v	Display more debug info.\n");
     printf("	-p	File containing MSER parameters.\n");
+    printf("	-Y	Score each detection (lattice regularity, sharpness, sub-pixel stability) and keep and try the best patterns first.\n");
+    printf("	-N	Mask pattern only: find up to this many boards per frame; boards beyond the first are used for intrinsics.\n");
+    printf("	-X	Extrinsics file from a previous run; cameras 1..N search only where camera 0's board is predicted to appear.\n");
+    printf("	-R	Thermal input: search only a padded box around the warmest large region of each frame.\n");
+    printf("	-T	Pre-screen each frame on a thumbnail this many pixels wide (e.g. 160) before the full MSER search.\n");
+    printf("	-L	Only search for the pattern where <dir>/N-mask.png is non-zero (one mask per camera).\n");
+    printf("	-l	Learn a mask of static clutter for each camera from the temporal median of this many sampled frames.\n");
+    printf("	-A	Auto-tune MSER parameters for each camera on a sample of this many frames (written to <dir>/mser-N.txt).\n");
     printf("	-c	Fraction of separation between squares to form corner search radius.\n");
     printf("If parameters are missing, defaults are used. However, if no parameters are provided, the user will be prompted.\n\n");
 }
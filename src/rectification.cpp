@@ -0,0 +1,189 @@
+#include "rectification.hpp"
+
+// 64-bit FNV-1a, chosen because it is trivially portable and the maps only need a change detector
+#define FNV_OFFSET_BASIS    14695981039346656037ULL
+#define FNV_PRIME           1099511628211ULL
+
+static uint64 hashBytes(uint64 hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char*) data;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (uint64) bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static uint64 hashMatrix(uint64 hash, const Mat& mat)
+{
+    Mat mat64;
+
+    // convertTo() always produces a continuous matrix, so the elements can be walked as one array
+    if (!mat.empty())
+    {
+        mat.convertTo(mat64, CV_64F);
+    }
+
+    int count = (int) mat64.total();
+
+    hash = hashBytes(hash, &count, sizeof(int));
+
+    if (count > 0)
+    {
+        hash = hashBytes(hash, mat64.ptr<double>(0), count * sizeof(double));
+    }
+
+    return hash;
+}
+
+uint64 hashCalibration(const Mat& cameraMatrix, const Mat& distCoeffs, const Mat& R, const Mat& P, Size imSize)
+{
+    uint64 hash = FNV_OFFSET_BASIS;
+
+    int dimensions[2] = { imSize.width, imSize.height };
+    hash = hashBytes(hash, dimensions, sizeof(dimensions));
+
+    hash = hashMatrix(hash, cameraMatrix);
+    hash = hashMatrix(hash, distCoeffs);
+    hash = hashMatrix(hash, R);
+    hash = hashMatrix(hash, P);
+
+    return hash;
+}
+
+static bool writeMapRows(FILE *file, const Mat& map)
+{
+    size_t rowBytes = map.cols * map.elemSize();
+
+    for (int i = 0; i < map.rows; i++)
+    {
+        if (fwrite(map.ptr(i), 1, rowBytes, file) != rowBytes)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool readMapRows(FILE *file, Mat& map)
+{
+    size_t rowBytes = map.cols * map.elemSize();
+
+    for (int i = 0; i < map.rows; i++)
+    {
+        if (fread(map.ptr(i), 1, rowBytes, file) != rowBytes)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool saveRectificationMaps(const char *filename, uint64 calibrationHash, const Mat& map1, const Mat& map2)
+{
+    if ((map1.type() != CV_16SC2) || (map2.type() != CV_16UC1) || (map1.size() != map2.size()))
+    {
+        printf("%s << ERROR. Only matching CV_16SC2 + CV_16UC1 maps can be saved.\n", __FUNCTION__);
+        return false;
+    }
+
+    FILE *file = fopen(filename, "wb");
+
+    if (file == NULL)
+    {
+        printf("%s << ERROR. Could not open (%s) for writing.\n", __FUNCTION__, filename);
+        return false;
+    }
+
+    unsigned int version = RECTIFICATION_MAP_FILE_VERSION;
+    int header[4] = { map1.cols, map1.rows, map1.type(), map2.type() };
+
+    bool success = (fwrite(RECTIFICATION_MAP_MAGIC, 1, 4, file) == 4);
+    success = success && (fwrite(&version, sizeof(unsigned int), 1, file) == 1);
+    success = success && (fwrite(&calibrationHash, sizeof(uint64), 1, file) == 1);
+    success = success && (fwrite(header, sizeof(int), 4, file) == 4);
+    success = success && writeMapRows(file, map1);
+    success = success && writeMapRows(file, map2);
+
+    fclose(file);
+
+    if (!success)
+    {
+        printf("%s << ERROR. Failed while writing (%s).\n", __FUNCTION__, filename);
+        remove(filename);
+    }
+
+    return success;
+}
+
+bool loadRectificationMaps(const char *filename, uint64 calibrationHash, Size imSize, Mat& map1, Mat& map2)
+{
+    FILE *file = fopen(filename, "rb");
+
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    char magic[4];
+    unsigned int version = 0;
+    uint64 storedHash = 0;
+    int header[4];
+
+    bool valid = (fread(magic, 1, 4, file) == 4) && (memcmp(magic, RECTIFICATION_MAP_MAGIC, 4) == 0);
+    valid = valid && (fread(&version, sizeof(unsigned int), 1, file) == 1) && (version == RECTIFICATION_MAP_FILE_VERSION);
+    valid = valid && (fread(&storedHash, sizeof(uint64), 1, file) == 1) && (storedHash == calibrationHash);
+    valid = valid && (fread(header, sizeof(int), 4, file) == 4);
+    valid = valid && (header[0] == imSize.width) && (header[1] == imSize.height);
+    valid = valid && (header[2] == CV_16SC2) && (header[3] == CV_16UC1);
+
+    if (valid)
+    {
+        map1.create(imSize, CV_16SC2);
+        map2.create(imSize, CV_16UC1);
+
+        valid = readMapRows(file, map1) && readMapRows(file, map2);
+    }
+
+    fclose(file);
+
+    if (!valid)
+    {
+        map1.release();
+        map2.release();
+    }
+
+    return valid;
+}
+
+bool obtainRectificationMaps(const char *filename,
+                             const Mat& cameraMatrix,
+                             const Mat& distCoeffs,
+                             const Mat& R,
+                             const Mat& P,
+                             Size imSize,
+                             Mat& map1,
+                             Mat& map2)
+{
+    uint64 calibrationHash = hashCalibration(cameraMatrix, distCoeffs, R, P, imSize);
+
+    if (loadRectificationMaps(filename, calibrationHash, imSize, map1, map2))
+    {
+        printf("%s << Reusing cached maps from (%s).\n", __FUNCTION__, filename);
+        return true;
+    }
+
+    initUndistortRectifyMap(cameraMatrix, distCoeffs, R, P, imSize, CV_16SC2, map1, map2);
+
+    if (saveRectificationMaps(filename, calibrationHash, map1, map2))
+    {
+        printf("%s << Maps written to (%s).\n", __FUNCTION__, filename);
+    }
+
+    return false;
+}
@@ -0,0 +1,44 @@
+/*! \file	rectification.hpp
+ *  \brief	Header file for building, caching and exporting rectification maps.
+ *
+ * Maps are stored in the compact fixed-point form (CV_16SC2 + CV_16UC1) that remap() consumes directly,
+ * so that later runs and downstream real-time consumers do not need to regenerate them from the YAML files.
+ */
+
+#ifndef RECTIFICATION_HPP
+#define RECTIFICATION_HPP
+
+#include "improc.h"
+
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+using namespace cv;
+
+#define RECTIFICATION_MAP_MAGIC             "MMRM"
+#define RECTIFICATION_MAP_FILE_VERSION      1
+
+/// \brief      Hashes a calibration (and the output view it is rectified to) so that cached maps can be keyed by it
+uint64 hashCalibration(const Mat& cameraMatrix, const Mat& distCoeffs, const Mat& R, const Mat& P, Size imSize);
+
+/// \brief      Writes a pair of fixed-point rectification maps to a versioned binary file
+bool saveRectificationMaps(const char *filename, uint64 calibrationHash, const Mat& map1, const Mat& map2);
+
+/// \brief      Reads a pair of fixed-point rectification maps, rejecting files of another version or calibration
+bool loadRectificationMaps(const char *filename, uint64 calibrationHash, Size imSize, Mat& map1, Mat& map2);
+
+/// \brief      Reuses cached maps if they match the calibration, otherwise builds them and refreshes the cache
+/// \return     true if the maps were loaded from the cache
+bool obtainRectificationMaps(const char *filename,
+                             const Mat& cameraMatrix,
+                             const Mat& distCoeffs,
+                             const Mat& R,
+                             const Mat& P,
+                             Size imSize,
+                             Mat& map1,
+                             Mat& map2);
+
+#endif
@@ -0,0 +1,386 @@
+#include "roi.hpp"
+
+bool loadROIMask(const char *filename, Size imageSize, Mat& mask)
+{
+    Mat maskImage = imread(filename, 0);
+
+    if (maskImage.empty())
+    {
+        printf("%s << ERROR. Could not read mask (%s).\n", __FUNCTION__, filename);
+        return false;
+    }
+
+    if (maskImage.size() != imageSize)
+    {
+        printf("%s << WARNING. Mask (%s) is %d x %d; resizing to %d x %d.\n", __FUNCTION__, filename, maskImage.cols, maskImage.rows, imageSize.width, imageSize.height);
+        resize(maskImage, maskImage, imageSize, 0, 0, INTER_NEAREST);
+    }
+
+    mask = (maskImage > 0);
+
+    return true;
+}
+
+void temporalMedian(const vector<Mat>& frames, Mat& median)
+{
+    vector<Mat> greyFrames(frames.size());
+
+    for (unsigned int iii = 0; iii < frames.size(); iii++)
+    {
+        if (frames.at(iii).channels() > 1)
+        {
+            cvtColor(frames.at(iii), greyFrames.at(iii), CV_RGB2GRAY);
+        }
+        else
+        {
+            greyFrames.at(iii) = frames.at(iii);
+        }
+    }
+
+    median = Mat(greyFrames.at(0).size(), CV_8UC1);
+
+    vector<unsigned char> values(greyFrames.size());
+
+    for (int row = 0; row < median.rows; row++)
+    {
+        unsigned char *medianRow = median.ptr<unsigned char>(row);
+
+        for (int col = 0; col < median.cols; col++)
+        {
+            for (unsigned int iii = 0; iii < greyFrames.size(); iii++)
+            {
+                values[iii] = greyFrames[iii].ptr<unsigned char>(row)[col];
+            }
+
+            nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+            medianRow[col] = values[values.size() / 2];
+        }
+    }
+}
+
+void learnBackgroundMask(const vector<Mat>& frames, Mat& mask, int threshold, int edgeThreshold, int margin)
+{
+    mask = Mat();
+
+    if (frames.size() < 3)
+    {
+        printf("%s << WARNING. Too few frames (%d) to learn a background from.\n", __FUNCTION__, (int)frames.size());
+        return;
+    }
+
+    Mat median;
+    temporalMedian(frames, median);
+
+    // A pixel is static if no sampled frame strays from the median by more than the threshold
+    Mat staticPixels(median.size(), CV_8UC1, Scalar(255));
+    Mat greyFrame, difference, moving;
+
+    for (unsigned int iii = 0; iii < frames.size(); iii++)
+    {
+        if (frames.at(iii).channels() > 1)
+        {
+            cvtColor(frames.at(iii), greyFrame, CV_RGB2GRAY);
+        }
+        else
+        {
+            greyFrame = frames.at(iii);
+        }
+
+        absdiff(greyFrame, median, difference);
+        moving = (difference > threshold);
+        staticPixels.setTo(Scalar(0), moving);
+    }
+
+    // Flat static background produces no MSERs anyway, so only textured static regions are worth excluding
+    Mat gradientX, gradientY, magnitude;
+    Sobel(median, gradientX, CV_32F, 1, 0);
+    Sobel(median, gradientY, CV_32F, 0, 1);
+    cv::magnitude(gradientX, gradientY, magnitude);
+
+    Mat clutter = (magnitude > edgeThreshold) & staticPixels;
+
+    if (margin > 0)
+    {
+        dilate(clutter, clutter, getStructuringElement(MORPH_ELLIPSE, Size(2 * margin + 1, 2 * margin + 1)));
+    }
+
+    mask = (clutter == 0);
+
+    printf("%s << Learned background from %d frames; %.1f%% of the frame remains searchable.\n", __FUNCTION__, (int)frames.size(), 100.0 * maskCoverage(mask));
+}
+
+void combineROIMasks(Mat& mask, const Mat& other)
+{
+    if (other.empty())
+    {
+        return;
+    }
+
+    if (mask.empty())
+    {
+        other.copyTo(mask);
+        return;
+    }
+
+    bitwise_and(mask, other, mask);
+}
+
+double maskCoverage(const Mat& mask)
+{
+    if (mask.empty())
+    {
+        return 1.0;
+    }
+
+    return double(countNonZero(mask)) / double(mask.total());
+}
+
+bool localizeWarmRegion(const Mat& image, Rect& region, double padding)
+{
+    region = Rect(0, 0, image.cols, image.rows);
+
+    if (image.empty())
+    {
+        return false;
+    }
+
+    Mat greyIm;
+    if (image.channels() > 1)
+    {
+        cvtColor(image, greyIm, CV_RGB2GRAY);
+    }
+    else
+    {
+        greyIm = image;
+    }
+
+    // Localization needs only a coarse box, so larger frames are shrunk first
+    double scale = min(1.0, double(THERMAL_WORKING_WIDTH) / greyIm.cols);
+    Mat workingIm;
+
+    if (scale < 1.0)
+    {
+        resize(greyIm, workingIm, Size(), scale, scale, INTER_AREA);
+    }
+    else
+    {
+        workingIm = greyIm;
+    }
+
+    double percentileVals[2] = { 0.500, THERMAL_WARM_PERCENTILE };
+    double intensityVals[2];
+    findPercentiles(workingIm, intensityVals, percentileVals, 2);
+
+    if (intensityVals[1] <= intensityVals[0])
+    {
+        return false;
+    }
+
+    // Anything closer to "hot" than to the typical scene counts as warm
+    Mat warm = (workingIm > (intensityVals[0] + intensityVals[1]) / 2.0);
+
+    // Close the gaps between heated squares so that the board forms a single component
+    int closeSize = max(3, workingIm.cols / 40) | 1;
+    morphologyEx(warm, warm, MORPH_CLOSE, getStructuringElement(MORPH_RECT, Size(closeSize, closeSize)));
+
+    vector<vector<Point> > contours;
+    findContours(warm, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
+
+    int largest = -1;
+    double largestArea = 0.0;
+
+    for (unsigned int iii = 0; iii < contours.size(); iii++)
+    {
+        double area = contourArea(Mat(contours[iii]));
+
+        if (area > largestArea)
+        {
+            largestArea = area;
+            largest = iii;
+        }
+    }
+
+    if ((largest < 0) || (largestArea < THERMAL_MIN_REGION_FRACTION * workingIm.total()))
+    {
+        return false;
+    }
+
+    Rect box = boundingRect(Mat(contours[largest]));
+
+    int padX = int(box.width * padding), padY = int(box.height * padding);
+
+    Rect padded(int((box.x - padX) / scale), int((box.y - padY) / scale), int((box.width + 2 * padX) / scale), int((box.height + 2 * padY) / scale));
+
+    region = padded & Rect(0, 0, image.cols, image.rows);
+
+    return (region.area() > 0);
+}
+
+void offsetPoints(vector<Point2f>& points, Point offset)
+{
+    for (unsigned int iii = 0; iii < points.size(); iii++)
+    {
+        points[iii].x += offset.x;
+        points[iii].y += offset.y;
+    }
+}
+
+Point2f pointSetCentroid(const vector<Point2f>& points)
+{
+    Point2f centroid(0.0f, 0.0f);
+
+    if (points.size() == 0)
+    {
+        return centroid;
+    }
+
+    for (unsigned int iii = 0; iii < points.size(); iii++)
+    {
+        centroid += points[iii];
+    }
+
+    return centroid * (1.0f / points.size());
+}
+
+rigEstimate::rigEstimate() :
+    numCams(0),
+    valid(false)
+{
+}
+
+bool loadRigEstimate(const char *filename, int numCams, rigEstimate& rig)
+{
+    rig = rigEstimate();
+
+    FileStorage fs(filename, FileStorage::READ);
+
+    if (!fs.isOpened())
+    {
+        printf("%s << ERROR. Could not open rig estimate (%s).\n", __FUNCTION__, filename);
+        return false;
+    }
+
+    char tmp[64];
+
+    for (int i = 0; i < numCams; i++)
+    {
+        sprintf(tmp, "cameraMatrix%d", i);
+        fs[tmp] >> rig.cameraMatrix[i];
+
+        sprintf(tmp, "distCoeffs%d", i);
+        fs[tmp] >> rig.distCoeffs[i];
+
+        sprintf(tmp, "R%d", i);
+        fs[tmp] >> rig.R[i];
+
+        sprintf(tmp, "T%d", i);
+        fs[tmp] >> rig.T[i];
+
+        if (rig.cameraMatrix[i].empty() || rig.R[i].empty() || rig.T[i].empty())
+        {
+            printf("%s << ERROR. Rig estimate (%s) has no entry for camera (%d).\n", __FUNCTION__, filename, i);
+            fs.release();
+            return false;
+        }
+    }
+
+    fs.release();
+
+    rig.numCams = numCams;
+    rig.valid = true;
+
+    return true;
+}
+
+bool predictPatternRegion(const rigEstimate& rig,
+                          int camera,
+                          const vector<Point3f>& objectPoints,
+                          const vector<Point2f>& referenceCorners,
+                          Size imageSize,
+                          vector<Point2f>& predictedCorners,
+                          Rect& region,
+                          double padding)
+{
+    region = Rect(0, 0, imageSize.width, imageSize.height);
+    predictedCorners.clear();
+
+    if (!rig.valid || (camera <= 0) || (camera >= rig.numCams) || (referenceCorners.size() != objectPoints.size()))
+    {
+        return false;
+    }
+
+    // Board pose in camera 0...
+    Mat rvec, tvec;
+    solvePnP(Mat(objectPoints), Mat(referenceCorners), rig.cameraMatrix[0], rig.distCoeffs[0], rvec, tvec, false);
+
+    Mat boardRotation;
+    Rodrigues(rvec, boardRotation);
+
+    // ... carried into the other camera by the rig estimate
+    Mat cameraRotation = rig.R[camera] * boardRotation;
+    Mat cameraTranslation = rig.R[camera] * tvec + rig.T[camera];
+
+    if (cameraTranslation.at<double>(2, 0) <= 0.0)
+    {
+        return false;
+    }
+
+    Mat cameraRvec;
+    Rodrigues(cameraRotation, cameraRvec);
+
+    projectPoints(Mat(objectPoints), cameraRvec, cameraTranslation, rig.cameraMatrix[camera], rig.distCoeffs[camera], predictedCorners);
+
+    Rect frame(0, 0, imageSize.width, imageSize.height);
+    int visible = 0;
+
+    for (unsigned int iii = 0; iii < predictedCorners.size(); iii++)
+    {
+        if (frame.contains(Point(int(predictedCorners[iii].x), int(predictedCorners[iii].y))))
+        {
+            visible++;
+        }
+    }
+
+    // A board that is only partly in view cannot be detected anyway, and a bad prediction is best not trusted
+    if (visible < PREDICTION_MIN_VISIBLE_FRACTION * predictedCorners.size())
+    {
+        predictedCorners.clear();
+        return false;
+    }
+
+    Rect box = boundingRect(Mat(predictedCorners));
+
+    int padX = int(box.width * padding), padY = int(box.height * padding);
+
+    region = Rect(box.x - padX, box.y - padY, box.width + 2 * padX, box.height + 2 * padY) & frame;
+
+    if (region.area() == 0)
+    {
+        region = frame;
+        predictedCorners.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void alignToPrediction(vector<Point2f>& corners, const vector<Point2f>& predictedCorners)
+{
+    if ((corners.size() != predictedCorners.size()) || (corners.size() == 0))
+    {
+        return;
+    }
+
+    double forwardError = 0.0, reverseError = 0.0;
+
+    for (unsigned int iii = 0; iii < corners.size(); iii++)
+    {
+        forwardError += norm(corners[iii] - predictedCorners[iii]);
+        reverseError += norm(corners[corners.size() - 1 - iii] - predictedCorners[iii]);
+    }
+
+    if (reverseError < forwardError)
+    {
+        reverse(corners.begin(), corners.end());
+    }
+}
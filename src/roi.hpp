@@ -0,0 +1,97 @@
+/*! \file	roi.hpp
+ *  \brief	Header file for restricting the pattern search to regions of interest.
+ *
+ * Masks here mark the pixels that the MSER finder may use (non-zero) and those it should ignore (zero),
+ * and travel with each camera's mserParameterGroup. A mask can be drawn by hand, or learned from the
+ * temporal median of a sample of frames: anything that is both textured and static across the whole
+ * sample (rig hardware, text overlays, hot objects in thermal) is clutter rather than pattern.
+ *
+ * For thermal captures the heated board is by far the warmest large region, so the search can also be
+ * cropped to a padded box around it, with the corners found mapped back to full-frame co-ordinates.
+ *
+ * In multi-camera runs, a provisional rig estimate lets camera 0's detection be projected into the other
+ * cameras, so that they only search a padded box around where the board should appear.
+ */
+
+#ifndef ROI_HPP
+#define ROI_HPP
+
+#include "calibration.hpp"
+
+using namespace std;
+using namespace cv;
+
+#define DEFAULT_BACKGROUND_SAMPLE_SIZE      30
+#define DEFAULT_BACKGROUND_THRESHOLD        20      // grey levels a pixel may wander and still count as static
+#define DEFAULT_BACKGROUND_EDGE_THRESHOLD   40      // gradient magnitude at which static background counts as clutter
+#define DEFAULT_BACKGROUND_MARGIN           5       // pixels of clearance kept around learned clutter
+
+#define DEFAULT_THERMAL_PADDING             0.15    // crop padding on each side, as a fraction of the warm region's size
+#define THERMAL_WARM_PERCENTILE             0.98    // intensity percentile taken as "hot"
+#define THERMAL_MIN_REGION_FRACTION         0.01    // warm regions smaller than this fraction of the frame are ignored
+#define THERMAL_WORKING_WIDTH               320     // frames are localized at (at most) this width
+
+#define DEFAULT_PREDICTION_PADDING          0.25    // crop padding on each side, as a fraction of the predicted board's size
+#define PREDICTION_MIN_VISIBLE_FRACTION     0.9     // fraction of predicted corners that must land in frame to trust the prediction
+
+/// \brief      Provisional rig geometry, used to predict where the board appears in cameras 1..N from camera 0
+struct rigEstimate {
+    int numCams;
+    Mat cameraMatrix[MAX_CAMS];
+    Mat distCoeffs[MAX_CAMS];
+    /// \brief		Rotation and translation from camera 0 to each camera (as from stereoCalibrate)
+    Mat R[MAX_CAMS];
+    Mat T[MAX_CAMS];
+    bool valid;
+
+    /// \brief 		Default Constructor.
+    rigEstimate();
+};
+
+/// \brief      Loads a hand-drawn mask image (non-zero = usable), resized to the frame size if necessary
+bool loadROIMask(const char *filename, Size imageSize, Mat& mask);
+
+/// \brief      Per-pixel temporal median of a set of frames, as a greyscale image
+void temporalMedian(const vector<Mat>& frames, Mat& median);
+
+/// \brief      Learns a mask that excludes textured regions which stay static across all of the sampled frames
+void learnBackgroundMask(const vector<Mat>& frames,
+                         Mat& mask,
+                         int threshold = DEFAULT_BACKGROUND_THRESHOLD,
+                         int edgeThreshold = DEFAULT_BACKGROUND_EDGE_THRESHOLD,
+                         int margin = DEFAULT_BACKGROUND_MARGIN);
+
+/// \brief      Intersects a mask with another (an empty mask allows everything)
+void combineROIMasks(Mat& mask, const Mat& other);
+
+/// \brief      Fraction of the frame that a mask leaves usable
+double maskCoverage(const Mat& mask);
+
+/// \brief      Finds a padded box around the largest warm region of a thermal frame
+/// \return     False (leaving region as the whole frame) if no sufficiently large warm region was found
+bool localizeWarmRegion(const Mat& image, Rect& region, double padding = DEFAULT_THERMAL_PADDING);
+
+/// \brief      Shifts points found within a crop back into full-frame co-ordinates
+void offsetPoints(vector<Point2f>& points, Point offset);
+
+/// \brief      Mean position of a set of points
+Point2f pointSetCentroid(const vector<Point2f>& points);
+
+/// \brief      Loads a rig estimate from an extrinsics file written by a previous run (cameraMatrixN, distCoeffsN, RN, TN)
+bool loadRigEstimate(const char *filename, int numCams, rigEstimate& rig);
+
+/// \brief      Projects the board found by camera 0 into another camera, giving the predicted corners and a padded search box
+/// \return     False (leaving region as the whole frame) if the board is not expected to be fully visible in that camera
+bool predictPatternRegion(const rigEstimate& rig,
+                          int camera,
+                          const vector<Point3f>& objectPoints,
+                          const vector<Point2f>& referenceCorners,
+                          Size imageSize,
+                          vector<Point2f>& predictedCorners,
+                          Rect& region,
+                          double padding = DEFAULT_PREDICTION_PADDING);
+
+/// \brief      Reverses the corner order if that agrees better with the predicted corners (keeps cameras' orderings consistent)
+void alignToPrediction(vector<Point2f>& corners, const vector<Point2f>& predictedCorners);
+
+#endif
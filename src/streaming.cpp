@@ -0,0 +1,298 @@
+#include "streaming.hpp"
+
+parallelRemap::parallelRemap(const Mat& src, Mat& dst, const Mat& map1, const Mat& map2, int stripes) :
+    source(src),
+    destination(dst),
+    xyMap(map1),
+    interpolationMap(map2),
+    stripeCount(stripes)
+{
+}
+
+void parallelRemap::operator()(const Range& range) const
+{
+    for (int iii = range.start; iii < range.end; iii++)
+    {
+        int firstRow = (iii * destination.rows) / stripeCount;
+        int lastRow = ((iii + 1) * destination.rows) / stripeCount;
+
+        if (lastRow <= firstRow)
+        {
+            continue;
+        }
+
+        // The destination stripe is a view into the full frame, so remap() fills it in place
+        Mat destinationStripe = destination.rowRange(firstRow, lastRow);
+        Mat interpolationStripe;
+
+        if (!interpolationMap.empty())
+        {
+            interpolationStripe = interpolationMap.rowRange(firstRow, lastRow);
+        }
+
+        remap(source, destinationStripe, xyMap.rowRange(firstRow, lastRow), interpolationStripe, INTER_LINEAR);
+    }
+}
+
+void remapInParallel(const Mat& src, Mat& dst, const Mat& map1, const Mat& map2)
+{
+    dst.create(map1.size(), src.type());
+
+    int stripes = min(max(getNumThreads(), 1) * 4, max(dst.rows, 1));
+
+    parallel_for_(Range(0, stripes), parallelRemap(src, dst, map1, map2, stripes));
+}
+
+asyncImageWriter::asyncImageWriter(int threadCount, unsigned int queueLength, const vector<int>& params) :
+    requests(queueLength),
+    encoderParams(params),
+    failureCount(0),
+    finished(false)
+{
+    for (int iii = 0; iii < max(threadCount, 1); iii++)
+    {
+        writers.create_thread(boost::bind(&asyncImageWriter::writerLoop, this));
+    }
+}
+
+asyncImageWriter::~asyncImageWriter()
+{
+    finish();
+}
+
+bool asyncImageWriter::enqueue(const string& filename, const Mat& image)
+{
+    writeRequest request;
+    request.filename = filename;
+    request.image = image;
+
+    return requests.push(request);
+}
+
+void asyncImageWriter::finish()
+{
+    if (finished)
+    {
+        return;
+    }
+
+    requests.close();
+    writers.join_all();
+
+    finished = true;
+}
+
+int asyncImageWriter::failures()
+{
+    boost::mutex::scoped_lock lock(failureMutex);
+    return failureCount;
+}
+
+void asyncImageWriter::writerLoop()
+{
+    writeRequest request;
+
+    while (requests.pop(request))
+    {
+        bool written = false;
+
+        try
+        {
+            written = imwrite(request.filename, request.image, encoderParams);
+        }
+        catch (cv::Exception& e)
+        {
+            written = false;
+        }
+
+        if (!written)
+        {
+            printf("%s << ERROR. Failed to write (%s).\n", __FUNCTION__, request.filename.c_str());
+
+            boost::mutex::scoped_lock lock(failureMutex);
+            failureCount++;
+        }
+    }
+}
+
+void buildEncoderParameters(const char *format, int quality, vector<int>& params)
+{
+    params.clear();
+
+    if ((format == NULL) || (quality < 0))
+    {
+        return;
+    }
+
+    quality = min(quality, 100);
+
+    if (!strcmp(format, "jpg") || !strcmp(format, "jpeg"))
+    {
+        params.push_back(CV_IMWRITE_JPEG_QUALITY);
+        params.push_back(quality);
+    }
+    else if (!strcmp(format, "png"))
+    {
+        // Higher quality is taken to mean faster, lighter compression (PNG is lossless either way)
+        params.push_back(CV_IMWRITE_PNG_COMPRESSION);
+        params.push_back(9 - (quality * 9) / 100);
+    }
+    else if (!strcmp(format, "ppm") || !strcmp(format, "pgm") || !strcmp(format, "pbm"))
+    {
+        params.push_back(CV_IMWRITE_PXM_BINARY);
+        params.push_back(1);
+    }
+}
+
+string replaceExtension(const string& filename, const char *format)
+{
+    if ((format == NULL) || (strlen(format) == 0))
+    {
+        return filename;
+    }
+
+    size_t dotPosition = filename.find_last_of('.');
+    size_t slashPosition = filename.find_last_of("/\\");
+
+    if ((dotPosition == string::npos) || ((slashPosition != string::npos) && (dotPosition < slashPosition)))
+    {
+        return filename + "." + format;
+    }
+
+    return filename.substr(0, dotPosition + 1) + format;
+}
+
+static void decodeStage(VideoCapture *capture, boundedQueue<streamFrame> *outputQueue)
+{
+    int index = 0;
+
+    while (true)
+    {
+        streamFrame frame;
+
+        // A fresh Mat each time, so queued frames never share the decoder's buffer
+        if (!capture->read(frame.image) || frame.image.empty())
+        {
+            break;
+        }
+
+        frame.index = index++;
+
+        if (!outputQueue->push(frame))
+        {
+            break;
+        }
+    }
+
+    outputQueue->close();
+}
+
+static void encodeStage(VideoWriter *writer, boundedQueue<streamFrame> *inputQueue, int *framesWritten)
+{
+    streamFrame frame;
+
+    while (inputQueue->pop(frame))
+    {
+        writer->write(frame.image);
+        (*framesWritten)++;
+    }
+}
+
+int rectifyVideoStream(const char *inputFilename,
+                       const char *outputFilename,
+                       const Mat& map1,
+                       const Mat& map2,
+                       Rect cropRegion,
+                       double scaleFactor,
+                       bool wantsToDisplay,
+                       unsigned int queueLength)
+{
+    VideoCapture capture(inputFilename);
+
+    if (!capture.isOpened())
+    {
+        printf("%s << ERROR. Failed to open (%s).\n", __FUNCTION__, inputFilename);
+        return -1;
+    }
+
+    Rect fullRegion(0, 0, map1.cols, map1.rows);
+
+    if (cropRegion.area() == 0)
+    {
+        cropRegion = fullRegion;
+    }
+
+    cropRegion &= fullRegion;
+
+    Size outputSize(int(cropRegion.width * scaleFactor), int(cropRegion.height * scaleFactor));
+
+    double fps = capture.get(CV_CAP_PROP_FPS);
+
+    if (fps <= 0.0)
+    {
+        fps = DEFAULT_STREAM_FPS;
+    }
+
+    VideoWriter writer(outputFilename, DEFAULT_STREAM_FOURCC, fps, outputSize);
+
+    if (!writer.isOpened())
+    {
+        printf("%s << ERROR. Failed to open (%s) for writing.\n", __FUNCTION__, outputFilename);
+        return -1;
+    }
+
+    printf("%s << Streaming (%s) -> (%s) [%d x %d] at %f fps\n", __FUNCTION__, inputFilename, outputFilename, outputSize.width, outputSize.height, fps);
+
+    boundedQueue<streamFrame> decodedQueue(queueLength), rectifiedQueue(queueLength);
+
+    int framesWritten = 0;
+
+    boost::thread decodeThread(decodeStage, &capture, &decodedQueue);
+    boost::thread encodeThread(encodeStage, &writer, &rectifiedQueue, &framesWritten);
+
+    // The remap stage stays on the calling thread, which is also the only one allowed to touch HighGUI
+    streamFrame frame;
+    Mat remappedMat;
+
+    while (decodedQueue.pop(frame))
+    {
+        remapInParallel(frame.image, remappedMat, map1, map2);
+
+        streamFrame rectifiedFrame;
+        rectifiedFrame.index = frame.index;
+
+        if (scaleFactor != 1.0)
+        {
+            resize(remappedMat(cropRegion), rectifiedFrame.image, outputSize);
+        }
+        else
+        {
+            remappedMat(cropRegion).copyTo(rectifiedFrame.image);
+        }
+
+        if (wantsToDisplay)
+        {
+            imshow("undistortedWin", rectifiedFrame.image);
+            waitKey(1);
+        }
+
+        if (!rectifiedQueue.push(rectifiedFrame))
+        {
+            break;
+        }
+    }
+
+    // Unblocks the decoder if we stopped early, then lets the encoder drain what is left
+    decodedQueue.close();
+    rectifiedQueue.close();
+
+    decodeThread.join();
+    encodeThread.join();
+
+    writer.release();
+    capture.release();
+
+    printf("%s << Wrote %d frames.\n", __FUNCTION__, framesWritten);
+
+    return framesWritten;
+}
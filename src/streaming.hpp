@@ -0,0 +1,210 @@
+/*! \file	streaming.hpp
+ *  \brief	Header file for threaded frame streaming (video rectification pipeline, background image writing).
+ *
+ * Video is processed as a three stage pipeline: a decode thread, a remap stage (striped across cores
+ * with parallel_for_) and an encode thread, joined by bounded queues so that memory stays flat
+ * however long the capture is. Images that only need saving are handed to a small writer pool in the
+ * same way, so that encoding never stalls the caller.
+ */
+
+#ifndef STREAMING_HPP
+#define STREAMING_HPP
+
+#include "improc.h"
+
+#include "opencv2/highgui/highgui.hpp"
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include <deque>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+using namespace cv;
+
+#define DEFAULT_STREAM_QUEUE_LENGTH     8
+#define DEFAULT_STREAM_FPS              25.0
+#define DEFAULT_STREAM_FOURCC           CV_FOURCC('M', 'J', 'P', 'G')
+
+#define DEFAULT_WRITER_THREADS          2
+#define DEFAULT_WRITER_QUALITY          -1  // i.e. use the encoder's default
+
+/// \brief      Fixed capacity FIFO shared between pipeline threads
+template <typename T>
+class boundedQueue
+{
+public:
+    /// \brief 		Constructor with the maximum number of items the queue may hold.
+    boundedQueue(unsigned int maxLength = DEFAULT_STREAM_QUEUE_LENGTH) : capacity(max(maxLength, 1U)), closed(false) { }
+
+    /// \brief      Adds an item, blocking while the queue is full. Returns false if the queue has been closed.
+    bool push(const T& item)
+    {
+        boost::mutex::scoped_lock lock(queueMutex);
+
+        while ((items.size() >= capacity) && !closed)
+        {
+            notFull.wait(lock);
+        }
+
+        if (closed)
+        {
+            return false;
+        }
+
+        items.push_back(item);
+        notEmpty.notify_one();
+
+        return true;
+    }
+
+    /// \brief      Adds an item only if there is room for it now. Returns false if the queue is full or closed.
+    bool tryPush(const T& item)
+    {
+        boost::mutex::scoped_lock lock(queueMutex);
+
+        if (closed || (items.size() >= capacity))
+        {
+            return false;
+        }
+
+        items.push_back(item);
+        notEmpty.notify_one();
+
+        return true;
+    }
+
+    /// \brief      Removes the oldest item, blocking while the queue is empty. Returns false once closed and drained.
+    bool pop(T& item)
+    {
+        boost::mutex::scoped_lock lock(queueMutex);
+
+        while (items.empty() && !closed)
+        {
+            notEmpty.wait(lock);
+        }
+
+        if (items.empty())
+        {
+            return false;
+        }
+
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+
+        return true;
+    }
+
+    /// \brief      Signals that no more items will be pushed, waking any waiting threads
+    void close()
+    {
+        boost::mutex::scoped_lock lock(queueMutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    /// \brief      Current number of queued items
+    unsigned int size()
+    {
+        boost::mutex::scoped_lock lock(queueMutex);
+        return (unsigned int) items.size();
+    }
+
+private:
+    unsigned int capacity;
+    bool closed;
+    deque<T> items;
+    boost::mutex queueMutex;
+    boost::condition_variable notEmpty, notFull;
+};
+
+/// \brief      A decoded frame travelling through a pipeline
+struct streamFrame {
+    /// \brief		Position of the frame within the input stream
+    int index;
+    /// \brief		Frame data (each frame owns its own buffer)
+    Mat image;
+};
+
+/// \brief      Remaps an image in horizontal stripes, one stripe per task
+class parallelRemap : public ParallelLoopBody
+{
+public:
+    /// \brief 		Constructor from source, destination (already allocated to the map size) and fixed-point maps.
+    parallelRemap(const Mat& src, Mat& dst, const Mat& map1, const Mat& map2, int stripes);
+
+    void operator()(const Range& range) const;
+
+private:
+    const Mat& source;
+    Mat& destination;
+    const Mat& xyMap;
+    const Mat& interpolationMap;
+    int stripeCount;
+};
+
+/// \brief      An image waiting to be encoded and written to disk
+struct writeRequest {
+    /// \brief		Destination path (the extension selects the encoder)
+    string filename;
+    /// \brief		Image data (must not be modified by the caller once queued)
+    Mat image;
+};
+
+/// \brief      Pool of background threads that encode and write queued images
+class asyncImageWriter
+{
+public:
+    /// \brief 		Constructor with the number of writer threads, queue capacity and imwrite() encoder parameters.
+    asyncImageWriter(int threadCount = DEFAULT_WRITER_THREADS,
+                     unsigned int queueLength = DEFAULT_STREAM_QUEUE_LENGTH,
+                     const vector<int>& params = vector<int>());
+
+    /// \brief 		Destructor (flushes anything still queued).
+    ~asyncImageWriter();
+
+    /// \brief      Queues an image for writing, blocking only if the queue is full
+    bool enqueue(const string& filename, const Mat& image);
+
+    /// \brief      Writes everything still queued and stops the writer threads
+    void finish();
+
+    /// \brief      Number of images that failed to write
+    int failures();
+
+private:
+    void writerLoop();
+
+    boundedQueue<writeRequest> requests;
+    boost::thread_group writers;
+    vector<int> encoderParams;
+    boost::mutex failureMutex;
+    int failureCount;
+    bool finished;
+};
+
+/// \brief      Builds imwrite() parameters from an image format ("jpg", "png", ...) and quality (0 - 100)
+void buildEncoderParameters(const char *format, int quality, vector<int>& params);
+
+/// \brief      Replaces the extension of a filename with the given format (leaves it untouched if format is empty)
+string replaceExtension(const string& filename, const char *format);
+
+/// \brief      Remaps a full frame using all available cores
+void remapInParallel(const Mat& src, Mat& dst, const Mat& map1, const Mat& map2);
+
+/// \brief      Rectifies a whole video (decode -> parallel remap -> encode), optionally cropping and rescaling each frame
+/// \return     Number of frames written, or -1 if the input or output could not be opened
+int rectifyVideoStream(const char *inputFilename,
+                       const char *outputFilename,
+                       const Mat& map1,
+                       const Mat& map2,
+                       Rect cropRegion = Rect(),
+                       double scaleFactor = 1.0,
+                       bool wantsToDisplay = false,
+                       unsigned int queueLength = DEFAULT_STREAM_QUEUE_LENGTH);
+
+#endif
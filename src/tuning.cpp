@@ -0,0 +1,358 @@
+#include "tuning.hpp"
+
+// Values each tuned parameter may take; the search steps between neighbouring entries
+static const double deltaLadder[] = { 3.0, 5.0, 7.5, 10.0, 12.5, 15.0, 20.0 };
+static const double maxVariationLadder[] = { 0.10, 0.15, 0.20, 0.25, 0.35, 0.50, 0.75 };
+static const double minDiversityLadder[] = { 0.05, 0.10, 0.15, 0.20, 0.30, 0.50 };
+static const double edgeBlurLadder[] = { 1, 3, 5, 7, 9 };
+
+#define TUNED_PARAMETER_COUNT 4
+
+mserTuningResult::mserTuningResult() :
+    detections(0),
+    frames(0),
+    meanTime(0.0),
+    score(-1.0)
+{
+}
+
+/// \brief      Searches (frame, candidate) pairs, each task writing only to its own slot
+class parallelMSERevaluation : public ParallelLoopBody
+{
+public:
+    parallelMSERevaluation(const vector<Mat>& frames, Size patternSize, const vector<mserParameterGroup>& candidates, double correctionFactor, vector<int>& found, vector<double>& times) :
+        greyFrames(frames),
+        cornersSize(2 * patternSize.width, 2 * patternSize.height),
+        candidateParams(candidates),
+        correction(correctionFactor),
+        foundFlags(found),
+        searchTimes(times)
+    {
+    }
+
+    void operator()(const Range& range) const
+    {
+        for (int iii = range.start; iii < range.end; iii++)
+        {
+            int candidate = iii / (int) greyFrames.size();
+            int frame = iii % (int) greyFrames.size();
+
+            vector<Point2f> corners;
+
+            int64 searchStart = getTickCount();
+            bool found = findPatternCorners(greyFrames.at(frame), cornersSize, corners, 1, candidateParams.at(candidate), correction, PATTERN_FINDER_CV_CORNER_SUBPIX_FLAG);
+
+            foundFlags[iii] = found ? 1 : 0;
+            searchTimes[iii] = elapsedMS(searchStart);
+        }
+    }
+
+private:
+    const vector<Mat>& greyFrames;
+    Size cornersSize;
+    const vector<mserParameterGroup>& candidateParams;
+    double correction;
+    vector<int>& foundFlags;
+    vector<double>& searchTimes;
+};
+
+int sampleFramesFromList(const char *folder, const vector<string>& filenames, int count, vector<Mat>& frames)
+{
+    frames.clear();
+
+    if ((count <= 0) || (filenames.size() == 0))
+    {
+        return 0;
+    }
+
+    count = min(count, (int) filenames.size());
+
+    char filename[256];
+
+    for (int iii = 0; iii < count; iii++)
+    {
+        sprintf(filename, "%s%s", folder, filenames.at((iii * filenames.size()) / count).c_str());
+
+        Mat frame = imread(filename);
+
+        if (!frame.empty())
+        {
+            frames.push_back(frame);
+        }
+    }
+
+    return (int) frames.size();
+}
+
+int sampleFramesFromVideo(const char *filename, int frameCount, int count, vector<Mat>& frames)
+{
+    frames.clear();
+
+    VideoCapture capture(filename);
+
+    if (!capture.isOpened() || (count <= 0))
+    {
+        return 0;
+    }
+
+    int stride = max(frameCount / count, 1);
+
+    Mat frame;
+
+    // Read straight through rather than seeking, since seeking is unreliable for many codecs
+    for (int iii = 0; (int) frames.size() < count; iii++)
+    {
+        if (!capture.read(frame) || frame.empty())
+        {
+            break;
+        }
+
+        if (iii % stride == 0)
+        {
+            frames.push_back(frame.clone());
+        }
+    }
+
+    capture.release();
+
+    return (int) frames.size();
+}
+
+void evaluateMSERcandidates(const vector<Mat>& greyFrames,
+                            Size patternSize,
+                            const vector<mserParameterGroup>& candidates,
+                            double correctionFactor,
+                            vector<mserTuningResult>& results,
+                            double timeWeight)
+{
+    int taskCount = (int) (greyFrames.size() * candidates.size());
+
+    vector<int> found(taskCount, 0);
+    vector<double> times(taskCount, 0.0);
+
+    parallel_for_(Range(0, taskCount), parallelMSERevaluation(greyFrames, patternSize, candidates, correctionFactor, found, times));
+
+    results.resize(candidates.size());
+
+    for (unsigned int iii = 0; iii < candidates.size(); iii++)
+    {
+        mserTuningResult& result = results.at(iii);
+
+        result = mserTuningResult();
+        result.params = candidates.at(iii);
+        result.frames = (int) greyFrames.size();
+
+        double totalTime = 0.0;
+
+        for (unsigned int jjj = 0; jjj < greyFrames.size(); jjj++)
+        {
+            result.detections += found[iii * greyFrames.size() + jjj];
+            totalTime += times[iii * greyFrames.size() + jjj];
+        }
+
+        if (result.frames > 0)
+        {
+            result.meanTime = totalTime / result.frames;
+            result.score = double(result.detections) / result.frames - timeWeight * (result.meanTime / 1000.0);
+        }
+    }
+}
+
+static int ladderLength(int parameter)
+{
+    switch (parameter)
+    {
+    case 0:
+        return sizeof(deltaLadder) / sizeof(double);
+    case 1:
+        return sizeof(maxVariationLadder) / sizeof(double);
+    case 2:
+        return sizeof(minDiversityLadder) / sizeof(double);
+    default:
+        return sizeof(edgeBlurLadder) / sizeof(double);
+    }
+}
+
+static double ladderValue(int parameter, int position)
+{
+    switch (parameter)
+    {
+    case 0:
+        return deltaLadder[position];
+    case 1:
+        return maxVariationLadder[position];
+    case 2:
+        return minDiversityLadder[position];
+    default:
+        return edgeBlurLadder[position];
+    }
+}
+
+static double getTunedParameter(const mserParameterGroup& mserParams, int parameter)
+{
+    switch (parameter)
+    {
+    case 0:
+        return mserParams.delta;
+    case 1:
+        return mserParams.max_variation;
+    case 2:
+        return mserParams.min_diversity;
+    default:
+        return mserParams.edge_blur_size;
+    }
+}
+
+static void setTunedParameter(mserParameterGroup& mserParams, int parameter, double value)
+{
+    switch (parameter)
+    {
+    case 0:
+        mserParams.delta = value;
+        break;
+    case 1:
+        mserParams.max_variation = value;
+        break;
+    case 2:
+        mserParams.min_diversity = value;
+        break;
+    default:
+        mserParams.edge_blur_size = int(value);
+        break;
+    }
+}
+
+/// \brief      Position on a parameter's ladder closest to its current value
+static int nearestLadderPosition(int parameter, double value)
+{
+    int nearest = 0;
+
+    for (int iii = 1; iii < ladderLength(parameter); iii++)
+    {
+        if (fabs(ladderValue(parameter, iii) - value) < fabs(ladderValue(parameter, nearest) - value))
+        {
+            nearest = iii;
+        }
+    }
+
+    return nearest;
+}
+
+mserTuningResult tuneMSERparameters(const vector<Mat>& frames,
+                                    Size patternSize,
+                                    mserParameterGroup initialParams,
+                                    double correctionFactor,
+                                    int maxRounds)
+{
+    // Convert once up front, as findMaskCorners_1 would for every search
+    vector<Mat> greyFrames(frames.size());
+
+    for (unsigned int iii = 0; iii < frames.size(); iii++)
+    {
+        if (frames.at(iii).channels() > 1)
+        {
+            cvtColor(frames.at(iii), greyFrames.at(iii), CV_RGB2GRAY);
+        }
+        else
+        {
+            greyFrames.at(iii) = frames.at(iii);
+        }
+    }
+
+    vector<mserParameterGroup> candidates(1, initialParams);
+    vector<mserTuningResult> results;
+
+    evaluateMSERcandidates(greyFrames, patternSize, candidates, correctionFactor, results);
+
+    mserTuningResult best = results.at(0);
+
+    printf("%s << Initial: %d / %d detected, %.1f ms per frame (score = %f)\n", __FUNCTION__, best.detections, best.frames, best.meanTime, best.score);
+
+    for (int round = 0; round < maxRounds; round++)
+    {
+        // Every single-step move of every parameter is searched as one parallel batch
+        candidates.clear();
+
+        for (int parameter = 0; parameter < TUNED_PARAMETER_COUNT; parameter++)
+        {
+            int position = nearestLadderPosition(parameter, getTunedParameter(best.params, parameter));
+
+            for (int step = -1; step <= 1; step++)
+            {
+                int neighbour = position + step;
+
+                if ((neighbour < 0) || (neighbour >= ladderLength(parameter)))
+                {
+                    continue;
+                }
+
+                // The ladder value itself is a move too if the starting value was off the ladder
+                if ((step == 0) && (ladderValue(parameter, neighbour) == getTunedParameter(best.params, parameter)))
+                {
+                    continue;
+                }
+
+                mserParameterGroup candidate = best.params;
+                setTunedParameter(candidate, parameter, ladderValue(parameter, neighbour));
+                candidates.push_back(candidate);
+            }
+        }
+
+        evaluateMSERcandidates(greyFrames, patternSize, candidates, correctionFactor, results);
+
+        int bestIndex = -1;
+
+        for (unsigned int iii = 0; iii < results.size(); iii++)
+        {
+            if (results.at(iii).score > ((bestIndex < 0) ? best.score : results.at(bestIndex).score))
+            {
+                bestIndex = iii;
+            }
+        }
+
+        if (bestIndex < 0)
+        {
+            printf("%s << Round %d: no improvement over %d candidates, stopping.\n", __FUNCTION__, round + 1, (int) candidates.size());
+            break;
+        }
+
+        best = results.at(bestIndex);
+
+        printf("%s << Round %d: delta = %.2f, max_variation = %.2f, min_diversity = %.2f, edge_blur_size = %d -> %d / %d detected, %.1f ms per frame (score = %f)\n",
+               __FUNCTION__,
+               round + 1,
+               best.params.delta,
+               best.params.max_variation,
+               best.params.min_diversity,
+               best.params.edge_blur_size,
+               best.detections,
+               best.frames,
+               best.meanTime,
+               best.score);
+    }
+
+    return best;
+}
+
+bool writeMSERparameters(const char *filename, const mserParameterGroup& mserParams)
+{
+    ofstream file_io(filename);
+
+    if (!file_io.is_open())
+    {
+        printf("%s << ERROR. Could not open (%s) for writing.\n", __FUNCTION__, filename);
+        return false;
+    }
+
+    file_io << mserParams.delta << endl;
+    file_io << mserParams.max_variation << endl;
+    file_io << mserParams.min_diversity << endl;
+    file_io << mserParams.max_evolution << endl;
+    file_io << mserParams.area_threshold << endl;
+    file_io << mserParams.min_margin << endl;
+    file_io << mserParams.edge_blur_size << endl;
+
+    file_io.close();
+
+    return true;
+}
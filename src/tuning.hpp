@@ -0,0 +1,63 @@
+/*! \file	tuning.hpp
+ *  \brief	Header file for automatic tuning of the MSER pattern finder parameters.
+ *
+ * A small sample of frames is searched with many candidate parameter groups at once (every frame and
+ * candidate pair is an independent task for parallel_for_). The search moves one parameter at a time
+ * along a ladder of sensible values, keeping whichever move best trades detection rate against time
+ * per frame, until no move improves on the current parameters.
+ */
+
+#ifndef TUNING_HPP
+#define TUNING_HPP
+
+#include "calibration.hpp"
+
+#include <fstream>
+
+using namespace std;
+using namespace cv;
+
+#define DEFAULT_TUNING_SAMPLE_SIZE      20
+#define DEFAULT_TUNING_ROUNDS           8
+#define DEFAULT_TUNING_TIME_WEIGHT      0.5     // detection rate given up for each second saved per frame
+
+/// \brief      How a parameter group performed on the tuning sample
+struct mserTuningResult {
+    mserParameterGroup params;
+    int detections;
+    int frames;
+    /// \brief		Mean search time per frame in ms
+    double meanTime;
+    /// \brief		Detection rate less the time penalty (higher is better)
+    double score;
+
+    /// \brief 		Default Constructor.
+    mserTuningResult();
+};
+
+/// \brief      Reads an evenly spaced sample of images from a folder
+int sampleFramesFromList(const char *folder, const vector<string>& filenames, int count, vector<Mat>& frames);
+
+/// \brief      Reads an evenly spaced sample of frames from a video
+int sampleFramesFromVideo(const char *filename, int frameCount, int count, vector<Mat>& frames);
+
+/// \brief      Searches every sample frame with every candidate parameter group in parallel
+void evaluateMSERcandidates(const vector<Mat>& greyFrames,
+                            Size patternSize,
+                            const vector<mserParameterGroup>& candidates,
+                            double correctionFactor,
+                            vector<mserTuningResult>& results,
+                            double timeWeight = DEFAULT_TUNING_TIME_WEIGHT);
+
+/// \brief      Adaptive search over delta, max_variation, min_diversity and edge_blur_size, starting from the given parameters
+/// \param      patternSize     Pattern size in squares, as passed to findMaskCorners_1
+mserTuningResult tuneMSERparameters(const vector<Mat>& frames,
+                                    Size patternSize,
+                                    mserParameterGroup initialParams,
+                                    double correctionFactor,
+                                    int maxRounds = DEFAULT_TUNING_ROUNDS);
+
+/// \brief      Writes parameters in the format read by obtainMSERparameters (see cfg/mser_parameters_sample.txt)
+bool writeMSERparameters(const char *filename, const mserParameterGroup& mserParams);
+
+#endif